@@ -11,13 +11,15 @@
 #include <stdbool.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-#define MAX_MUTEXES 20
-#define MAX_CLIENTS 20
 #define BUFFER_SIZE 2048
 #define SERVER_PORT 8080
+#define SERVER_SOCKET_PATH "/tmp/mutex_server.sock"  // Unix-domain listener for local clients
 #define MAX_MUTEX_NAME 64
 #define MAX_MSG_SIZE 1024
+#define MUTEX_MESSAGE_RING 16   // Messages kept per mutex (power of two)
 
 
 typedef enum {
@@ -29,27 +31,98 @@ typedef enum {
     CMD_DELETE,
     CMD_SEND,
     CMD_EXIT,
+    CMD_HELLO,
+    CMD_BATCH,
+    CMD_RENEW,
+    CMD_LOCK_SHARED,
+    CMD_LOCK_ALL,
+    CMD_ATTACH,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_MESSAGE,        // Pushed to subscribers, never sent by clients
+    CMD_OPEN,
     CMD_INVALID
 } CommandType;
 
+struct MutexWaiter;
+struct MutexMessage;
+struct MutexSubscriber;
+struct ShmSlot;
+
+// A client holding a mutex in shared mode
+typedef struct {
+    int pid;
+    uint64_t owner_token;
+    uint64_t acquired_ns;   // Monotonic time of the grant
+} SharedHolder;
+
+// Mutex.state packs the owner PID (low 32 bits: the creator, then the last client to
+// acquire it) with the lock flags, so that uncontended locks and unlocks are one CAS
+#define MUTEX_STATE_LOCKED (1ull << 32)   // Held in either mode
+#define MUTEX_STATE_BUSY   (1ull << 33)   // A lock-free lock or unlock is updating the entry
+
+// What a mutex needs once it has had a waiter, a shared holder, a lock word, a message
+// or a subscriber. Allocated the first time, kept until the mutex is deleted.
+typedef struct {
+    SharedHolder* readers;  // Shared-mode holders, Mutex.reader_count of them
+    int reader_cap;
+    struct MutexWaiter* wait_head;  // FIFO of clients blocked in a LOCK on this mutex
+    struct MutexWaiter* wait_tail;
+    struct ShmSlot* shm;    // Lock word of a fast mutex in the shared-memory table, else NULL
+    struct MutexMessage** messages;     // Ring of the last MUTEX_MESSAGE_RING, NULL until the first
+    struct MutexMessage* last_message;  // Newest message, also in the ring; NULL = none
+    struct MutexSubscriber* subscribers;
+} MutexExtra;
+
+// Name and counters of a mutex, allocated with it to fit the name
+typedef struct {
+    uint64_t acquires;      // Holds granted by the server
+    _Atomic uint64_t contentions;   // Lock attempts that found it held (failed or waited)
+    MutexExtra* extra;      // NULL = none needed yet
+    char name[];
+} MutexCold;
+
+// A registry slot: the lock state, one cache line per mutex (slots are 64-byte aligned)
 typedef struct {
-    char name[MAX_MUTEX_NAME];
-    int owner_pid;
-    bool is_locked;
+    _Atomic uint64_t state; // Owner PID and lock flags, read with mutex_owner / mutex_locked
+    _Atomic uint64_t owner_token;   // Session that acquired the lock, 0 = none (see mutex_release_token)
     time_t lock_time;
-    char last_message[MAX_MSG_SIZE];  
-    time_t last_message_time;         
+    uint64_t acquired_ns;   // Monotonic time the server granted the exclusive hold, 0 = unknown
+    uint64_t changed_gen;   // Registry generation of its last change (see mutex_generation)
+    MutexCold* cold;        // Name and the rest, NULL = free slot
+    uint32_t hash;          // Cached hash of name (registry index)
+    uint32_t incarnation;   // Of the slot: changes when its mutex is deleted (see MutexHandle)
+    int next;               // Next slot in the same hash bucket or free list, -1 = end
+    int reader_count;       // Shared-mode holders; > 0 means the lock is shared
 } Mutex;
 
-typedef struct {
-    CommandType type;
-    char mutex_name[MAX_MUTEX_NAME];
-    char message[MAX_MSG_SIZE];
-    int client_pid;
-} ClientCommand;
-
-extern Mutex mutexes[MAX_MUTEXES];
-extern pthread_mutex_t global_mutex_lock;
-extern int mutex_count;
+static inline int mutex_owner(const Mutex* m) {
+    return (int)(uint32_t)atomic_load(&m->state);
+}
+
+static inline bool mutex_locked(const Mutex* m) {
+    return (atomic_load(&m->state) & MUTEX_STATE_LOCKED) != 0;
+}
+
+static inline const char* mutex_name(const Mutex* m) {
+    return m->cold->name;
+}
+
+static inline struct MutexMessage* mutex_last_message(const Mutex* m) {
+    return m->cold->extra ? m->cold->extra->last_message : NULL;
+}
+
+// FNV-1a hash of a mutex name. The registry and the shared-memory table (probed by
+// clients too) both use this one, so they agree on it.
+static inline uint32_t mutex_name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+extern _Atomic int mutex_count;
 
 #endif 
\ No newline at end of file
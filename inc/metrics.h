@@ -0,0 +1,33 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include "protocol.h"
+#include <stdatomic.h>
+
+// Latency histograms for GET /metrics (Prometheus text format). Observing a value is a
+// few relaxed atomic adds, so any thread can record without taking a lock.
+
+#define HISTOGRAM_BUCKETS 10    // Upper bounds from 1 us to 100 s, plus +Inf
+
+typedef struct {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS + 1];   // Not cumulative; last = +Inf
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t count;
+} Histogram;
+
+uint64_t monotonic_ns();
+void histogram_observe(Histogram* h, uint64_t ns);
+
+// Append h as metric `name` (in seconds), with optional labels such as `mode="shared"`
+// (NULL = none). HELP and TYPE lines are written only when help is not NULL.
+void histogram_format(Buffer* out, const char* name, const char* help, const char* labels,
+                      Histogram* h);
+
+// Append printf-formatted text to out (truncated at 512 bytes)
+void metrics_printf(Buffer* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Escape a label value: backslash, double quote and newline
+void metrics_label_escape(char* out, size_t size, const char* value);
+
+#endif
@@ -2,18 +2,151 @@
 #define MUTEX_H
 
 #include "common.h"
+#include "metrics.h"
+#include "protocol.h"
+
+// A client parked in a mutex's FIFO wait queue by mutex_lock_wait.
+// wake() is called exactly once, outside any registry lock, with status set to
+// 0 (lock granted) or a negative error code (-4: mutex deleted while waiting,
+// -5: out of memory, -6: aborted to break a deadlock).
+typedef struct MutexWaiter {
+    int client_pid;
+    uint64_t owner_token;   // Recorded as the mutex's owner_token when granted
+    bool shared;            // Waiting for a shared (read) hold
+    char name[MAX_MUTEX_NAME];
+    MutexHandle handle;     // Set by mutex_lock_wait_handle, else 0
+    int status;
+    void (*wake)(struct MutexWaiter* w);
+    void* ctx;
+
+    // Registry bookkeeping, owned by mutex.c
+    _Atomic int state;
+    _Atomic(void*) stripe;
+    Mutex* mutex;
+    struct MutexWaiter* prev;
+    struct MutexWaiter* next;
+
+    // Wait-for graph bookkeeping (deadlock detection)
+    bool in_graph;
+    uint64_t park_seq;
+    uint64_t park_ns;       // Monotonic time it was parked (wait time histogram)
+    struct MutexWaiter* graph_prev;
+    struct MutexWaiter* graph_next;
+} MutexWaiter;
+
+#define MUTEX_MAX_LOCK_ALL 64   // Names per mutex_lock_all call
+
+// A message sent through a mutex. Its CMD_MESSAGE frame is encoded once, when it is
+// sent: the mutex's ring and every connection the frame is queued on hold a reference
+// (frame.refs). Nothing changes once subscribers have it.
+typedef struct MutexMessage {
+    SharedBuf frame;        // First, so releasing the frame frees the message
+    uint64_t seq;           // 1, 2, ... per mutex; 0 = the mutex was deleted (NOT_FOUND frame)
+    uint64_t lsn;           // Its log record, 0 if there is no log
+    int pid;
+    time_t time;
+    const char* text;       // NUL-terminated, the end of the frame
+} MutexMessage;
+
+// Subscription to the messages of a mutex. deliver runs on the thread that stored the
+// message, with the mutex's stripe locked, so messages arrive in seq order; it must not
+// call back into the registry, and keeps msg past the call with shared_retain(&msg->frame).
+// Deleting the mutex delivers a last message with seq 0 and ends the subscription.
+typedef struct MutexSubscriber {
+    void (*deliver)(struct MutexSubscriber* s, MutexMessage* msg);
+    void* ctx;
+    struct MutexSubscriber* next;   // Registry bookkeeping
+} MutexSubscriber;
+
+// Holds granted and released through the server, by mode (0 exclusive, 1 shared), and
+// time from parking in a wait queue until the mutex is handed over
+extern Histogram mutex_hold_time[2];
+extern Histogram mutex_wait_time;
+
+// Registry changes reported to the observer (see mutex_set_observer)
+typedef enum {
+    MUTEX_EVENT_CREATE,
+    MUTEX_EVENT_DELETE,
+    MUTEX_EVENT_LOCK,       // client_pid acquired m (either mode)
+    MUTEX_EVENT_UNLOCK,     // client_pid gave up its hold on m
+    MUTEX_EVENT_SEND        // client_pid added mutex_last_message(m)
+} MutexEvent;
+
+// Called on the thread that made the change, with the mutex's stripe locked (or, for a
+// lock-free lock or unlock, read-locked with the entry claimed), so the events of one
+// mutex arrive in order and m shows the state right after the change.
+// The observer must not call back into the registry.
+typedef void (*mutex_observer)(MutexEvent event, const Mutex* m, int client_pid);
 
 // Server-side API
 void mutex_init();
 int mutex_create(const char* name, int client_pid);
-int mutex_lock(const char* name, int client_pid);
+int mutex_create_fast(const char* name, int client_pid);
+int mutex_lock(const char* name, int client_pid, uint64_t owner_token);
+int mutex_lock_shared(const char* name, int client_pid, uint64_t owner_token);
+int mutex_lock_all(const char* const* names, const bool* shared, int count,
+                   int client_pid, uint64_t owner_token, int* failed);
+int mutex_lock_wait(const char* name, int client_pid, MutexWaiter* w);
+int mutex_lock_wait_handle(MutexHandle handle, int client_pid, MutexWaiter* w);
+bool mutex_cancel_wait(MutexWaiter* w);
 int mutex_unlock(const char* name, int client_pid);
+int mutex_release_token(const char* name, uint64_t owner_token);
+bool mutex_held_by(const char* name, uint64_t owner_token);
 int mutex_delete(const char* name, int client_pid);
-void mutex_list(char* buffer, size_t buf_size);
+size_t mutex_list(char* buffer, size_t buf_size);  // Size that fits it all; ends with a note if cut
+void mutex_foreach(void (*fn)(const Mutex* m, void* ctx), void* ctx);  // fn gets copies, no lock held
+
+// Registry generation: every change (MutexEvent) takes the next number. Mutexes and
+// deletions are visited if their change is newer than `since`; every change up to a
+// generation read before the call is included. mutex_foreach_deleted returns false if
+// the deletion log no longer reaches back to `since` (the caller needs a full list).
+// Fast mutexes can change hands through their lock words without a new generation
+// until the server looks at them, which mutex_foreach_since does.
+uint64_t mutex_generation();
+bool mutex_has_fast();
+void mutex_foreach_since(uint64_t since, void (*fn)(const Mutex* m, void* ctx), void* ctx);
+bool mutex_foreach_deleted(uint64_t since, void (*fn)(const char* name, void* ctx), void* ctx);
 int mutex_send(const char* name, int client_pid, const char* message, 
                char* response, size_t resp_size, char* welcome_msg, size_t welcome_size);
 bool mutex_has_permission(const char* name, int client_pid);
 
+// Handles: a mutex's slot (stripe and index) and the slot's incarnation, which changes
+// when the mutex is deleted. The calls below find the mutex without hashing or comparing
+// its name; a handle of a deleted mutex, or of another registry, is not found (same
+// return codes as the calls by name). name, if not NULL, receives the mutex's name
+// (MAX_MUTEX_NAME bytes) when the handle is valid.
+int mutex_open(const char* name, MutexHandle* handle);      // 0, or -1 not found
+int mutex_lock_handle(MutexHandle handle, int client_pid, uint64_t owner_token, bool shared,
+                      char* name);
+int mutex_unlock_handle(MutexHandle handle, int client_pid, char* name);
+int mutex_delete_handle(MutexHandle handle, int client_pid, char* name);
+int mutex_send_handle(MutexHandle handle, int client_pid, const char* message,
+                      char* response, size_t resp_size, char* welcome_msg, size_t welcome_size);
+
+// Deliver the messages of name to s, starting with the kept ones numbered after `after`
+// (UINT64_MAX: none), and set *newest to the seq of its newest message (0 = none).
+// Returns 0, -1 (not found) or -2 (out of memory). Once mutex_unsubscribe returns (0, or -1 if s was not
+// subscribed to name), deliver is not running for s and is not called again.
+int mutex_subscribe(const char* name, MutexSubscriber* s, uint64_t after, uint64_t* newest);
+int mutex_unsubscribe(const char* name, MutexSubscriber* s);
+void mutex_set_observer(mutex_observer fn);    // Before any other thread uses the registry
+
+// Shared-memory fast path (see shmtable.h): map a table of `capacity` lock words and
+// serve handoffs to server-side waiters from a thread of its own. Returns 0 or -1.
+int mutex_shm_start(uint32_t capacity);
+void mutex_shm_stop();
+void mutex_release_pid(int client_pid);    // Client died: free the fast mutexes it holds
+
+// Durable registry (see wal.h): replay the log in dir (NULL = no files, the records only
+// feed replication), then log every change. Call after
+// mutex_init and mutex_shm_start, before serving clients. Returns the records replayed
+// or -1 (errno set). Restored holds belong to their PID only: no lease, no connection.
+int mutex_persist_open(const char* dir);
+
+// Mirror the registry of the primary at host:port as a backup (see repl.h). Call after
+// mutex_persist_open if there is a log. Returns 0, or -1 with errno set.
+int mutex_follow(const char* primary);
+
 // Client-side helpers
 CommandType parse_command(const char* cmd);
 void print_help();
@@ -0,0 +1,107 @@
+#ifndef MUTEXCLIENT_H
+#define MUTEXCLIENT_H
+
+#include "common.h"
+#include "protocol.h"
+
+// Client library for the mutex server (lib/libmutexclient.a).
+//
+// Every call takes a MutexClient from mc_connect(), or NULL for the process-wide
+// connection that is opened on first use and reopened after a failure or fork().
+// Synchronous calls return a Status (STATUS_OK, STATUS_NOT_FOUND, ...) or MC_ERROR if
+// the connection failed (errno is set). The server tracks ownership per process, so
+// all connections of a process act as the same owner.
+//
+// Locks are tied to the connection that acquired them: they are released when it
+// closes, or when their lease TTL (mc_lock_lease) passes without an mc_renew.
+//
+// A MutexClient is safe to share between threads, but requests on one connection are
+// answered in order: while a blocking lock waits, later requests queue behind it.
+
+#define MC_ERROR -1         // Connection or local failure, see errno
+
+// Timeout argument of mc_lock
+#define MC_TRY 0            // Fail with STATUS_LOCKED_OTHER instead of waiting
+#define MC_WAIT_FOREVER -1  // Wait until the mutex is handed over
+
+typedef struct MutexClient MutexClient;
+
+// Completion callback of an asynchronous request. status is a Status or MC_ERROR;
+// payload (LIST text, SEND reply, BATCH statuses) is only valid during the call.
+typedef void (*mc_callback)(MutexClient* c, int status, const void* payload,
+                            size_t payload_len, void* ctx);
+
+// Connect to host:port, or to a Unix socket with host "unix:<path>", and introduce
+// this process. NULL host = this machine, over SERVER_SOCKET_PATH when the server
+// listens there (else 127.0.0.1). Returns NULL on failure.
+MutexClient* mc_connect(const char* host, int port);
+void mc_close(MutexClient* c);
+
+// Synchronous API
+int mc_create(MutexClient* c, const char* name);
+int mc_lock(MutexClient* c, const char* name, int timeout_ms);  // MC_TRY, MC_WAIT_FOREVER or ms
+int mc_lock_lease(MutexClient* c, const char* name, int timeout_ms, uint32_t ttl_ms);
+int mc_renew(MutexClient* c, const char* name, uint32_t ttl_ms);
+int mc_lock_shared(MutexClient* c, const char* name, int timeout_ms, uint32_t ttl_ms);  // ttl 0 = none
+int mc_lock_all(MutexClient* c, const char* const* names, int count, int timeout_ms, int* failed);
+int mc_unlock(MutexClient* c, const char* name);
+int mc_delete(MutexClient* c, const char* name);
+int mc_send(MutexClient* c, const char* name, const char* message, char* reply, size_t reply_size);
+int mc_list(MutexClient* c, char* out, size_t out_size);
+
+// Handles: mc_create_handle and mc_open return a handle for the mutex, which the calls
+// below send instead of its name, so the server skips looking the name up. A handle is
+// valid on the server that issued it until the mutex is deleted, then calls get
+// STATUS_NOT_FOUND; it does not outlive a server restart. Locks taken by handle are
+// released with mc_unlock_handle or mc_unlock alike.
+int mc_create_handle(MutexClient* c, const char* name, MutexHandle* handle);
+int mc_open(MutexClient* c, const char* name, MutexHandle* handle);
+int mc_lock_handle(MutexClient* c, MutexHandle handle, int timeout_ms);
+int mc_unlock_handle(MutexClient* c, MutexHandle handle);
+int mc_delete_handle(MutexClient* c, MutexHandle handle);
+int mc_send_handle(MutexClient* c, MutexHandle handle, const char* message, char* reply,
+                   size_t reply_size);
+
+// Subscriptions: every message sent through the mutex is pushed to this client and passed
+// to the handler set with mc_on_message, from mc_process() or from a synchronous call on
+// the same client; msg->text is only valid during the call. Deleting the mutex ends the
+// subscription with status STATUS_NOT_FOUND (seq 0). Subscriptions do not survive a
+// reconnect. mc_subscribe first replays the messages the server kept with a seq above
+// `after` (0 = all of them, MC_NEW_ONLY = none) and sets *newest (may be NULL) to the
+// seq of the newest message.
+#define MC_NEW_ONLY UINT64_MAX
+
+typedef void (*mc_message_fn)(MutexClient* c, int status, const ProtoMessage* msg, void* ctx);
+
+void mc_on_message(MutexClient* c, mc_message_fn fn, void* ctx);
+int mc_subscribe(MutexClient* c, const char* name, uint64_t after, uint64_t* newest);
+int mc_unsubscribe(MutexClient* c, const char* name);
+
+// Fast mutexes: created by the server in a shared-memory table (server option -f).
+// Over the local Unix socket, from a process of the server's user, mc_fast_lock / mc_fast_unlock take and release them with
+// one atomic operation, sleeping on a futex only under contention; otherwise, and for
+// ordinary mutexes, they behave like mc_lock / mc_unlock. Fast mutexes held by a
+// process are released when the connection that made these calls closes.
+int mc_create_fast(MutexClient* c, const char* name);
+int mc_fast_lock(MutexClient* c, const char* name, int timeout_ms);
+int mc_fast_unlock(MutexClient* c, const char* name);
+
+// Asynchronous API: queue a request (op is a CommandType, arg the LOCK timeout) and
+// return 0, or MC_ERROR. The callback runs from mc_process() or from a synchronous
+// call on the same client, in request order.
+int mc_submit(MutexClient* c, CommandType op, const char* name, int32_t arg,
+              const void* payload, uint32_t payload_len, mc_callback cb, void* ctx);
+int mc_submit_handle(MutexClient* c, CommandType op, MutexHandle handle, int32_t arg,
+                     const void* payload, uint32_t payload_len, mc_callback cb, void* ctx);
+
+// Event loop integration: poll mc_fd() for POLLIN (and POLLOUT while mc_want_write()),
+// then call mc_process() to send queued requests and run callbacks for the responses
+// and messages that arrived. mc_process never blocks; it returns the number of
+// callbacks run, or MC_ERROR once the connection failed (pending callbacks then get
+// MC_ERROR).
+int mc_fd(MutexClient* c);
+bool mc_want_write(MutexClient* c);
+int mc_pending(MutexClient* c);
+int mc_process(MutexClient* c);
+
+#endif
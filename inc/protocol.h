@@ -0,0 +1,185 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "common.h"
+
+// Framed binary wire protocol between clients and the mutex server.
+//
+// Request:  u32 length | u8 version | u8 op | u16 name_len | i32 arg | name | payload
+// Response: u32 length | u8 version | u8 op | i16 status | payload
+//
+// length counts the bytes after the length field itself; integers are big-endian.
+// The first request on a connection must be CMD_HELLO with arg = client PID (> 0, else
+// STATUS_INVALID and the connection stays unidentified).
+//
+// LOCK: arg = 0 (try), -1 (wait) or a timeout in ms; an optional u32 payload is a lease
+// TTL in ms, after which the server releases the lock unless RENEW (arg = new TTL in ms)
+// extends it. Locks taken over a connection are released when it closes.
+// LOCK_SHARED takes the same arguments and acquires a shared (read) hold instead.
+//
+// Requests may be pipelined: responses come back in request order. A CMD_BATCH request
+// carries several create/lock/lock_shared/unlock/delete operations in its payload and is answered
+// with one status per operation, applied in order (locks never wait):
+//   request payload:  { u8 op | u8 name_len | name } ...
+//   response payload: { i16 status } ...
+//
+// CMD_LOCK_ALL locks every mutex listed in its payload (BATCH encoding, op LOCK or
+// LOCK_SHARED per entry) or none of them; arg is a timeout as for LOCK. A blocking
+// LOCK_ALL acquires the mutexes one by one in name order. On failure the response
+// payload is the i16 index of the entry that could not be locked.
+//
+// CREATE with arg = 1 makes a fast mutex: local clients that sent CMD_ATTACH over the
+// Unix socket lock and unlock it directly in the server's shared-memory table (see
+// shmtable.h). When the attached connection closes, the server frees the fast mutexes
+// its process still holds. Fast mutexes have no shared mode.
+//
+// A waiting LOCK fails with STATUS_DEADLOCK when it would close a cycle of clients
+// waiting for each other (the most recent wait of the cycle is aborted).
+//
+// SEND messages are numbered per mutex (seq 1, 2, ...) and the server keeps the last
+// MUTEX_MESSAGE_RING of them. SUBSCRIBE asks for every later message of the mutex as a
+// CMD_MESSAGE frame, laid out like a response and pushed between responses, in seq
+// order. An optional u64 payload first replays the kept messages with a higher seq;
+// the response payload is the u64 seq of the newest message (0 = none). UNSUBSCRIBE
+// ends it (NOT_FOUND if there was none); pushes already on their way may still arrive.
+//   push payload: u64 seq | i64 time | i32 pid | u8 name_len | name | message
+// Deleting the mutex ends its subscriptions with a last push of status NOT_FOUND, seq 0
+// and no message.
+//
+// CREATE answers with the u64 handle of the new mutex, OPEN with the handle of an
+// existing one. LOCK, LOCK_SHARED, UNLOCK, SEND and DELETE may carry the handle instead
+// of the name (name_len = PROTO_NAME_HANDLE | 8, the name field is the u64): the server
+// then finds the mutex without a lookup by name. A handle is only valid on the server
+// that issued it, until the mutex is deleted; after that it gets NOT_FOUND.
+
+#define PROTO_VERSION 1
+#define PROTO_REQUEST_HEADER 12     // Fixed request bytes including the length field
+#define PROTO_RESPONSE_HEADER 8     // Fixed response bytes including the length field
+#define PROTO_MAX_FRAME (1 << 20)   // Larger frames are a protocol error
+#define PROTO_MESSAGE_HEADER 21     // Fixed bytes of a CMD_MESSAGE payload
+#define PROTO_NAME_HANDLE 0x8000    // name_len flag: the name field holds a handle
+
+// Result of a request, rendered as text by the client
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND,       // No mutex with that name
+    STATUS_EXISTS,          // CREATE: name already taken
+    STATUS_LOCKED_OTHER,    // Held by another client
+    STATUS_LOCKED_SELF,     // LOCK: already held by this client
+    STATUS_SYSTEM_BUSY,     // Unused: clients may hold several mutexes
+    STATUS_NOT_LOCKED,      // UNLOCK: mutex is not locked
+    STATUS_NOT_OWNER,       // UNLOCK/SEND: caller does not hold the mutex
+    STATUS_TIMEOUT,         // LOCK: wait timed out
+    STATUS_NO_MEMORY,       // CREATE: server out of memory
+    STATUS_INVALID,         // Unknown op, empty or too long name, HELLO PID <= 0
+    STATUS_BAD_VERSION,     // Unsupported protocol version
+    STATUS_DEADLOCK,        // LOCK: waiting would deadlock, wait aborted
+    STATUS_READ_ONLY        // Server is a backup: changes go to the primary
+} Status;
+
+// Growable byte buffer used for socket input and output
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// Names a mutex of one server without its name (see CMD_OPEN); never 0
+typedef uint64_t MutexHandle;
+
+// Decoded request; name is NUL-terminated, payload points into the input buffer
+typedef struct {
+    uint8_t version;
+    uint8_t op;
+    int32_t arg;
+    uint16_t name_len;
+    char name[MAX_MUTEX_NAME];
+    MutexHandle handle;     // Sent instead of the name (which is then empty), else 0
+    const uint8_t* payload;
+    uint32_t payload_len;
+} ProtoRequest;
+
+// Decoded response; payload points into the input buffer
+typedef struct {
+    uint8_t version;
+    uint8_t op;
+    int16_t status;
+    const uint8_t* payload;
+    uint32_t payload_len;
+} ProtoResponse;
+
+// Decoded CMD_MESSAGE push; text points into the response payload (not NUL-terminated)
+typedef struct {
+    uint64_t seq;
+    int64_t time;
+    int32_t pid;
+    char name[MAX_MUTEX_NAME];
+    const char* text;
+    uint32_t text_len;
+} ProtoMessage;
+
+// Immutable bytes shared by reference, like a frame queued on many connections at once
+// (conn_send_shared). The owner embeds it and frees itself in destroy, which runs when
+// shared_release drops the last reference.
+typedef struct SharedBuf {
+    _Atomic int refs;
+    uint32_t len;
+    const uint8_t* data;
+    void (*destroy)(struct SharedBuf* b);
+} SharedBuf;
+
+// Buffer helpers
+int buf_append(Buffer* b, const void* data, size_t n);
+void buf_consume(Buffer* b, size_t n);
+void buf_free(Buffer* b);
+
+void shared_retain(SharedBuf* b);
+void shared_release(SharedBuf* b);
+
+// Encode a frame at the end of out. Return 0, or -1 if out of memory.
+int proto_put_request(Buffer* out, uint8_t op, int32_t arg, const char* name,
+                      const void* payload, uint32_t payload_len);
+int proto_put_handle_request(Buffer* out, uint8_t op, int32_t arg, MutexHandle handle,
+                             const void* payload, uint32_t payload_len);
+int proto_put_response(Buffer* out, uint8_t op, int16_t status,
+                       const void* payload, uint32_t payload_len);
+
+// Big-endian u32 at p
+void proto_put_u32(uint8_t* p, uint32_t v);
+uint32_t proto_get_u32(const uint8_t* p);
+
+// Decode the first frame in `in`. Return its total size (consume it with buf_consume
+// once done), 0 if it is not complete yet, or -1 if the framing is invalid.
+int proto_get_request(const Buffer* in, ProtoRequest* req);
+int proto_get_response(const Buffer* in, ProtoResponse* resp);
+
+// Batch payload helpers. proto_get_batch_op decodes the operation at *p (advancing it)
+// and returns 1, 0 at the end of the payload, or -1 if it is malformed.
+int proto_put_batch_op(Buffer* out, uint8_t op, const char* name);
+int proto_get_batch_op(const uint8_t** p, const uint8_t* end, uint8_t* op, char* name);
+int proto_put_batch_status(Buffer* out, int16_t status);
+int16_t proto_get_batch_status(const ProtoResponse* resp, uint32_t index);
+
+// CMD_MESSAGE frames. proto_message_size gives the size of the whole frame, which
+// proto_put_message writes to out; proto_get_message returns 0, or -1 if malformed.
+size_t proto_message_size(size_t name_len, size_t text_len);
+void proto_put_message(uint8_t* out, int16_t status, uint64_t seq, int64_t time, int32_t pid,
+                       const char* name, const char* text, size_t text_len);
+int proto_get_message(const ProtoResponse* resp, ProtoMessage* msg);
+
+// Big-endian u64 at p (SUBSCRIBE payloads)
+void proto_put_u64(uint8_t* p, uint64_t v);
+uint64_t proto_get_u64(const uint8_t* p);
+
+// Blocking socket helpers. proto_connect opens a connection to the server at host:port
+// (a host written as "name:port" brings its own port), or at the Unix socket path for a
+// host of the form "unix:<path>". host NULL means
+// this machine: SERVER_SOCKET_PATH if the server listens there, else 127.0.0.1.
+// Returns the socket, or -1 with errno set.
+int proto_connect(const char* host, int port);
+int proto_send_all(int fd, const void* data, size_t len);
+int proto_recv_frame(int fd, Buffer* in);
+
+const char* status_to_string(Status status);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "common.h"
+#include "protocol.h"
+#include "timer.h"
+
+// Event-driven connection handling: one epoll loop per reactor thread multiplexes its
+// listening sockets and every connection accepted from them. Sockets are non-blocking;
+// protocol code plugs in through ConnOps and always runs on the connection's reactor.
+
+struct Conn;
+
+typedef struct {
+    void (*on_open)(struct Conn* c);    // Connection accepted; set up c->session
+    void (*on_data)(struct Conn* c);    // New bytes in c->in (not called while paused)
+    void (*on_wake)(struct Conn* c);    // Work was posted to the connection with conn_post
+    void (*on_close)(struct Conn* c);   // Connection is closing; drop protocol state
+} ConnOps;
+
+typedef struct Reactor {
+    int id;
+    int epoll_fd;
+    int wake_fd;                // eventfd written by conn_post from other threads
+    TimerWheel timers;
+    pthread_mutex_t inbox_lock;
+    struct Conn* inbox;         // Connections with posted work
+    struct Conn* released;      // Connections to free after the current batch
+    int conn_count;
+    pthread_t thread;
+} Reactor;
+
+typedef struct Conn {
+    int kind;                   // Epoll tag, see reactor.c
+    int fd;
+    Reactor* reactor;
+    const ConnOps* ops;
+    Buffer in;                  // Received bytes not yet consumed by on_data
+    Buffer out;                 // Bytes waiting for the socket to become writable
+    SharedBuf** shared;         // Frames queued by reference (conn_send_shared)
+    size_t shared_head;         // First unsent entry of shared
+    size_t shared_count;        // Entries in use, including the sent ones before shared_head
+    size_t shared_cap;
+    size_t shared_offset;       // Bytes of the head entry already sent
+    size_t shared_bytes;        // Unsent bytes in shared
+    void* session;              // Protocol state, freed together with the connection
+    int refs;                   // Reactor reference plus conn_hold()s
+    uint32_t events;            // Current epoll interest
+    bool paused;                // Input is not delivered until conn_resume
+    bool peer_closed;           // Peer shut down its side
+    bool close_after_flush;
+    bool closed;
+    bool in_inbox;              // Guarded by reactor->inbox_lock
+    struct Conn* inbox_next;
+    struct Conn* released_next;
+} Conn;
+
+Reactor* reactor_create(int id);
+int reactor_listen(Reactor* r, int listen_fd, const ConnOps* ops);
+void reactor_run(Reactor* r);      // Run the event loop on the calling thread
+int reactor_start(Reactor* r);     // Run the event loop on a new thread (pthread_create result)
+void reactor_add_timer(Reactor* r, TimerEntry* t, uint64_t deadline_ms);
+void reactor_cancel_timer(Reactor* r, TimerEntry* t);
+
+// All of these run on the connection's reactor thread, except conn_post
+void conn_flush(Conn* c);   // Send queued output; closes the connection when it is done
+void conn_send_shared(Conn* c, SharedBuf* b);
+void conn_pause(Conn* c);
+void conn_resume(Conn* c);
+void conn_close(Conn* c);
+void conn_hold(Conn* c);
+void conn_release(Conn* c);
+void conn_post(Conn* c);    // Thread-safe: run ops->on_wake on the reactor thread soon
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include "common.h"
+#include "wal.h"
+
+// Primary/backup replication of the registry, built on the write-ahead log's records.
+//
+// A backup connects to the primary's replication port and receives a snapshot of the
+// registry, then every batch of records the primary's log thread takes (see wal_tap_fn).
+// It applies them through the same callback as log replay and acknowledges the last LSN
+// applied. Clients of a backup may look (LIST, the web views) but get STATUS_READ_ONLY
+// for changes until it is promoted: then it stops following and serves them itself, with
+// the holds it received (owned by their PID, like holds restored from the log).
+//
+// Replication is asynchronous by default. In synchronous mode a change is committed (and
+// answered) once a backup has acknowledged it. Only backups that have loaded their
+// snapshot count; while there are none, changes do not wait.
+//
+// Wire format, in host byte order like the log (primary and backups share an
+// architecture): the backup sends REPL_MAGIC and REPL_VERSION as two u32, the primary
+// answers with a snapshot (wal_snapshot) followed by records, and the backup sends back
+// u64 LSNs.
+
+#define REPL_MAGIC 0x4C504552u      // "REPL"
+#define REPL_VERSION 2
+#define REPL_MAX_BACKLOG (64u << 20)    // Unsent bytes before a slow backup is dropped
+
+// Serve backups on port; with sync, changes wait for a backup's acknowledgement. Call
+// after wal_open. Returns 0, or -1 with errno set.
+int repl_serve(int port, bool sync);
+
+// Forget the whole state: a backup reloads it from the primary on every connection
+typedef void (*repl_reset_fn)(void);
+
+// Follow the primary at host:port as a backup, applying its records through apply.
+// Reconnects until promoted. Returns 0, or -1 with errno set.
+int repl_follow(const char* primary, wal_apply_fn apply, repl_reset_fn reset);
+
+bool repl_is_backup();
+int repl_backup_count();    // Backups connected to this server
+
+// Stop following and accept changes. Returns -1 if this server is not a backup.
+int repl_promote();
+
+#endif
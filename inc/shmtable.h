@@ -0,0 +1,71 @@
+#ifndef SHMTABLE_H
+#define SHMTABLE_H
+
+#include "common.h"
+#include <stdatomic.h>
+
+// Shared-memory lock table for "fast" mutexes: the server maps it read-write and so do
+// local clients, which then lock and unlock those mutexes with one atomic operation on
+// the slot's lock word, sleeping on a futex only under contention. The server still
+// creates and deletes slots, releases the locks of clients that die, and reads the
+// words for LIST and the web view.
+//
+// The table is readable and writable by the server's user only (mode 0600).
+//
+// Lock word: holder PID in the low bits (0 = free), plus flags telling the releasing
+// side whom to wake. Clients find slots by name through open addressing on the name
+// hash; a slot's generation changes whenever it is reused.
+
+#define SHM_TABLE_NAME "/mutex_server_locks"   // shm_open name
+#define SHM_PID_MASK 0x3FFFFFFFu
+#define SHM_SERVER_WAITERS 0x40000000u  // Clients wait in the server queue: ring the doorbell
+#define SHM_FUTEX_WAITERS 0x80000000u   // Clients sleep on the word: futex wake
+#define SHM_DEAD SHM_PID_MASK           // Word of a deleted mutex
+
+// Slot states
+enum { SHM_EMPTY, SHM_LIVE, SHM_TOMBSTONE };
+
+typedef struct ShmSlot {
+    _Atomic uint32_t word;
+    _Atomic uint32_t generation;
+    _Atomic uint32_t state;
+    _Atomic uint32_t rung;  // Released by a client with SHM_SERVER_WAITERS set, not handed off yet
+    uint32_t hash;
+    char name[MAX_MUTEX_NAME];
+} __attribute__((aligned(64))) ShmSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;              // Power of two
+    _Atomic uint32_t doorbell;      // Bumped (and futex-woken) for SHM_SERVER_WAITERS
+    ShmSlot slots[];
+} ShmTable;
+
+// Server side. Slot changes must be serialized by the caller.
+ShmTable* shm_table_create(uint32_t capacity);     // NULL on failure
+void shm_table_destroy(ShmTable* t);
+void shm_table_unlink();     // New clients no longer find the table
+ShmSlot* shm_slot_insert(ShmTable* t, const char* name);   // NULL if full
+void shm_slot_remove(ShmSlot* s);                          // Word must be SHM_DEAD
+
+// Client side
+ShmTable* shm_table_open();                         // NULL if there is no table
+void shm_table_close(ShmTable* t);
+ShmSlot* shm_slot_find(ShmTable* t, const char* name, uint32_t* generation);
+
+// Lock word operations (any process). shm_lock returns 0, -1 busy (timeout_ms == 0),
+// -2 already held by pid, -3 timed out, -4 deleted; timeout_ms < 0 waits forever.
+// shm_unlock returns 0, -1 not locked, -2 held by another PID.
+int shm_lock(ShmTable* t, ShmSlot* s, uint32_t generation, uint32_t pid, int timeout_ms);
+int shm_unlock(ShmTable* t, ShmSlot* s, uint32_t pid);
+
+// Used by the server for locks it grants and releases itself
+uint32_t shm_owner(ShmSlot* s);             // Holder PID, 0 = free (or deleted)
+bool shm_acquire(ShmSlot* s, uint32_t pid, bool server_waiters);  // false if held
+bool shm_flag_server_waiters(ShmSlot* s);   // false if the word is free
+void shm_release(ShmSlot* s);               // Free the word, wake a futex sleeper
+bool shm_kill(ShmSlot* s, uint32_t pid);    // Free or held by pid: mark SHM_DEAD
+uint32_t shm_doorbell_wait(ShmTable* t, uint32_t seen);  // Block while doorbell == seen
+bool shm_take_rung(ShmSlot* s);             // Clear the rung mark, true if it was set
+
+#endif
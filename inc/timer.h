@@ -0,0 +1,40 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "common.h"
+
+// Hashed timer wheel: O(1) add/remove, expiry cost proportional to the ticks elapsed
+// and the timers due. Not thread-safe; each owner serializes access itself.
+
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK_MS 10
+
+typedef struct TimerEntry {
+    uint64_t deadline;      // Monotonic milliseconds
+    void (*fire)(struct TimerEntry* t);
+    struct TimerEntry* prev;
+    struct TimerEntry* next;
+    bool armed;
+} TimerEntry;
+
+typedef struct {
+    TimerEntry slots[WHEEL_SLOTS];  // List heads (sentinels)
+    TimerEntry due;                 // Expired timers not fired yet (still armed)
+    uint64_t tick;                  // Last tick processed
+    int count;                      // Armed timers
+} TimerWheel;
+
+void wheel_init(TimerWheel* w, uint64_t now_ms);
+void wheel_add(TimerWheel* w, TimerEntry* t, uint64_t deadline_ms);
+void wheel_remove(TimerWheel* w, TimerEntry* t);
+
+// Move every timer due at now_ms to the due list. They stay armed, so wheel_remove still
+// takes them out if an earlier timer's fire() cancels them.
+void wheel_expire(TimerWheel* w, uint64_t now_ms);
+
+// Unlink and return the first due timer, NULL if none: the caller calls fire() on it
+TimerEntry* wheel_next_due(TimerWheel* w);
+
+uint64_t monotonic_ms();
+
+#endif
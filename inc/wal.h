@@ -0,0 +1,103 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "common.h"
+#include "protocol.h"
+
+// Write-ahead log, so that a restarted server keeps its mutexes and their holders.
+//
+// The log directory holds a snapshot (mutex.snap) and log segments (mutex-<seq>.wal).
+// wal_append adds a record to an in-memory batch; the log thread writes the batch with
+// one write() and one fdatasync(), and changes made while a sync runs share the next
+// one (group commit). Once the open segment grows past WAL_SNAPSHOT_BYTES, the snapshot
+// thread starts a new segment, writes a snapshot and deletes the older segments.
+//
+// A snapshot is a sequence of records as well, taken while the registry keeps changing:
+// at startup the log is replayed from the position where the snapshot began, so changes
+// the snapshot already contains are applied twice. Records must therefore set state
+// ("pid holds m") rather than depend on it.
+//
+// Replication (repl.c) sees every batch through the tap, and can make a change wait for
+// a backup as well: a change is committed, and wal_durable() true, once it is on disk
+// (if there is a log directory) and acknowledged by a backup (if wal_set_replica_lsn
+// asks for that).
+
+#ifndef WAL_SNAPSHOT_BYTES
+#define WAL_SNAPSHOT_BYTES (64u << 20)
+#endif
+
+#define WAL_SNAPSHOT_HEADER 24  // Bytes before the records of a snapshot
+#define WAL_MAX_RECORD (40 + MAX_MUTEX_NAME + MAX_MSG_SIZE)  // Largest encoded record
+
+#define WAL_SHARED 0x01     // Record flags
+#define WAL_FAST   0x02
+
+typedef struct {
+    uint64_t lsn;           // Log sequence number, set by wal_append
+    uint8_t type;           // Chosen by the caller (the registry uses MutexEvent)
+    uint8_t flags;
+    int32_t pid;
+    uint64_t seq;           // Chosen by the caller (the registry numbers messages)
+    int64_t time;
+    const char* name;
+    const char* message;    // "" = none
+} WalRecord;
+
+// Replays one record at startup, before the log accepts new records
+typedef void (*wal_apply_fn)(const WalRecord* r);
+
+// Adds a record for every part of the current state to a snapshot with wal_snapshot_add
+// (runs on the snapshot thread)
+typedef void (*wal_dump_fn)(Buffer* snapshot);
+
+// Receives each batch of encoded records, in LSN order (on the log thread)
+typedef void (*wal_tap_fn)(const uint8_t* records, size_t len);
+
+// Notification that the log is committed up to lsn
+typedef struct WalWaiter {
+    void (*done)(struct WalWaiter* w);  // Called on the log thread, or by wal_wait itself
+    void* ctx;
+    uint64_t lsn;
+    struct WalWaiter* next;
+} WalWaiter;
+
+// Create or open the log in dir, replay it through apply and start logging. Returns the
+// number of records replayed, or -1 (errno set; a corrupt snapshot gives EBADMSG).
+// With dir NULL nothing is written to disk: the records only go to the tap.
+int wal_open(const char* dir, wal_apply_fn apply, wal_dump_fn dump);
+bool wal_enabled();
+
+// Queue r (r->lsn is set) and return its LSN. Never waits for the disk.
+uint64_t wal_append(WalRecord* r);
+
+uint64_t wal_last_lsn();            // Newest record appended
+bool wal_durable(uint64_t lsn);     // Is the log committed up to lsn?
+void wal_flush();                   // Wait until every record appended is on disk (not for backups)
+void wal_wait(WalWaiter* w, uint64_t lsn);
+
+void wal_set_tap(wal_tap_fn fn);
+
+// Changes up to lsn are acknowledged by a backup; later ones wait for it before they
+// count as committed. UINT64_MAX = commit without a backup.
+void wal_set_replica_lsn(uint64_t lsn);
+
+void wal_snapshot_add(Buffer* snapshot, const WalRecord* r);
+
+// Append a snapshot of the current state (taken through the dump callback) to out,
+// marked as starting at log position lsn. -1 if out of memory.
+int wal_snapshot(Buffer* out, uint64_t lsn);
+
+// Total size of the snapshot whose WAL_SNAPSHOT_HEADER bytes are at header, 0 if they
+// are not a snapshot header
+size_t wal_snapshot_size(const uint8_t* header);
+
+// Apply every record of a snapshot of `size` bytes and set *lsn to its start position.
+// Returns the records applied, -1 if the snapshot is damaged (errno EBADMSG).
+int wal_load_snapshot(const uint8_t* data, size_t size, wal_apply_fn apply, uint64_t* lsn);
+
+// Decode the record at p into r; name and message are copied into the given buffers
+// (MAX_MUTEX_NAME and MAX_MSG_SIZE bytes). Returns its size, 0 if it is cut short or
+// corrupt.
+size_t wal_decode(const uint8_t* p, size_t avail, WalRecord* r, char* name, char* message);
+
+#endif
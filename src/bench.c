@@ -0,0 +1,555 @@
+#include "../inc/common.h"
+#include "../inc/metrics.h"
+#include "../inc/protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Load generator for the mutex server. Connections speak the wire protocol with one
+// request in flight each and run a weighted mix of operations for a fixed time; the
+// latency of every request is recorded per operation. Each connection introduces itself
+// with a PID of its own, so they contend with each other like separate clients.
+//
+// Mix entries (-m name=weight,...):
+//   create     CREATE a new name, then DELETE it
+//   lock       LOCK (try) one of the connection's own mutexes, then UNLOCK it
+//   send       SEND through a mutex the connection holds
+//   list       LIST
+//   contended  LOCK one of the shared hot mutexes (try, or wait with -w), UNLOCK if granted
+
+#define MAX_CONNS 4096
+#define MAX_THREADS 256
+#define LAT_SUB_BITS 5                      // 32 latency buckets per power of two (~3% wide)
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+#define PID_BASE 0x40000000                 // HELLO PIDs: PID_BASE + (process << 16) + connection
+#define DEFAULT_MIX "lock=50,contended=20,send=15,create=10,list=5"
+
+// What a request measured; mix entries use the first five
+typedef enum {
+    OP_LOCK,
+    OP_CONTENDED,
+    OP_SEND,
+    OP_CREATE,
+    OP_LIST,
+    OP_UNLOCK,
+    OP_DELETE,
+    OP_KINDS
+} BenchOp;
+
+#define MIX_KINDS (OP_LIST + 1)
+
+static const char* op_names[OP_KINDS] = {
+    "lock", "contended", "send", "create", "list", "unlock", "delete"
+};
+
+// Log-linear latency histogram
+typedef struct {
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t count;
+    uint64_t errors;        // Unexpected status
+    uint64_t busy;          // contended: held by another connection (or timed out)
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} Latency;
+
+typedef struct {
+    int fd;
+    int index;              // Connection number: names and PID derive from it
+    Buffer in;
+    Buffer out;
+    BenchOp pending;        // Request in flight
+    bool busy;              // A request is in flight
+    uint64_t sent_ns;
+    char name[MAX_MUTEX_NAME];  // Mutex of the request in flight
+    uint64_t created;       // Names made by create so far
+    unsigned int seed;
+} BenchConn;
+
+typedef struct {
+    BenchConn* conns;
+    int count;
+    Latency stats[OP_KINDS];
+    pthread_t thread;
+} BenchThread;
+
+// Settings
+static const char* host = NULL;
+static int conn_count = 16;
+static int thread_count = 4;
+static int duration_s = 5;
+static int keys = 8;                // Own mutexes per connection for lock
+static int hot_count = 1;           // Shared mutexes for contended
+static int message_size = 64;
+static int wait_ms = 0;             // contended: LOCK timeout, 0 = try
+static const char* json_path = NULL;
+static int mix[MIX_KINDS];
+static int mix_total = 0;
+
+static BenchConn conns[MAX_CONNS];
+static BenchThread threads[MAX_THREADS];
+static char message[MAX_MSG_SIZE];
+static uint64_t stop_ns;
+
+
+static int lat_bucket(uint64_t ns) {
+    if (ns < (1u << LAT_SUB_BITS)) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) + (int)((ns >> shift) & ((1u << LAT_SUB_BITS) - 1));
+}
+
+
+// Middle of a bucket's range
+static uint64_t lat_value(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) return bucket;
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << LAT_SUB_BITS) + (bucket & ((1 << LAT_SUB_BITS) - 1))) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+
+static uint64_t lat_percentile(const Latency* l, double p) {
+    if (l->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * l->count);
+    if (rank >= l->count) rank = l->count - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += l->buckets[b];
+        if (seen > rank) return lat_value(b) < l->max_ns ? lat_value(b) : l->max_ns;
+    }
+    return l->max_ns;
+}
+
+
+static void lat_merge(Latency* into, const Latency* l) {
+    for (int b = 0; b < LAT_BUCKETS; b++) into->buckets[b] += l->buckets[b];
+    into->count += l->count;
+    into->errors += l->errors;
+    into->busy += l->busy;
+    into->sum_ns += l->sum_ns;
+    if (l->max_ns > into->max_ns) into->max_ns = l->max_ns;
+}
+
+
+// Queue a request and send what the socket takes. Returns -1 if the connection failed.
+static int send_request(BenchConn* c, BenchOp kind, uint8_t op, int32_t arg,
+                        const void* payload, uint32_t payload_len) {
+    if (proto_put_request(&c->out, op, arg, c->name, payload, payload_len) < 0) return -1;
+    c->pending = kind;
+    c->busy = true;
+    c->sent_ns = monotonic_ns();
+
+    while (c->out.len > 0) {
+        ssize_t n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (n > 0) {
+            buf_consume(&c->out, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;  // The poll loop waits for POLLOUT
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Start the next operation of the mix
+static int start_op(BenchConn* c) {
+    int pick = rand_r(&c->seed) % mix_total;
+    BenchOp kind = OP_LOCK;
+    while (pick >= mix[kind]) pick -= mix[kind++];
+
+    switch (kind) {
+        case OP_LOCK:
+            snprintf(c->name, sizeof(c->name), "bench-%d-%d", c->index, rand_r(&c->seed) % keys);
+            return send_request(c, OP_LOCK, CMD_LOCK, 0, NULL, 0);
+        case OP_CONTENDED:
+            snprintf(c->name, sizeof(c->name), "bench-hot-%d", rand_r(&c->seed) % hot_count);
+            return send_request(c, OP_CONTENDED, CMD_LOCK, wait_ms, NULL, 0);
+        case OP_SEND:
+            snprintf(c->name, sizeof(c->name), "bench-%d-send", c->index);
+            return send_request(c, OP_SEND, CMD_SEND, 0, message, message_size);
+        case OP_CREATE:
+            snprintf(c->name, sizeof(c->name), "bench-%d-n%llu", c->index,
+                     (unsigned long long)c->created++);
+            return send_request(c, OP_CREATE, CMD_CREATE, 0, NULL, 0);
+        default:
+            c->name[0] = '\0';
+            return send_request(c, OP_LIST, CMD_LIST, 0, NULL, 0);
+    }
+}
+
+
+// Record the response to the request in flight and send the follow-up or the next
+// operation (none once the run is over). Returns -1 if the connection failed.
+static int handle_response(BenchThread* t, BenchConn* c, const ProtoResponse* resp) {
+    uint64_t now = monotonic_ns();
+    uint64_t ns = now - c->sent_ns;
+    Latency* l = &t->stats[c->pending];
+    bool ok = (resp->status == STATUS_OK);
+
+    l->buckets[lat_bucket(ns)]++;
+    l->count++;
+    l->sum_ns += ns;
+    if (ns > l->max_ns) l->max_ns = ns;
+    c->busy = false;
+
+    if (c->pending == OP_CONTENDED &&
+        (resp->status == STATUS_LOCKED_OTHER || resp->status == STATUS_TIMEOUT)) {
+        l->busy++;
+    } else if (!ok) {
+        l->errors++;
+    }
+
+    // Second half of lock, contended and create, even after the deadline
+    if (ok && (c->pending == OP_LOCK || c->pending == OP_CONTENDED)) {
+        return send_request(c, OP_UNLOCK, CMD_UNLOCK, 0, NULL, 0);
+    }
+    if (ok && c->pending == OP_CREATE) return send_request(c, OP_DELETE, CMD_DELETE, 0, NULL, 0);
+
+    return now < stop_ns ? start_op(c) : 0;
+}
+
+
+static void read_responses(BenchThread* t, BenchConn* c) {
+    uint8_t chunk[16384];
+
+    while (1) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            if (buf_append(&c->in, chunk, n) < 0) break;
+            if ((size_t)n < sizeof(chunk)) break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        fprintf(stderr, "Connection %d: server closed the connection\n", c->index);
+        c->busy = false;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+
+    ProtoResponse resp;
+    int size;
+    while (c->busy && (size = proto_get_response(&c->in, &resp)) > 0) {
+        int rc = handle_response(t, c, &resp);
+        buf_consume(&c->in, size);
+        if (rc < 0) {
+            fprintf(stderr, "Connection %d: %s\n", c->index, strerror(errno));
+            c->busy = false;
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+    }
+}
+
+
+// Event loop of one thread: run until the deadline, then until nothing is in flight
+static void* run_thread(void* arg) {
+    BenchThread* t = arg;
+    struct pollfd* fds = calloc(t->count, sizeof(struct pollfd));
+    if (!fds) return NULL;
+
+    for (int i = 0; i < t->count; i++) {
+        if (start_op(&t->conns[i]) < 0) t->conns[i].busy = false;
+    }
+
+    while (1) {
+        int active = 0;
+        for (int i = 0; i < t->count; i++) {
+            BenchConn* c = &t->conns[i];
+            if (c->fd < 0 || !c->busy) {
+                fds[i].fd = -1;
+                continue;
+            }
+            fds[i].fd = c->fd;
+            fds[i].events = POLLIN | (c->out.len > 0 ? POLLOUT : 0);
+            active++;
+        }
+        if (active == 0) break;
+
+        if (poll(fds, t->count, 100) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < t->count; i++) {
+            BenchConn* c = &t->conns[i];
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+
+            if ((fds[i].revents & POLLOUT) && c->out.len > 0) {
+                ssize_t n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+                if (n > 0) buf_consume(&c->out, n);
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) read_responses(t, c);
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+
+// Blocking request for setup and cleanup. Returns the status, -1 if the connection failed.
+static int call(BenchConn* c, uint8_t op, const char* name, int32_t arg) {
+    Buffer out = {0};
+    ProtoResponse resp;
+
+    if (proto_put_request(&out, op, arg, name, NULL, 0) < 0 ||
+        proto_send_all(c->fd, out.data, out.len) < 0) {
+        buf_free(&out);
+        return -1;
+    }
+    buf_free(&out);
+
+    int size = proto_recv_frame(c->fd, &c->in);
+    if (size <= 0 || proto_get_response(&c->in, &resp) < 0) return -1;
+    int status = resp.status;
+    buf_consume(&c->in, size);
+    return status;
+}
+
+
+// Connect, say HELLO, and create the connection's mutexes. Returns -1 on failure.
+static int open_conn(BenchConn* c, int index) {
+    char name[MAX_MUTEX_NAME];
+
+    c->index = index;
+    c->seed = (unsigned int)(index * 2654435761u) ^ (unsigned int)getpid();
+    c->fd = proto_connect(host, SERVER_PORT);
+    if (c->fd < 0) return -1;
+
+    int pid = PID_BASE + ((getpid() & 0x3FFF) << 16) + index;
+    if (call(c, CMD_HELLO, NULL, pid) != STATUS_OK) return -1;
+
+    for (int k = 0; k < keys && mix[OP_LOCK] > 0; k++) {
+        snprintf(name, sizeof(name), "bench-%d-%d", index, k);
+        int status = call(c, CMD_CREATE, name, 0);
+        if (status != STATUS_OK && status != STATUS_EXISTS) return -1;
+    }
+    if (mix[OP_SEND] > 0) {
+        snprintf(name, sizeof(name), "bench-%d-send", index);
+        int status = call(c, CMD_CREATE, name, 0);
+        if (status != STATUS_OK && status != STATUS_EXISTS) return -1;
+        if (call(c, CMD_LOCK, name, 0) != STATUS_OK) return -1;
+    }
+    for (int h = 0; h < hot_count && index == 0 && mix[OP_CONTENDED] > 0; h++) {
+        snprintf(name, sizeof(name), "bench-hot-%d", h);
+        int status = call(c, CMD_CREATE, name, 0);
+        if (status != STATUS_OK && status != STATUS_EXISTS) return -1;
+    }
+
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+
+// Delete what open_conn created (the hot mutexes go with connection 0)
+static void close_conn(BenchConn* c) {
+    char name[MAX_MUTEX_NAME];
+
+    if (c->fd < 0) return;
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+
+    for (int k = 0; k < keys && mix[OP_LOCK] > 0; k++) {
+        snprintf(name, sizeof(name), "bench-%d-%d", c->index, k);
+        call(c, CMD_DELETE, name, 0);
+    }
+    if (mix[OP_SEND] > 0) {
+        snprintf(name, sizeof(name), "bench-%d-send", c->index);
+        call(c, CMD_DELETE, name, 0);
+    }
+    for (int h = 0; h < hot_count && c->index == 0 && mix[OP_CONTENDED] > 0; h++) {
+        snprintf(name, sizeof(name), "bench-hot-%d", h);
+        call(c, CMD_DELETE, name, 0);
+    }
+    close(c->fd);
+    buf_free(&c->in);
+    buf_free(&c->out);
+}
+
+
+// "lock=50,send=10,...": weights of the mix entries, others 0. Returns -1 if invalid.
+static int parse_mix(const char* spec) {
+    char copy[256];
+    char* save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(mix, 0, sizeof(mix));
+    mix_total = 0;
+
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+
+        int kind = 0;
+        while (kind < MIX_KINDS && strcmp(op_names[kind], item) != 0) kind++;
+        int weight = atoi(eq + 1);
+        if (kind == MIX_KINDS || weight < 0) return -1;
+        mix[kind] = weight;
+        mix_total += weight;
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+
+static void print_results(const Latency* stats, double elapsed) {
+    uint64_t total = 0;
+    for (int k = 0; k < OP_KINDS; k++) total += stats[k].count;
+
+    printf("\n%-10s %10s %10s %9s %9s %9s %9s %9s %8s %8s\n", "op", "count", "ops/s",
+           "mean us", "p50 us", "p99 us", "p999 us", "max us", "busy", "errors");
+    for (int k = 0; k < OP_KINDS; k++) {
+        const Latency* l = &stats[k];
+        if (l->count == 0) continue;
+        printf("%-10s %10llu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %8llu %8llu\n", op_names[k],
+               (unsigned long long)l->count, l->count / elapsed, l->sum_ns / 1e3 / l->count,
+               lat_percentile(l, 0.50) / 1e3, lat_percentile(l, 0.99) / 1e3,
+               lat_percentile(l, 0.999) / 1e3, l->max_ns / 1e3,
+               (unsigned long long)l->busy, (unsigned long long)l->errors);
+    }
+    printf("\nTotal: %llu requests in %.2f s, %.0f requests/s\n",
+           (unsigned long long)total, elapsed, total / elapsed);
+}
+
+
+// Results as JSON, for scripts comparing runs
+static int write_json(const char* path, const Latency* stats, double elapsed) {
+    FILE* f = fopen(path, "w");
+    if (!f) return -1;
+
+    uint64_t total = 0;
+    for (int k = 0; k < OP_KINDS; k++) total += stats[k].count;
+
+    fprintf(f, "{\n  \"config\": {\"host\": \"%s\", \"connections\": %d, \"threads\": %d, "
+               "\"duration_s\": %d, \"keys\": %d, \"hot\": %d, \"message_size\": %d, "
+               "\"wait_ms\": %d, \"mix\": {",
+            host, conn_count, thread_count, duration_s, keys, hot_count, message_size, wait_ms);
+    for (int k = 0; k < MIX_KINDS; k++) {
+        fprintf(f, "%s\"%s\": %d", k ? ", " : "", op_names[k], mix[k]);
+    }
+    fprintf(f, "}},\n  \"elapsed_s\": %.3f,\n  \"requests\": %llu,\n  \"requests_per_s\": %.1f,\n"
+               "  \"ops\": {",
+            elapsed, (unsigned long long)total, total / elapsed);
+
+    int written = 0;
+    for (int k = 0; k < OP_KINDS; k++) {
+        const Latency* l = &stats[k];
+        if (l->count == 0) continue;
+        fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"ops_per_s\": %.1f, \"mean_us\": %.2f, "
+                   "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f, "
+                   "\"busy\": %llu, \"errors\": %llu}",
+                written++ ? "," : "", op_names[k], (unsigned long long)l->count, l->count / elapsed,
+                l->sum_ns / 1e3 / l->count, lat_percentile(l, 0.50) / 1e3,
+                lat_percentile(l, 0.99) / 1e3, lat_percentile(l, 0.999) / 1e3, l->max_ns / 1e3,
+                (unsigned long long)l->busy, (unsigned long long)l->errors);
+    }
+    fprintf(f, "\n  }\n}\n");
+    return fclose(f);
+}
+
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options] [host[:port]]\n"
+           "  -c <n>        Connections (default 16)\n"
+           "  -t <n>        Threads driving them (default 4)\n"
+           "  -d <s>        Seconds to run (default 5)\n"
+           "  -m <mix>      Weighted operations (default %s)\n"
+           "                of create, lock, send, list, contended\n"
+           "  -k <n>        Own mutexes per connection for lock (default 8)\n"
+           "  -n <n>        Shared mutexes for contended (default 1)\n"
+           "  -s <bytes>    Message size for send (default 64)\n"
+           "  -w <ms>       contended waits up to <ms> for the lock (default 0: try)\n"
+           "  -o <file>     Write the results as JSON\n"
+           "The host defaults to MUTEX_SERVER_HOST, else 127.0.0.1. Use TCP: over a Unix\n"
+           "socket the server sees one PID, so the connections do not contend as clients.\n",
+           prog, DEFAULT_MIX);
+}
+
+
+int main(int argc, char* argv[]) {
+    const char* mix_spec = DEFAULT_MIX;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:d:m:k:n:s:w:o:h")) != -1) {
+        switch (opt) {
+            case 'c': conn_count = atoi(optarg); break;
+            case 't': thread_count = atoi(optarg); break;
+            case 'd': duration_s = atoi(optarg); break;
+            case 'm': mix_spec = optarg; break;
+            case 'k': keys = atoi(optarg); break;
+            case 'n': hot_count = atoi(optarg); break;
+            case 's': message_size = atoi(optarg); break;
+            case 'w': wait_ms = atoi(optarg); break;
+            case 'o': json_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) host = argv[optind];
+    if (host == NULL) host = getenv("MUTEX_SERVER_HOST");
+    if (host == NULL) host = "127.0.0.1";
+
+    if (conn_count < 1 || conn_count > MAX_CONNS || duration_s < 1 || keys < 1 || hot_count < 1 ||
+        message_size < 1 || message_size >= MAX_MSG_SIZE || wait_ms < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (parse_mix(mix_spec) < 0) {
+        fprintf(stderr, "Invalid mix '%s'\n", mix_spec);
+        return 1;
+    }
+    if (thread_count < 1) thread_count = 1;
+    if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+    if (thread_count > conn_count) thread_count = conn_count;
+    memset(message, 'x', message_size);
+
+    printf("Connecting %d clients to %s...\n", conn_count, host);
+    for (int i = 0; i < conn_count; i++) {
+        if (open_conn(&conns[i], i) < 0) {
+            perror("Setup failed");
+            return 1;
+        }
+    }
+
+    // Consecutive connections per thread
+    int next = 0;
+    for (int i = 0; i < thread_count; i++) {
+        threads[i].conns = &conns[next];
+        threads[i].count = conn_count / thread_count + (i < conn_count % thread_count);
+        next += threads[i].count;
+    }
+
+    printf("Running %s for %d s on %d threads\n", mix_spec, duration_s, thread_count);
+    uint64_t start = monotonic_ns();
+    stop_ns = start + (uint64_t)duration_s * 1000000000ull;
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    Latency* stats = calloc(OP_KINDS, sizeof(Latency));
+    if (!stats) return 1;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (int k = 0; k < OP_KINDS; k++) lat_merge(&stats[k], &threads[i].stats[k]);
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    for (int i = conn_count - 1; i >= 0; i--) close_conn(&conns[i]);
+
+    print_results(stats, elapsed);
+    if (json_path && write_json(json_path, stats, elapsed) != 0) {
+        perror(json_path);
+        return 1;
+    }
+    free(stats);
+    return 0;
+}
@@ -1,134 +1,508 @@
 #include "../inc/common.h"
 #include "../inc/mutex.h"
+#include "../inc/protocol.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
+
+#define PIPELINE_DEPTH 64   // Requests in flight when commands come from a pipe or file
+
+// Request sent to the server and not answered yet
+typedef struct {
+    CommandType type;
+    char name[MAX_MUTEX_NAME];
+    Buffer batch;           // CMD_BATCH / CMD_LOCK_ALL: the operations sent, to label each status
+} PendingRequest;
+
+// Render the server's status code for a command as text
+static void print_response(CommandType type, const char* name, const ProtoResponse* resp) {
+    int len = (int)resp->payload_len;
+    const char* payload = (const char*)resp->payload;
+
+    printf("Server: ");
+    switch ((Status)resp->status) {
+        case STATUS_OK:
+            switch (type) {
+                case CMD_CREATE:
+                    if (len >= 8) {
+                        printf("Mutex '%s' created (handle #%#llx)\n", name,
+                               (unsigned long long)proto_get_u64(resp->payload));
+                    } else {
+                        printf("Mutex '%s' created\n", name);
+                    }
+                    break;
+                case CMD_OPEN:
+                    printf("Handle of mutex '%s': #%#llx\n", name,
+                           len >= 8 ? (unsigned long long)proto_get_u64(resp->payload) : 0ull);
+                    break;
+                case CMD_LOCK: printf("Mutex '%s' locked\n", name); break;
+                case CMD_LOCK_SHARED: printf("Mutex '%s' locked (shared)\n", name); break;
+                case CMD_UNLOCK: printf("Mutex '%s' unlocked\n", name); break;
+                case CMD_RENEW: printf("Lease on mutex '%s' renewed\n", name); break;
+                case CMD_DELETE: printf("Mutex '%s' deleted\n", name); break;
+                case CMD_LIST: printf("%.*s\n", len, payload); break;
+                case CMD_SEND:
+                    printf("SUCCESS:\nMessage sent via mutex '%.20s'\nSERVER REPLY:\n%.*s\n",
+                           name, len, payload);
+                    break;
+                case CMD_EXIT: printf("Goodbye!\n"); break;
+                case CMD_SUBSCRIBE:
+                    printf("Subscribed to mutex '%s' (%llu messages so far)\n", name,
+                           len >= 8 ? (unsigned long long)proto_get_u64(resp->payload) : 0ull);
+                    break;
+                case CMD_UNSUBSCRIBE: printf("Unsubscribed from mutex '%s'\n", name); break;
+                default: printf("OK\n"); break;
+            }
+            break;
+        case STATUS_NOT_FOUND:
+            if (type == CMD_UNSUBSCRIBE) {
+                printf("Not subscribed to mutex '%s'\n", name);
+            } else {
+                printf("Mutex '%s' not found\n", name);
+            }
+            break;
+        case STATUS_EXISTS: printf("Mutex '%s' already exists\n", name); break;
+        case STATUS_LOCKED_OTHER:
+            if (type == CMD_DELETE) {
+                printf("Cannot delete: mutex '%s' is locked by another client\n", name);
+            } else {
+                printf("Mutex '%s' already locked by another client\n", name);
+            }
+            break;
+        case STATUS_LOCKED_SELF: printf("Mutex '%s' already locked by this client\n", name); break;
+        case STATUS_SYSTEM_BUSY: printf("There is already a mutex in the system\n"); break;
+        case STATUS_DEADLOCK: printf("Waiting for mutex '%s' would deadlock, gave up\n", name); break;
+        case STATUS_READ_ONLY: printf("This server is a backup: changes go to the primary\n"); break;
+        case STATUS_NOT_LOCKED: printf("Mutex '%s' already unlocked\n", name); break;
+        case STATUS_NOT_OWNER:
+            printf("Cannot %s: you don't own mutex '%s'\n",
+                   type == CMD_SEND ? "send" : (type == CMD_RENEW ? "renew" : "unlock"), name);
+            break;
+        case STATUS_TIMEOUT: printf("Timed out waiting for mutex '%s'\n", name); break;
+        case STATUS_NO_MEMORY: printf("Cannot create mutex: out of memory\n"); break;
+        case STATUS_INVALID: printf("Invalid command. Type 'help' for available commands.\n"); break;
+        case STATUS_BAD_VERSION: printf("Protocol version not supported by server\n"); break;
+        default: printf("Unknown status %d\n", resp->status); break;
+    }
+}
+
+
+// Print a message pushed for a subscription
+static void print_push(const ProtoResponse* resp) {
+    ProtoMessage msg;
+    if (proto_get_message(resp, &msg) < 0) return;
+
+    if (resp->status == STATUS_NOT_FOUND) {
+        printf("\n[%s] Mutex deleted by PID %d, subscription ended\n", msg.name, msg.pid);
+    } else {
+        printf("\n[%s] #%llu from PID %d: %.*s\n", msg.name, (unsigned long long)msg.seq,
+               msg.pid, (int)msg.text_len, msg.text);
+    }
+}
+
+
+// Interactive mode: print pushed messages until a line can be read from stdin, then
+// the prompt again. Returns false if the connection failed.
+static bool wait_for_input(int sock, Buffer* in, int client_pid) {
+    ProtoResponse resp;
+    int size;
+
+    while (1) {
+        // Frames that arrived together with the last one first
+        bool printed = false;
+        while ((size = proto_get_response(in, &resp)) > 0) {
+            if (resp.op == CMD_MESSAGE) print_push(&resp);
+            buf_consume(in, size);
+            printed = true;
+        }
+        if (printed) printf("[PID:%d]> ", client_pid);
+        fflush(stdout);
+
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sock, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) continue;
+        if (fds[0].revents) return true;
+
+        size = proto_recv_frame(sock, in);
+        if (size <= 0 || proto_get_response(in, &resp) < 0) {
+            printf("\nServer disconnected\n");
+            return false;
+        }
+    }
+}
+
+
+// Print the status of each operation of a BATCH request
+static void print_batch_response(const PendingRequest* req, const ProtoResponse* resp) {
+    const uint8_t* p = req->batch.data;
+    const uint8_t* end = req->batch.data + req->batch.len;
+    uint32_t answered = resp->payload_len / 2;
+    char name[MAX_MUTEX_NAME];
+    uint8_t op;
+
+    for (uint32_t i = 0; i < answered && proto_get_batch_op(&p, end, &op, name) == 1; i++) {
+        ProtoResponse entry = { resp->version, op, proto_get_batch_status(resp, i), NULL, 0 };
+        print_response((CommandType)op, name, &entry);
+    }
+    if (resp->status != STATUS_OK) print_response(CMD_BATCH, "", resp);
+}
+
+
+// Print the outcome of a LOCK_ALL request: on failure, the entry that could not be locked
+static void print_lock_all_response(const PendingRequest* req, const ProtoResponse* resp) {
+    const uint8_t* p = req->batch.data;
+    const uint8_t* end = req->batch.data + req->batch.len;
+    char name[MAX_MUTEX_NAME] = "";
+    uint8_t op;
+    int count = 0;
+
+    int failed = resp->payload_len >= 2 ? proto_get_batch_status(resp, 0) : -1;
+    for (int i = 0; proto_get_batch_op(&p, end, &op, name) == 1 && i != failed; i++) count++;
+
+    if (resp->status == STATUS_OK) {
+        printf("Server: All %d mutexes locked\n", count);
+    } else {
+        ProtoResponse entry = { resp->version, resp->op, resp->status, NULL, 0 };
+        print_response(CMD_LOCK, failed >= 0 ? name : "", &entry);
+    }
+}
+
+
+// Send the queued requests, then read and print one response per pending request.
+// Returns false if the connection failed.
+static bool flush_requests(int sock, Buffer* out, Buffer* in,
+                           PendingRequest* pending, int* pending_count) {
+    bool ok = true;
+
+    if (proto_send_all(sock, out->data, out->len) < 0) {
+        perror("send failed");
+        ok = false;
+    }
+    buf_consume(out, out->len);
+
+    for (int i = 0; i < *pending_count; i++) {
+        PendingRequest* req = &pending[i];
+        ProtoResponse resp;
+
+        int size = ok ? proto_recv_frame(sock, in) : -1;
+        if (ok && size > 0 && proto_get_response(in, &resp) < 0) size = -1;
+
+        // Pushed messages come between responses
+        while (ok && size > 0 && resp.op == CMD_MESSAGE) {
+            print_push(&resp);
+            buf_consume(in, size);
+            size = proto_recv_frame(sock, in);
+            if (size > 0 && proto_get_response(in, &resp) < 0) size = -1;
+        }
+        if (ok && size <= 0) {
+            if (size == 0) {
+                printf("Server disconnected\n");
+            } else {
+                perror("recv failed");
+            }
+            ok = false;
+        }
+
+        if (ok) {
+            // Print server response
+            if (req->type == CMD_BATCH) {
+                print_batch_response(req, &resp);
+            } else if (req->type == CMD_LOCK_ALL) {
+                print_lock_all_response(req, &resp);
+            } else {
+                print_response(req->type, req->name, &resp);
+            }
+            buf_consume(in, size);
+        }
+        buf_free(&req->batch);
+    }
+
+    *pending_count = 0;
+    return ok;
+}
+
+
+// Send one request and wait for its response frame (left at the front of `in`).
+// Returns the frame size, or <= 0 if the connection failed.
+static int round_trip(int sock, Buffer* in, CommandType type, int32_t arg, const char* name,
+                      const char* message, ProtoResponse* resp) {
+    Buffer out = {0};
+    uint32_t msg_len = message ? strlen(message) : 0;
+
+    if (proto_put_request(&out, type, arg, name, message, msg_len) < 0 ||
+        proto_send_all(sock, out.data, out.len) < 0) {
+        perror("send failed");
+        buf_free(&out);
+        return -1;
+    }
+    buf_free(&out);
+
+    int size = proto_recv_frame(sock, in);
+    if (size > 0 && proto_get_response(in, resp) < 0) return -1;
+    return size;
+}
+
 
 int main() {
     int sock = 0;   // Socket file descriptor
-    struct sockaddr_in serv_addr; // Server address structure
     char input[BUFFER_SIZE];  // Buffer for user input
     int client_pid = getpid();  // Get current process ID
     
     printf("Client started (PID: %d)\n", client_pid);
     print_help();
     
-    // Create socket using IPv4 stream
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return -1;
-    }
-    
-    serv_addr.sin_family = AF_INET; // IPv4
-    serv_addr.sin_port = htons(SERVER_PORT);  // Server port in network byte order
-    
-    // Convert IP address string to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address/Address not supported");
-        return -1;
-    }
-    
-    // Connect client to server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    // Connect client to server: the local Unix socket if the server listens there,
+    // else TCP (MUTEX_SERVER_HOST selects another host, or "unix:<path>")
+    if ((sock = proto_connect(getenv("MUTEX_SERVER_HOST"), SERVER_PORT)) < 0) {
         perror("Connection Failed");
         return -1;
     }
     
+    Buffer in = {0};  // Bytes received from the server
+    ProtoResponse resp;
+
     // Send PID to server first
-    if (send(sock, &client_pid, sizeof(client_pid), 0) != sizeof(client_pid)) {
-        perror("Failed to send PID");
+    int size = round_trip(sock, &in, CMD_HELLO, client_pid, NULL, NULL, &resp);
+    if (size <= 0 || resp.status != STATUS_OK) {
+        printf("Failed to send PID\n");
         close(sock);
         return -1;
     }
+    buf_consume(&in, size);
+    
+    // Commands from a pipe or file are pipelined: up to PIPELINE_DEPTH requests are
+    // sent before their responses are read. Interactive input waits for each response.
+    bool pipelined = !isatty(STDIN_FILENO);
+    Buffer out = {0};  // Requests not sent yet
+    PendingRequest pending[PIPELINE_DEPTH];
+    int pending_count = 0;
+    bool connected = true;
     
     while (1) {
-        printf("[PID:%d]> ", client_pid);   // Prompt for input
-        fgets(input, sizeof(input), stdin);  // Read user input
+        if (!pipelined) {
+            printf("[PID:%d]> ", client_pid);   // Prompt for input
+            fflush(stdout);
+            if (!wait_for_input(sock, &in, client_pid)) {
+                connected = false;
+                break;
+            }
+        }
+        if (fgets(input, sizeof(input), stdin) == NULL) break;  // Read user input
         input[strcspn(input, "\n")] = '\0'; // Remove newline
         
         if (strlen(input) == 0) continue;  // Skip empty input
         
-        ClientCommand cmd;
-        cmd.client_pid = client_pid;   // Set client PID in command structure
-        memset(cmd.mutex_name, 0, sizeof(cmd.mutex_name));  // Clear mutex name
-        memset(cmd.message, 0, sizeof(cmd.message));   // Clear message
+        char mutex_name[MAX_MUTEX_NAME] = {0};
+        char* message = NULL;
+        Buffer batch = {0};    // Operations of a BATCH command
+        int timeout_ms = 0;    // LOCK fails immediately unless asked to wait (RENEW: TTL)
+        int ttl_ms = 0;        // LOCK lease, 0 = held until unlocked
+        uint8_t ttl_payload[4];
+        bool replay = false;   // SUBSCRIBE: kept messages first
+        MutexHandle handle = 0;   // "#<handle>" given in place of the mutex name
+        uint8_t after_payload[8];
         
         // Parse first word as command
         char *token = strtok(input, " ");
-        cmd.type = parse_command(token);
+        CommandType type = parse_command(token);
         
-        if (cmd.type == CMD_INVALID) {
+        if (type == CMD_INVALID || type == CMD_HELLO) {
             printf("Invalid command. Type 'help' for available commands.\n");
             continue;
         }
         
-        if (cmd.type == CMD_HELP) {
+        if (type == CMD_HELP) {
             print_help();
             continue;
         }
         
-        if (cmd.type == CMD_EXIT) {
-            cmd.type = CMD_EXIT;
-            send(sock, &cmd, sizeof(cmd), 0);
-            break;
-        }
-        
         // Handle commands with mutex name
-        if (cmd.type == CMD_CREATE || cmd.type == CMD_LOCK || 
-            cmd.type == CMD_UNLOCK || cmd.type == CMD_DELETE || cmd.type == CMD_SEND) {
+        if (type == CMD_CREATE || type == CMD_LOCK || type == CMD_UNLOCK ||
+            type == CMD_DELETE || type == CMD_SEND || type == CMD_RENEW || type == CMD_LOCK_SHARED ||
+            type == CMD_SUBSCRIBE || type == CMD_UNSUBSCRIBE || type == CMD_OPEN) {
             
             token = strtok(NULL, " ");   // Get mutex name
             if (token == NULL) {
-                printf("Error: Mutex name required for command '%s'\n", command_to_string(cmd.type));
+                printf("Error: Mutex name required for command '%s'\n", command_to_string(type));
                 continue;
             }
 
-            strncpy(cmd.mutex_name, token, MAX_MUTEX_NAME - 1);
+            strncpy(mutex_name, token, MAX_MUTEX_NAME - 1);
+            
+            // "#<handle>" (from create or open) names the mutex for lock, unlock, send, delete
+            if (token[0] == '#') {
+                char* end;
+                handle = strtoull(token + 1, &end, 0);
+                if (handle == 0 || *end != '\0' ||
+                    !(type == CMD_LOCK || type == CMD_LOCK_SHARED || type == CMD_UNLOCK ||
+                      type == CMD_DELETE || type == CMD_SEND)) {
+                    printf("Error: Invalid handle '%s' for command '%s'\n", token,
+                           command_to_string(type));
+                    continue;
+                }
+            }
+            
+            // For LOCK command, optional "wait" or timeout in milliseconds, and "ttl <ms>"
+            if (type == CMD_LOCK || type == CMD_LOCK_SHARED) {
+                bool valid = true;
+                while (valid && (token = strtok(NULL, " ")) != NULL) {
+                    if (strcasecmp(token, "ttl") == 0) {
+                        token = strtok(NULL, " ");
+                        ttl_ms = token ? atoi(token) : 0;
+                        if (ttl_ms <= 0) {
+                            printf("Error: Lease TTL must be a number of milliseconds\n");
+                            valid = false;
+                        }
+                    } else {
+                        timeout_ms = (strcasecmp(token, "wait") == 0) ? -1 : atoi(token);
+                        if (timeout_ms == 0) {
+                            printf("Error: Timeout must be 'wait' or a number of milliseconds\n");
+                            valid = false;
+                        }
+                    }
+                }
+                if (!valid) continue;
+            }
+            
+            // "create <mutex> fast" asks for a fast (shared-memory) mutex
+            if (type == CMD_CREATE && (token = strtok(NULL, " ")) != NULL) {
+                if (strcasecmp(token, "fast") != 0) {
+                    printf("Error: Unknown option '%s' for 'create' command\n", token);
+                    continue;
+                }
+                timeout_ms = 1;
+            }
+            
+            // "subscribe <mutex> all" first replays the messages the server kept
+            if (type == CMD_SUBSCRIBE && (token = strtok(NULL, " ")) != NULL) {
+                if (strcasecmp(token, "all") != 0) {
+                    printf("Error: Unknown option '%s' for 'subscribe' command\n", token);
+                    continue;
+                }
+                replay = true;
+            }
+            
+            // For RENEW command, the new lease TTL travels as the argument
+            if (type == CMD_RENEW) {
+                token = strtok(NULL, " ");
+                timeout_ms = token ? atoi(token) : 0;
+                if (timeout_ms <= 0) {
+                    printf("Error: Lease TTL in milliseconds required for 'renew' command\n");
+                    continue;
+                }
+            }
             
             // For SEND command, get the message
-            if (cmd.type == CMD_SEND) {
-                token = strtok(NULL, "");
-                if (token == NULL) {
+            if (type == CMD_SEND) {
+                message = strtok(NULL, "");
+                if (message == NULL) {
                     printf("Error: Message required for 'send' command\n");
                     continue;
                 }
                 
-                // Copy message safely with limit
-                size_t msg_len = strlen(token);
-                size_t copy_len = msg_len < MAX_MSG_SIZE - 1 ? msg_len : MAX_MSG_SIZE - 1;
-                strncpy(cmd.message, token, copy_len);
-                cmd.message[copy_len] = '\0';
+                // Limit message length
+                size_t msg_len = strlen(message);
+                if (msg_len > MAX_MSG_SIZE - 1) message[MAX_MSG_SIZE - 1] = '\0';
                 
                 // Preview message sent
                 printf("[PID:%d] Sending via '%.20s': %.50s%s\n", 
                     client_pid, 
-                    cmd.mutex_name, 
-                    cmd.message, 
+                    mutex_name, 
+                    message, 
                     msg_len > 50 ? "..." : "");
             }
         }
                 
-        // Send command to server
-        if (send(sock, &cmd, sizeof(cmd), 0) < 0) {
-            perror("send failed");
-                break;
+        // BATCH takes pairs of command and mutex name
+        if (type == CMD_BATCH) {
+            bool valid = true;
+            while (valid && (token = strtok(NULL, " ")) != NULL) {
+                CommandType op = parse_command(token);
+                char* name = strtok(NULL, " ");
+                
+                if (op != CMD_CREATE && op != CMD_LOCK && op != CMD_LOCK_SHARED &&
+                    op != CMD_UNLOCK && op != CMD_DELETE) {
+                    printf("Error: Only create, lock, rlock, unlock and delete can be batched\n");
+                    valid = false;
+                } else if (name == NULL || proto_put_batch_op(&batch, op, name) < 0) {
+                    printf("Error: Valid mutex name required after '%s'\n", token);
+                    valid = false;
+                }
+            }
+            if (valid && batch.len == 0) {
+                printf("Error: At least one operation required for 'batch' command\n");
+                valid = false;
+            }
+            if (!valid) {
+                buf_free(&batch);
+                continue;
+            }
         }
         
-        // Receive response from server
-        char response[BUFFER_SIZE] = {0};
-        ssize_t valread = recv(sock, response, sizeof(response) - 1, 0);
-        if (valread <= 0) {
-            if (valread == 0) {
-                printf("Server disconnected\n");
-            } else {
-                perror("recv failed");
+        // LOCK_ALL takes mutex names, optionally followed by "wait" or a timeout in ms
+        if (type == CMD_LOCK_ALL) {
+            bool valid = true;
+            while (valid && (token = strtok(NULL, " ")) != NULL) {
+                if (strcasecmp(token, "wait") == 0) {
+                    timeout_ms = -1;
+                } else if (strspn(token, "0123456789") == strlen(token)) {
+                    timeout_ms = atoi(token);
+                } else if (timeout_ms != 0 || proto_put_batch_op(&batch, CMD_LOCK, token) < 0) {
+                    printf("Error: Invalid mutex name '%s'\n", token);
+                    valid = false;
+                }
+            }
+            if (valid && batch.len == 0) {
+                printf("Error: At least one mutex name required for 'lockall' command\n");
+                valid = false;
+            }
+            if (!valid) {
+                buf_free(&batch);
+                continue;
             }
-            break;
         }
         
-        printf("Server: %s\n", response);  // Print server response
+        // Queue the command; send it and receive responses when the window is full
+        // (or right away in interactive mode)
+        bool batched = (type == CMD_BATCH || type == CMD_LOCK_ALL);
+        uint32_t payload_len = batched ? batch.len : (message ? strlen(message) : 0);
+        const void* payload = batched ? (const void*)batch.data : message;
+        if (replay) {
+            proto_put_u64(after_payload, 0);
+            payload = after_payload;
+            payload_len = sizeof(after_payload);
+        }
+        if (ttl_ms > 0) {
+            proto_put_u32(ttl_payload, ttl_ms);
+            payload = ttl_payload;
+            payload_len = sizeof(ttl_payload);
+        }
+        int rc = handle ? proto_put_handle_request(&out, type, timeout_ms, handle, payload, payload_len)
+                        : proto_put_request(&out, type, timeout_ms, mutex_name, payload, payload_len);
+        if (rc < 0) {
+            printf("Error: Out of memory\n");
+            buf_free(&batch);
+            continue;
+        }
+        
+        PendingRequest* req = &pending[pending_count++];
+        req->type = type;
+        memcpy(req->name, mutex_name, sizeof(req->name));
+        req->batch = batch;
+        
+        if (!pipelined || pending_count == PIPELINE_DEPTH || type == CMD_EXIT) {
+            connected = flush_requests(sock, &out, &in, pending, &pending_count);
+            if (!connected) break;
+        }
+        
+        if (type == CMD_EXIT) break;
     }
     
+    // End of input: collect the responses still outstanding
+    if (connected && pending_count > 0) flush_requests(sock, &out, &in, pending, &pending_count);
+    
+    buf_free(&out);
+    buf_free(&in);
     close(sock);  // Close the socket
     printf("Client (PID: %d) exiting...\n", client_pid);
     return 0;
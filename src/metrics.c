@@ -0,0 +1,88 @@
+#include "../inc/metrics.h"
+#include <stdarg.h>
+
+// Bucket upper bounds in nanoseconds, and as Prometheus "le" labels in seconds
+static const uint64_t bucket_ns[HISTOGRAM_BUCKETS] = {
+    1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 30000000000ull, 100000000000ull
+};
+static const char* bucket_le[HISTOGRAM_BUCKETS] = {
+    "1e-06", "1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10", "30", "100"
+};
+
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void histogram_observe(Histogram* h, uint64_t ns) {
+    int b = 0;
+    while (b < HISTOGRAM_BUCKETS && ns > bucket_ns[b]) b++;
+
+    atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+
+void metrics_printf(Buffer* out, const char* fmt, ...) {
+    char line[512];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+    buf_append(out, line, len);
+}
+
+
+void histogram_format(Buffer* out, const char* name, const char* help, const char* labels,
+                      Histogram* h) {
+    const char* sep = labels ? "," : "";
+    uint64_t cumulative = 0;
+
+    if (help) {
+        metrics_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    }
+    if (!labels) labels = "";
+
+    // The buckets are read one by one while others record: the total is their sum, so
+    // the exported series stays monotonic even if it misses the newest observations
+    for (int b = 0; b <= HISTOGRAM_BUCKETS; b++) {
+        cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        metrics_printf(out, "%s_bucket{%s%sle=\"%s\"} %llu\n", name, labels, sep,
+                       b < HISTOGRAM_BUCKETS ? bucket_le[b] : "+Inf",
+                       (unsigned long long)cumulative);
+    }
+
+    uint64_t sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    const char* open = labels[0] ? "{" : "";
+    const char* close = labels[0] ? "}" : "";
+    metrics_printf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, sum_ns / 1e9);
+    metrics_printf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+                   (unsigned long long)cumulative);
+}
+
+
+void metrics_label_escape(char* out, size_t size, const char* value) {
+    size_t n = 0;
+
+    for (; *value && n + 2 < size; value++) {
+        if (*value == '\\' || *value == '"') {
+            out[n++] = '\\';
+            out[n++] = *value;
+        } else if (*value == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else {
+            out[n++] = *value;
+        }
+    }
+    out[n] = '\0';
+}
@@ -0,0 +1,463 @@
+#include "../inc/common.h"
+#include "../inc/metrics.h"
+#include "../inc/mutex.h"
+
+// Microbenchmark of the registry API (lib/libmutex.a), without sockets: how much of a
+// request's cost is the table itself. Every combination of the listed table sizes, name
+// lengths, hit ratios and contention levels runs each function from 1 thread up to -t,
+// and reports ns per call and the throughput of all threads against one thread.
+//
+// Calls are timed in batches of BATCH so that reading the clock does not weigh on them:
+//   create, delete  create BATCH new names, then delete them (the table size holds)
+//   lock, unlock    lock BATCH names, then unlock the ones granted. A name is one of
+//                   the thread's own, one of the hot names all threads lock (contention)
+//                   or one that does not exist (misses)
+//   send            send through the thread's own mutex, or a missing one
+//   list            format the whole table
+
+#define BATCH 64
+#define MAX_THREADS 256
+#define MAX_SWEEP 16        // Values per swept setting
+#define MAX_HOT 64
+#define LIST_BUF (64 * 1024)
+#define MESSAGE_SIZE 64
+#define PID_BASE 100000
+
+typedef enum { FN_CREATE, FN_DELETE, FN_LOCK, FN_UNLOCK, FN_SEND, FN_LIST, FN_COUNT } BenchFn;
+
+static const char* fn_names[FN_COUNT] = { "create", "delete", "lock", "unlock", "send", "list" };
+static const int fn_phase[FN_COUNT] = { 0, 0, 1, 1, 2, 3 };    // Functions timed together
+
+typedef struct {
+    int index;
+    int pid;
+    int hit_pct;
+    int contention_pct;
+    unsigned int seed;
+    uint64_t ns[FN_COUNT];      // Time spent in each function
+    uint64_t calls[FN_COUNT];
+    uint64_t failed[FN_COUNT];  // Calls that returned an error (misses, contended locks)
+    uint64_t wall_ns[FN_COUNT]; // Of each phase, from start to the last thread done
+    pthread_t thread;
+} Worker;
+
+// One result row
+typedef struct {
+    BenchFn fn;
+    int threads;
+    int table;
+    int name_len;
+    int hit_pct;
+    int contention_pct;
+    uint64_t calls;
+    uint64_t failed;
+    double ns_per_call;
+    double per_second;  // Calls per second, all threads together
+    double scaling;     // per_second against one thread with the same settings
+} Result;
+
+// Settings
+static int max_threads = 4;
+static int iterations = 100000;     // Calls per thread per function (list: / 1000)
+static int tables[MAX_SWEEP] = { 1000 }, table_count = 1;
+static int name_lens[MAX_SWEEP] = { 16 }, name_len_count = 1;
+static int hits[MAX_SWEEP] = { 100 }, hit_count = 1;
+static int contentions[MAX_SWEEP] = { 0 }, contention_count = 1;
+static int hot_count = 4;           // Names behind the contention
+static bool run_fn[FN_COUNT] = { true, true, true, true, true, true };
+static const char* json_path = NULL;
+
+static int name_len;                // Of the configuration running
+static pthread_barrier_t start_barrier, end_barrier;
+static Worker workers[MAX_THREADS];
+static Result* results = NULL;
+static int result_count = 0, result_cap = 0;
+
+
+// A name of name_len characters: the tag and number at the end, padded in front, so names
+// of one table differ late (like "app.jobs.queue-17") and comparisons read all of them
+static void make_name(char* out, const char* tag, int a, int b) {
+    char tail[MAX_MUTEX_NAME];
+    int n = snprintf(tail, sizeof(tail), "%s%d.%d", tag, a, b);
+    int pad = name_len > n ? name_len - n : 0;
+
+    memset(out, 'n', pad);
+    memcpy(out + pad, tail, n + 1);
+}
+
+
+static void add_time(Worker* w, BenchFn fn, uint64_t start, uint64_t calls, uint64_t failed) {
+    w->ns[fn] += monotonic_ns() - start;
+    w->calls[fn] += calls;
+    w->failed[fn] += failed;
+}
+
+
+static void run_create_delete(Worker* w) {
+    char names[BATCH][MAX_MUTEX_NAME];
+    for (int i = 0; i < BATCH; i++) make_name(names[i], "c", w->index, i);
+
+    for (int done = 0; done < iterations; done += BATCH) {
+        uint64_t failed = 0;
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < BATCH; i++) failed += mutex_create(names[i], w->pid) != 0;
+        add_time(w, FN_CREATE, start, BATCH, failed);
+
+        failed = 0;
+        start = monotonic_ns();
+        for (int i = 0; i < BATCH; i++) failed += mutex_delete(names[i], w->pid) != 0;
+        add_time(w, FN_DELETE, start, BATCH, failed);
+    }
+}
+
+
+static void run_lock_unlock(Worker* w) {
+    char own[BATCH][MAX_MUTEX_NAME], missing[BATCH][MAX_MUTEX_NAME];
+    char hot[MAX_HOT][MAX_MUTEX_NAME];
+    const char* batch[BATCH];
+    int granted[BATCH];
+
+    for (int i = 0; i < BATCH; i++) {
+        make_name(own[i], "k", w->index, i);
+        make_name(missing[i], "x", w->index, i);
+    }
+    for (int h = 0; h < hot_count; h++) make_name(hot[h], "h", 0, h);
+
+    for (int done = 0; done < iterations; done += BATCH) {
+        // Names of this batch, each at most once; a hot name taken already falls back to
+        // one of the thread's own
+        bool hot_used[MAX_HOT] = { false };
+        for (int i = 0; i < BATCH; i++) {
+            int r = rand_r(&w->seed) % 100;
+            int h = rand_r(&w->seed) % hot_count;
+            if (r >= w->hit_pct) {
+                batch[i] = missing[i];
+            } else if (rand_r(&w->seed) % 100 < w->contention_pct && !hot_used[h]) {
+                hot_used[h] = true;
+                batch[i] = hot[h];
+            } else {
+                batch[i] = own[i];
+            }
+        }
+
+        int count = 0;
+        uint64_t failed = 0;
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < BATCH; i++) {
+            if (mutex_lock(batch[i], w->pid, 0) == 0) {
+                granted[count++] = i;
+            } else {
+                failed++;
+            }
+        }
+        add_time(w, FN_LOCK, start, BATCH, failed);
+
+        failed = 0;
+        start = monotonic_ns();
+        for (int i = 0; i < count; i++) failed += mutex_unlock(batch[granted[i]], w->pid) != 0;
+        add_time(w, FN_UNLOCK, start, count, failed);
+    }
+}
+
+
+static void run_send(Worker* w) {
+    char own[MAX_MUTEX_NAME], missing[MAX_MUTEX_NAME];
+    char message[MESSAGE_SIZE + 1], response[BUFFER_SIZE], welcome[BUFFER_SIZE];
+    const char* batch[BATCH];
+
+    make_name(own, "s", w->index, 0);
+    make_name(missing, "x", w->index, 0);
+    memset(message, 'm', MESSAGE_SIZE);
+    message[MESSAGE_SIZE] = '\0';
+
+    for (int done = 0; done < iterations; done += BATCH) {
+        for (int i = 0; i < BATCH; i++) {
+            batch[i] = rand_r(&w->seed) % 100 < w->hit_pct ? own : missing;
+        }
+
+        uint64_t failed = 0;
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < BATCH; i++) {
+            failed += mutex_send(batch[i], w->pid, message, response, sizeof(response),
+                                 welcome, sizeof(welcome)) != 0;
+        }
+        add_time(w, FN_SEND, start, BATCH, failed);
+    }
+}
+
+
+static void run_list(Worker* w) {
+    char* buffer = malloc(LIST_BUF);
+    if (!buffer) return;
+
+    int calls = iterations / 1000 + 1;
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < calls; i++) mutex_list(buffer, LIST_BUF);
+    add_time(w, FN_LIST, start, calls, 0);
+    free(buffer);
+}
+
+
+// All threads start the phase of fn together; it ends when the last is done
+static void run_phase(Worker* w, BenchFn fn, void (*body)(Worker* w)) {
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = monotonic_ns();
+    body(w);
+    pthread_barrier_wait(&end_barrier);
+    w->wall_ns[fn_phase[fn]] = monotonic_ns() - start;
+}
+
+
+static void* run_worker(void* arg) {
+    Worker* w = arg;
+
+    if (run_fn[FN_CREATE] || run_fn[FN_DELETE]) run_phase(w, FN_CREATE, run_create_delete);
+    if (run_fn[FN_LOCK] || run_fn[FN_UNLOCK]) run_phase(w, FN_LOCK, run_lock_unlock);
+    if (run_fn[FN_SEND]) run_phase(w, FN_SEND, run_send);
+    if (run_fn[FN_LIST]) run_phase(w, FN_LIST, run_list);
+    return NULL;
+}
+
+
+static void add_result(const Result* r) {
+    if (result_count == result_cap) {
+        int cap = result_cap ? result_cap * 2 : 64;
+        Result* grown = realloc(results, cap * sizeof(Result));
+        if (!grown) return;
+        results = grown;
+        result_cap = cap;
+    }
+    results[result_count++] = *r;
+}
+
+
+// Run every function on `threads` threads and record a row for each
+static int run_threads(int threads, int table, int hit_pct, int contention_pct) {
+    if (pthread_barrier_init(&start_barrier, NULL, threads) != 0 ||
+        pthread_barrier_init(&end_barrier, NULL, threads) != 0) {
+        return -1;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        Worker* w = &workers[t];
+        memset(w, 0, sizeof(*w));
+        w->index = t;
+        w->pid = PID_BASE + t;
+        w->hit_pct = hit_pct;
+        w->contention_pct = contention_pct;
+        w->seed = 12345u + t * 7919u;
+        if (pthread_create(&w->thread, NULL, run_worker, w) != 0) return -1;
+    }
+
+    uint64_t ns[FN_COUNT] = { 0 }, calls[FN_COUNT] = { 0 }, failed[FN_COUNT] = { 0 };
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        for (int f = 0; f < FN_COUNT; f++) {
+            ns[f] += workers[t].ns[f];
+            calls[f] += workers[t].calls[f];
+            failed[f] += workers[t].failed[f];
+        }
+    }
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&end_barrier);
+
+    for (int f = 0; f < FN_COUNT; f++) {
+        if (!run_fn[f] || calls[f] == 0) continue;
+
+        // Throughput over the phase's wall time, the share of it spent in f (threads may
+        // outnumber CPUs, so their ns per call overlap less than it seems)
+        uint64_t phase_ns = 0;
+        for (int g = 0; g < FN_COUNT; g++) phase_ns += fn_phase[g] == fn_phase[f] ? ns[g] : 0;
+        double wall = (double)workers[0].wall_ns[fn_phase[f]] * ns[f] / phase_ns;
+
+        Result r = { f, threads, table, name_len, hit_pct, contention_pct, calls[f], failed[f],
+                     (double)ns[f] / calls[f], calls[f] * 1e9 / wall, 1 };
+        for (int i = result_count - 1; i >= 0; i--) {
+            Result* base = &results[i];
+            if (base->fn == r.fn && base->threads == 1 && base->table == r.table &&
+                base->name_len == r.name_len && base->hit_pct == r.hit_pct &&
+                base->contention_pct == r.contention_pct) {
+                r.scaling = r.per_second / base->per_second;
+                break;
+            }
+        }
+        add_result(&r);
+        printf("%-7s %7d %8d %5d %5d%% %5d%% %11llu %10.1f %11.0f %7.2fx %9.1f%%\n",
+               fn_names[f], threads, table, name_len, hit_pct, contention_pct,
+               (unsigned long long)r.calls, r.ns_per_call, r.per_second, r.scaling,
+               100.0 * r.failed / r.calls);
+    }
+    return 0;
+}
+
+
+// Create the names the threads use, plus filler up to `table` mutexes; delete them
+// again with create false. Returns the table size (more than `table` if the threads need
+// more names), -1 if a create failed.
+static int setup_table(int table, bool create) {
+    char name[MAX_MUTEX_NAME];
+    int made = 0;
+
+    for (int t = 0; t < max_threads; t++) {
+        int pid = PID_BASE + t;
+        for (int i = 0; i < BATCH; i++, made++) {
+            make_name(name, "k", t, i);
+            if (!create) mutex_delete(name, pid);
+            else if (mutex_create(name, pid) != 0) return -1;
+        }
+        make_name(name, "s", t, 0);
+        made++;
+        if (!create) {
+            mutex_delete(name, pid);
+        } else if (mutex_create(name, pid) != 0 || mutex_lock(name, pid, 0) != 0) {
+            return -1;
+        }
+    }
+    for (int h = 0; h < hot_count; h++, made++) {
+        make_name(name, "h", 0, h);
+        if (!create) mutex_delete(name, PID_BASE);
+        else if (mutex_create(name, PID_BASE) != 0) return -1;
+    }
+    for (int i = 0; made < table; i++, made++) {
+        make_name(name, "f", 0, i);
+        if (!create) mutex_delete(name, PID_BASE);
+        else if (mutex_create(name, PID_BASE) != 0) return -1;
+    }
+    return made;
+}
+
+
+static int write_json(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return -1;
+
+    fprintf(f, "{\n  \"iterations\": %d,\n  \"hot\": %d,\n  \"results\": [", iterations, hot_count);
+    for (int i = 0; i < result_count; i++) {
+        const Result* r = &results[i];
+        fprintf(f, "%s\n    {\"fn\": \"%s\", \"threads\": %d, \"table\": %d, \"name_len\": %d, "
+                   "\"hit_pct\": %d, \"contention_pct\": %d, \"calls\": %llu, \"failed\": %llu, "
+                   "\"ns_per_call\": %.2f, \"calls_per_s\": %.0f, \"scaling\": %.3f}",
+                i ? "," : "", fn_names[r->fn], r->threads, r->table, r->name_len, r->hit_pct,
+                r->contention_pct, (unsigned long long)r->calls, (unsigned long long)r->failed,
+                r->ns_per_call, r->per_second, r->scaling);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f);
+}
+
+
+// Comma-separated values within [min, max]. Returns how many, -1 if invalid.
+static int parse_list(const char* arg, int* values, int min, int max) {
+    int count = 0;
+    const char* p = arg;
+
+    while (*p && count < MAX_SWEEP) {
+        char* end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < min || v > max) return -1;
+        values[count++] = (int)v;
+        if (*end == '\0') return count;
+        if (*end != ',') return -1;
+        p = end + 1;
+    }
+    return -1;
+}
+
+
+static int parse_fns(const char* arg) {
+    char copy[128];
+    char* save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", arg);
+    memset(run_fn, 0, sizeof(run_fn));
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        int f = 0;
+        while (f < FN_COUNT && strcmp(fn_names[f], item) != 0) f++;
+        if (f == FN_COUNT) return -1;
+        run_fn[f] = true;
+    }
+    return 0;
+}
+
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  -t <n>        Up to n threads: 1, 2, 4, ... and n (default 4)\n"
+           "  -i <n>        Calls per thread per function (default 100000, list: n/1000+1)\n"
+           "  -n <sizes>    Mutexes in the table, at least %d per thread (default 1000)\n"
+           "  -l <lengths>  Name length, 8..%d (default 16)\n"
+           "  -r <pcts>     Percent of lock and send calls on existing names (default 100)\n"
+           "  -c <pcts>     Percent of locks on the hot names all threads use (default 0)\n"
+           "  -H <n>        Hot names (default 4)\n"
+           "  -f <fns>      Functions to run (default create,delete,lock,unlock,send,list)\n"
+           "  -o <file>     Write the results as JSON\n"
+           "-n, -l, -r and -c take comma-separated lists; every combination is run.\n",
+           prog, BATCH + 1, MAX_MUTEX_NAME - 1);
+}
+
+
+int main(int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:n:l:r:c:H:f:o:h")) != -1) {
+        int rc = 0;
+        switch (opt) {
+            case 't': max_threads = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 'n': rc = table_count = parse_list(optarg, tables, 0, 10000000); break;
+            case 'l': rc = name_len_count = parse_list(optarg, name_lens, 8, MAX_MUTEX_NAME - 1); break;
+            case 'r': rc = hit_count = parse_list(optarg, hits, 0, 100); break;
+            case 'c': rc = contention_count = parse_list(optarg, contentions, 0, 100); break;
+            case 'H': hot_count = atoi(optarg); break;
+            case 'f': rc = parse_fns(optarg); break;
+            case 'o': json_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+        if (rc < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || iterations < 1 ||
+        hot_count < 1 || hot_count > MAX_HOT) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mutex_init();
+
+    printf("%-7s %7s %8s %5s %6s %6s %11s %10s %11s %8s %10s\n", "fn", "threads", "table",
+           "name", "hit", "cont", "calls", "ns/call", "calls/s", "scaling", "failed");
+    for (int ti = 0; ti < table_count; ti++) {
+        for (int li = 0; li < name_len_count; li++) {
+            name_len = name_lens[li];
+            int table = setup_table(tables[ti], true);
+            if (table < 0) {
+                fprintf(stderr, "Cannot create %d mutexes\n", tables[ti]);
+                return 1;
+            }
+            for (int hi = 0; hi < hit_count; hi++) {
+                for (int ci = 0; ci < contention_count; ci++) {
+                    for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2
+                                                                                  : max_threads) {
+                        if (run_threads(threads, table, hits[hi], contentions[ci]) < 0) {
+                            perror("Cannot start threads");
+                            return 1;
+                        }
+                        if (threads == max_threads) break;
+                    }
+                }
+            }
+            setup_table(tables[ti], false);
+        }
+    }
+
+    if (json_path && write_json(json_path) != 0) {
+        perror(json_path);
+        return 1;
+    }
+    free(results);
+    return 0;
+}
@@ -1,251 +1,2242 @@
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
 #include "../inc/mutex.h"
 #include "../inc/common.h"
+#include "../inc/repl.h"
+#include "../inc/shmtable.h"
+#include "../inc/wal.h"
+#include <sched.h>
+#include <stdatomic.h>
 
-Mutex mutexes[MAX_MUTEXES];
-int mutex_count = 0;
-pthread_mutex_t global_mutex_lock = PTHREAD_MUTEX_INITIALIZER; // Mutex static initialization  
+#define MUTEX_CHUNK_SIZE 256      // Slots allocated at a time (slots never move once allocated)
+#define MUTEX_MIN_BUCKETS 16      // Initial hash index size per stripe (power of two)
+#define MUTEX_STRIPE_BITS 6
+#define MUTEX_STRIPES (1 << MUTEX_STRIPE_BITS)  // Independent registry stripes
+#define MUTEX_DELETE_LOG 1024     // Deletions remembered for mutex_foreach_deleted
+#define MUTEX_HANDLE_SLOT_BITS 26 // Handles: slot incarnation (32 bits) | stripe | slot index
+
+_Static_assert(sizeof(Mutex) == 64, "a registry slot is one cache line");
+
+_Atomic int mutex_count = 0;
+Histogram mutex_hold_time[2];
+Histogram mutex_wait_time;
+
+// Mutex registry, split into stripes by name hash. Each stripe has its own lock, its own
+// chunked slot storage and its own chained hash index, so operations on names that fall
+// into different stripes never wait for each other.
+// Deleted slots go on the stripe's free list and are reused, so nothing is ever shifted.
+// A slot holds only the lock state (one cache line, see Mutex); the name and counters
+// are in a MutexCold allocated to fit the name, and waiters, shared holders, lock words,
+// messages and subscribers in a MutexExtra allocated when first needed.
+//
+// The stripe lock is a reader-writer lock. Uncontended exclusive locks and unlocks, and
+// permission checks, only read-lock the stripe (the entry cannot be created, deleted or
+// moved meanwhile) and change the Mutex.state word with a CAS, so they run in parallel
+// with each other. Everything else, including any lock or unlock that involves waiters,
+// shared holders or a fast mutex, write-locks the stripe and never sees a BUSY word.
+typedef struct {
+    pthread_rwlock_t lock;  // Guards every field below and the Mutex slots of this stripe
+    Mutex** chunks;         // Slot storage, MUTEX_CHUNK_SIZE slots per chunk
+    int chunk_count;
+    int slot_count;         // High-water mark of slots handed out
+    int free_slot;          // Head of the free slot list
+    int* buckets;           // Hash index: first slot of each bucket, -1 = empty
+    uint32_t bucket_count;
+    int count;              // Live mutexes in this stripe
+    int fast_count;         // Fast mutexes among them
+    _Atomic uint64_t generation;    // Newest changed_gen in this stripe
+    _Atomic int notifying;          // notify() calls that may not have raised it yet
+} __attribute__((aligned(64))) Stripe;
+
+static Stripe stripes[MUTEX_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+// Incarnation of new slots, drawn by mutex_init: handles from an earlier registry (or
+// another server) then match a slot of this one only by a 1 in 2^32 coincidence
+static uint32_t incarnation_base = 1;
+
+// A mutex asked for by name, or by handle if name is NULL. A lookup by handle copies
+// the mutex's name to found_name (MAX_MUTEX_NAME bytes) unless that is NULL.
+typedef struct {
+    const char* name;
+    MutexHandle handle;
+    char* found_name;
+} MutexKey;
+
+// Waiter states
+enum { WAIT_IDLE, WAIT_QUEUED, WAIT_WAKING };
+#define WAIT_RETRY 1    // Internal wake status: try to acquire again
+
+// Wait-for graph used to detect deadlocks: one node per PID that has parked waiters
+// (kept once created), found through an open-addressing table keyed by PID. A node's
+// edges lead to the PIDs holding the mutexes its waiters are queued on.
+typedef struct {
+    int pid;                    // 0 = empty slot
+    MutexWaiter* parked;        // Parked waiters of this PID, linked through graph_next
+    int parked_count;
+    uint32_t visit;             // Search pass that last reached this node
+    int depth;                  // Position on the current search path, -1 = finished
+} WaitNode;
+
+// graph_lock is the innermost lock: it is taken while holding stripe locks
+static pthread_mutex_t graph_lock = PTHREAD_MUTEX_INITIALIZER;
+static WaitNode* wait_nodes = NULL;
+static uint32_t wait_node_cap = 0;     // Power of two
+static uint32_t wait_node_used = 0;
+static uint64_t park_seq = 0;          // Orders parked waiters by age (victim choice)
+static uint32_t visit_pass = 0;
+
+// Set when a new wait-for edge may have closed a cycle; cleared by check_deadlocks
+static _Atomic bool deadlock_check_pending = false;
+
+// Shared-memory lock table of fast mutexes, NULL when disabled. shm_slots_lock
+// serializes slot creation and removal (taken under a stripe lock).
+static ShmTable* shm_table = NULL;
+static pthread_mutex_t shm_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t shm_thread;
+
+// Set once at startup, NULL = nobody is watching
+static mutex_observer observer = NULL;
+
+// Registry generation, and the names of recently deleted mutexes (a ring buffer).
+// Deletions take their generation under delete_log_lock (innermost, like graph_lock),
+// so a reader that saw the generation also finds the entry.
+typedef struct {
+    char name[MAX_MUTEX_NAME];
+    uint64_t generation;
+} DeletedMutex;
+
+static _Atomic uint64_t generation = 0;
+static _Atomic int fast_count = 0;
+static pthread_mutex_t delete_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static DeletedMutex delete_log[MUTEX_DELETE_LOG];
+static uint64_t delete_count = 0;       // Entries ever logged
+static uint64_t delete_floor = 0;       // Newest generation overwritten in the ring
+
+
+// Top bits of the hash pick the stripe, low bits pick the bucket inside it
+static Stripe* stripe_of(uint32_t hash) {
+    return &stripes[hash >> (32 - MUTEX_STRIPE_BITS)];
+}
+
+
+static Mutex* slot_at(Stripe* st, int index) {
+    return &st->chunks[index / MUTEX_CHUNK_SIZE][index % MUTEX_CHUNK_SIZE];
+}
+
+
+// Extras of m, allocated the first time they are needed (NULL if out of memory)
+static MutexExtra* need_extra(Mutex* m) {
+    if (m->cold->extra == NULL) m->cold->extra = calloc(1, sizeof(MutexExtra));
+    return m->cold->extra;
+}
+
+
+// Shared holders of m (only while m->reader_count > 0, or room was reserved)
+static SharedHolder* readers_of(const Mutex* m) {
+    return m->cold->extra->readers;
+}
+
+
+static MutexWaiter* first_waiter(const Mutex* m) {
+    return m->cold->extra ? m->cold->extra->wait_head : NULL;
+}
+
+
+static ShmSlot* lock_word(const Mutex* m) {
+    return m->cold->extra ? m->cold->extra->shm : NULL;
+}
+
+
+// Find a mutex by name in its stripe and return its slot, -1 if not found (caller
+// holds st->lock)
+static int find_slot(Stripe* st, const char* name, uint32_t h) {
+    if (st->bucket_count == 0) return -1;
+
+    for (int i = st->buckets[h & (st->bucket_count - 1)]; i != -1; i = slot_at(st, i)->next) {
+        Mutex* m = slot_at(st, i);
+        if (m->hash == h && strcmp(m->cold->name, name) == 0) return i;
+    }
+    return -1;
+}
+
+
+static Mutex* find_mutex(Stripe* st, const char* name, uint32_t h) {
+    int i = find_slot(st, name, h);
+    return i != -1 ? slot_at(st, i) : NULL;
+}
+
+
+static MutexHandle handle_of(Stripe* st, int index) {
+    return (uint64_t)slot_at(st, index)->incarnation << 32 |
+           (uint64_t)(st - stripes) << MUTEX_HANDLE_SLOT_BITS | (uint64_t)index;
+}
+
+
+static void free_message(SharedBuf* frame) {
+    free(frame);  // First member of its MutexMessage
+}
+
+
+// A message with its CMD_MESSAGE frame and one reference, NULL if out of memory
+static MutexMessage* new_message(const char* name, Status status, uint64_t seq, int pid,
+                                 time_t time, const char* text) {
+    size_t text_len = strlen(text);
+    size_t size = proto_message_size(strlen(name), text_len);
+
+    MutexMessage* msg = malloc(sizeof(MutexMessage) + size + 1);
+    if (!msg) return NULL;
+    uint8_t* data = (uint8_t*)(msg + 1);
+    proto_put_message(data, status, seq, time, pid, name, text, text_len);
+    data[size] = '\0';
+
+    atomic_init(&msg->frame.refs, 1);
+    msg->frame.len = size;
+    msg->frame.data = data;
+    msg->frame.destroy = free_message;
+    msg->seq = seq;
+    msg->lsn = 0;
+    msg->pid = pid;
+    msg->time = time;
+    msg->text = (const char*)data + size - text_len;
+    return msg;
+}
+
+
+// Make msg (and its reference) the newest message of m, dropping the oldest one once
+// the ring is full. Returns false if out of memory.
+static bool keep_message(Mutex* m, MutexMessage* msg) {
+    MutexExtra* x = need_extra(m);
+    if (x == NULL) return false;
+    if (x->messages == NULL) {
+        x->messages = calloc(MUTEX_MESSAGE_RING, sizeof(MutexMessage*));
+        if (x->messages == NULL) return false;
+    }
+
+    MutexMessage** slot = &x->messages[msg->seq & (MUTEX_MESSAGE_RING - 1)];
+    if (*slot) shared_release(&(*slot)->frame);
+    *slot = msg;
+    x->last_message = msg;
+    return true;
+}
+
+
+static uint64_t newest_seq(const Mutex* m) {
+    MutexMessage* last = mutex_last_message(m);
+    return last ? last->seq : 0;
+}
+
+
+// Kept message number seq of m, NULL if it is not in the ring
+static MutexMessage* kept_message(const Mutex* m, uint64_t seq) {
+    if (m->cold->extra == NULL || m->cold->extra->messages == NULL) return NULL;
+    MutexMessage* msg = m->cold->extra->messages[seq & (MUTEX_MESSAGE_RING - 1)];
+    return msg && msg->seq == seq ? msg : NULL;
+}
+
+
+// Oldest seq still in the ring of m (newest_seq + 1 if there is none)
+static uint64_t oldest_seq(const Mutex* m) {
+    uint64_t newest = newest_seq(m);
+    uint64_t oldest = newest > MUTEX_MESSAGE_RING ? newest - MUTEX_MESSAGE_RING + 1 : 1;
+    while (oldest <= newest && kept_message(m, oldest) == NULL) oldest++;
+    return oldest;
+}
+
+
+// The mutex is going away: end its subscriptions with a NOT_FOUND push
+static void end_subscriptions(Mutex* m, int client_pid) {
+    MutexMessage* end = new_message(m->cold->name, STATUS_NOT_FOUND, 0, client_pid, time(NULL), "");
+    if (end == NULL) printf("Out of memory: subscribers of '%s' miss its deletion\n", m->cold->name);
+
+    MutexSubscriber* s = m->cold->extra->subscribers;
+    m->cold->extra->subscribers = NULL;
+    while (s != NULL) {
+        MutexSubscriber* next = s->next;
+        if (end) s->deliver(s, end);
+        s = next;
+    }
+    if (end) shared_release(&end->frame);
+}
+
+
+// Append a change to the write-ahead log as the state it leaves behind (see wal.h)
+static void log_change(MutexEvent event, const Mutex* m, int client_pid) {
+    WalRecord r = { .type = event, .pid = client_pid, .name = m->cold->name, .message = "" };
+    MutexMessage* last = mutex_last_message(m);
+
+    if (lock_word(m)) r.flags |= WAL_FAST;
+    if (event == MUTEX_EVENT_CREATE) {
+        r.pid = mutex_owner(m);
+    } else if (event == MUTEX_EVENT_LOCK) {
+        if (m->reader_count > 0) r.flags |= WAL_SHARED;
+        r.time = m->lock_time;
+    } else if (event == MUTEX_EVENT_SEND) {
+        r.seq = last->seq;
+        r.message = last->text;
+        r.time = last->time;
+    }
+
+    uint64_t lsn = wal_append(&r);
+    if (event == MUTEX_EVENT_SEND) last->lsn = lsn;  // Pushes wait for it
+}
+
+
+// Every registry change ends here (caller holds the stripe lock of m, or the read lock
+// and the BUSY bit of m)
+static void notify(MutexEvent event, Mutex* m, int client_pid) {
+    Stripe* st = stripe_of(m->hash);
+
+    // Until generation is raised below, snapshots must not skip st on its account
+    atomic_fetch_add(&st->notifying, 1);
+    if (event == MUTEX_EVENT_DELETE) {
+        pthread_mutex_lock(&delete_log_lock);
+        DeletedMutex* d = &delete_log[delete_count++ % MUTEX_DELETE_LOG];
+        if (delete_count > MUTEX_DELETE_LOG) delete_floor = d->generation;
+        m->changed_gen = atomic_fetch_add(&generation, 1) + 1;
+        d->generation = m->changed_gen;
+        strcpy(d->name, m->cold->name);
+        pthread_mutex_unlock(&delete_log_lock);
+    } else {
+        m->changed_gen = atomic_fetch_add(&generation, 1) + 1;
+    }
+    // Lock-free updates of other mutexes in the stripe may be raising it too
+    uint64_t newest = atomic_load(&st->generation);
+    while (newest < m->changed_gen &&
+           !atomic_compare_exchange_weak(&st->generation, &newest, m->changed_gen)) {
+    }
+    atomic_fetch_sub(&st->notifying, 1);
+
+    if (wal_enabled()) log_change(event, m, client_pid);
+    if (observer != NULL) observer(event, m, client_pid);
+
+    if (event == MUTEX_EVENT_SEND) {
+        MutexExtra* x = m->cold->extra;
+        for (MutexSubscriber* s = x->subscribers; s != NULL; s = s->next) {
+            s->deliver(s, x->last_message);
+        }
+    }
+}
+
+
+// Store the owner and lock flag of m, keeping the BUSY bit of a lock-free update
+// in progress (there is none under the stripe write lock)
+static void set_state(Mutex* m, int owner, bool locked) {
+    uint64_t busy = atomic_load(&m->state) & MUTEX_STATE_BUSY;
+    atomic_store(&m->state, (uint32_t)owner | (locked ? MUTEX_STATE_LOCKED : 0) | busy);
+}
+
+
+// A fast mutex may be locked and unlocked through its shared lock word without the
+// server knowing: bring the registry fields in line with the word (caller holds the
+// stripe lock). Holds taken that way have no owner token.
+static void sync_fast(Mutex* m) {
+    if (m == NULL || lock_word(m) == NULL) return;
+
+    int owner = (int)shm_owner(lock_word(m));
+    if (mutex_locked(m) && mutex_owner(m) != owner) {
+        set_state(m, mutex_owner(m), false);
+        m->owner_token = 0;
+        m->lock_time = 0;
+        m->acquired_ns = 0;  // Released through the word: hold time unknown
+        notify(MUTEX_EVENT_UNLOCK, m, mutex_owner(m));
+    }
+    if (owner != 0 && !mutex_locked(m)) {
+        set_state(m, owner, true);
+        m->owner_token = 0;
+        m->lock_time = time(NULL);
+        notify(MUTEX_EVENT_LOCK, m, owner);
+    }
+}
+
+
+// Hash the name, lock its stripe and look it up. Returns the stripe locked even if not found.
+static Mutex* lookup_locked(const char* name, Stripe** out) {
+    uint32_t h = mutex_name_hash(name);
+    Stripe* st = stripe_of(h);
+
+    pthread_rwlock_wrlock(&st->lock);
+    *out = st;
+
+    Mutex* m = find_mutex(st, name, h);
+    sync_fast(m);
+    return m;
+}
+
+
+// Hash the name, read-lock its stripe and look it up, for the lock-free paths: the entry
+// cannot be created, deleted or moved meanwhile, but its state word can change. Fast
+// mutexes are not synced. Returns the stripe read-locked even if not found.
+static Mutex* lookup_shared(const char* name, Stripe** out) {
+    uint32_t h = mutex_name_hash(name);
+    Stripe* st = stripe_of(h);
+
+    pthread_rwlock_rdlock(&st->lock);
+    *out = st;
+    return find_mutex(st, name, h);
+}
+
+
+// Lock the stripe of a handle (write: like lookup_locked, else like lookup_shared) and
+// return its mutex, NULL if the mutex was deleted or the handle was never issued here
+static Mutex* lookup_handle(MutexHandle handle, Stripe** out, bool write) {
+    Stripe* st = &stripes[(handle >> MUTEX_HANDLE_SLOT_BITS) & (MUTEX_STRIPES - 1)];
+    int index = (int)(handle & ((1u << MUTEX_HANDLE_SLOT_BITS) - 1));
+
+    if (write) {
+        pthread_rwlock_wrlock(&st->lock);
+    } else {
+        pthread_rwlock_rdlock(&st->lock);
+    }
+    *out = st;
+
+    if (index >= st->slot_count) return NULL;
+    Mutex* m = slot_at(st, index);
+    if (m->cold == NULL || m->incarnation != (uint32_t)(handle >> 32)) return NULL;
+    if (write) sync_fast(m);
+    return m;
+}
+
+
+static Mutex* lookup_key(const MutexKey* k, Stripe** out, bool write) {
+    if (k->name) return write ? lookup_locked(k->name, out) : lookup_shared(k->name, out);
+
+    Mutex* m = lookup_handle(k->handle, out, write);
+    if (m != NULL && k->found_name) strcpy(k->found_name, m->cold->name);
+    return m;
+}
+
+
+// Double the stripe's hash index and relink every live slot (caller holds st->lock)
+static int grow_buckets(Stripe* st) {
+    uint32_t new_count = st->bucket_count ? st->bucket_count * 2 : MUTEX_MIN_BUCKETS;
+    int* new_buckets = malloc(new_count * sizeof(int));
+    if (!new_buckets) return -1;
+
+    for (uint32_t b = 0; b < new_count; b++) new_buckets[b] = -1;
+
+    for (int i = 0; i < st->slot_count; i++) {
+        Mutex* m = slot_at(st, i);
+        if (m->cold == NULL) continue;  // Free slot
+        uint32_t b = m->hash & (new_count - 1);
+        m->next = new_buckets[b];
+        new_buckets[b] = i;
+    }
+
+    free(st->buckets);
+    st->buckets = new_buckets;
+    st->bucket_count = new_count;
+    return 0;
+}
+
+
+// Take a slot from the free list or from the end of storage, -1 if out of memory
+static int alloc_slot(Stripe* st) {
+    if (st->free_slot != -1) {
+        int i = st->free_slot;
+        st->free_slot = slot_at(st, i)->next;
+        return i;
+    }
+
+    if (st->slot_count == 1 << MUTEX_HANDLE_SLOT_BITS) return -1;
+    if (st->slot_count == st->chunk_count * MUTEX_CHUNK_SIZE) {
+        Mutex** new_chunks = realloc(st->chunks, (st->chunk_count + 1) * sizeof(Mutex*));
+        if (!new_chunks) return -1;
+        st->chunks = new_chunks;
+
+        // Aligned so that every slot is one cache line
+        Mutex* chunk = aligned_alloc(64, MUTEX_CHUNK_SIZE * sizeof(Mutex));
+        if (!chunk) return -1;
+        memset(chunk, 0, MUTEX_CHUNK_SIZE * sizeof(Mutex));
+        st->chunks[st->chunk_count] = chunk;
+        for (int i = 0; i < MUTEX_CHUNK_SIZE; i++) {
+            st->chunks[st->chunk_count][i].incarnation = incarnation_base;
+        }
+        st->chunk_count++;
+    }
+    return st->slot_count++;
+}
+
+
+// Free the cold part of a mutex, with its extras and its kept messages
+static void free_cold(MutexCold* cold) {
+    MutexExtra* x = cold->extra;
+    if (x != NULL) {
+        free(x->readers);
+        if (x->messages) {
+            for (int i = 0; i < MUTEX_MESSAGE_RING; i++) {
+                if (x->messages[i]) shared_release(&x->messages[i]->frame);
+            }
+            free(x->messages);
+        }
+        free(x);
+    }
+    free(cold);
+}
+
+
+// Unlink a mutex from its hash bucket and put its slot on the free list
+static void free_mutex(Stripe* st, Mutex* m) {
+    int* link = &st->buckets[m->hash & (st->bucket_count - 1)];
+
+    while (slot_at(st, *link) != m) link = &slot_at(st, *link)->next;
+    int index = *link;
+    *link = m->next;
+
+    free_cold(m->cold);
+
+    // Handles of the mutex stop matching the slot (incarnations are never 0)
+    uint32_t incarnation = m->incarnation + 1 ? m->incarnation + 1 : 1;
+    memset(m, 0, sizeof(*m));
+    m->incarnation = incarnation;
+    set_state(m, -1, false);
+    m->next = st->free_slot;
+    st->free_slot = index;
+}
+
+
+// Index of pid among the shared holders of m, -1 if it is not one
+static int find_reader(const Mutex* m, int client_pid) {
+    for (int i = 0; i < m->reader_count; i++) {
+        if (readers_of(m)[i].pid == client_pid) return i;
+    }
+    return -1;
+}
+
+
+// Does pid hold m, in either mode?
+static bool holds(const Mutex* m, int client_pid) {
+    if (!mutex_locked(m)) return false;
+    if (m->reader_count > 0) return find_reader(m, client_pid) >= 0;
+    return mutex_owner(m) == client_pid;
+}
+
+
+// Make room for one more shared holder before taking any hold (false if out of memory)
+static bool reserve_reader(Mutex* m) {
+    MutexExtra* x = need_extra(m);
+    if (x == NULL) return false;
+    if (m->reader_count < x->reader_cap) return true;
+
+    int new_cap = x->reader_cap ? x->reader_cap * 2 : 4;
+    SharedHolder* new_readers = malloc(new_cap * sizeof(SharedHolder));
+    if (!new_readers) return false;
+    if (m->reader_count > 0) memcpy(new_readers, x->readers, m->reader_count * sizeof(SharedHolder));
+
+    // The deadlock search reads the holders under graph_lock only: swap the array under it
+    SharedHolder* old_readers = x->readers;
+    pthread_mutex_lock(&graph_lock);
+    x->readers = new_readers;
+    x->reader_cap = new_cap;
+    pthread_mutex_unlock(&graph_lock);
+    free(old_readers);
+    return true;
+}
+
+
+// Record a granted hold on m (room for a reader was reserved)
+static void grant(Mutex* m, int client_pid, uint64_t owner_token, bool shared) {
+    uint64_t now = monotonic_ns();
+    if (shared) {
+        SharedHolder* reader = &readers_of(m)[m->reader_count++];
+        reader->pid = client_pid;
+        reader->owner_token = owner_token;
+        reader->acquired_ns = now;
+        m->owner_token = 0;
+    } else {
+        m->owner_token = owner_token;
+        m->acquired_ns = now;
+    }
+    m->cold->acquires++;
+    set_state(m, client_pid, true);
+    m->lock_time = time(NULL);
+    notify(MUTEX_EVENT_LOCK, m, client_pid);
+}
+
+
+// Append to / remove from a doubly linked waiter queue
+static void queue_push(MutexWaiter** head, MutexWaiter** tail, MutexWaiter* w) {
+    w->next = NULL;
+    w->prev = *tail;
+    if (*tail) (*tail)->next = w;
+    else *head = w;
+    *tail = w;
+}
+
+
+static void queue_remove(MutexWaiter** head, MutexWaiter** tail, MutexWaiter* w) {
+    if (w->prev) w->prev->next = w->next;
+    else *head = w->next;
+    if (w->next) w->next->prev = w->prev;
+    else *tail = w->prev;
+    w->prev = w->next = NULL;
+}
+
+
+// Wake w later, once the caller has dropped its locks
+static void queue_woken(MutexWaiter** head, MutexWaiter** tail, MutexWaiter* w, int status) {
+    w->status = status;
+    atomic_store(&w->state, WAIT_WAKING);
+    queue_push(head, tail, w);
+}
+
+
+// Graph node of pid, created if asked (NULL if absent or out of memory).
+// Caller holds graph_lock.
+static WaitNode* wait_node(int pid, bool create) {
+    if (wait_node_cap > 0) {
+        uint32_t i = ((uint32_t)pid * 2654435761u) & (wait_node_cap - 1);
+        while (wait_nodes[i].pid != 0) {
+            if (wait_nodes[i].pid == pid) return &wait_nodes[i];
+            i = (i + 1) & (wait_node_cap - 1);
+        }
+        if (!create) return NULL;
+
+        // Keep the table at most half full
+        if ((wait_node_used + 1) * 2 <= wait_node_cap) {
+            wait_nodes[i].pid = pid;
+            wait_nodes[i].depth = -1;
+            wait_node_used++;
+            return &wait_nodes[i];
+        }
+    }
+    if (!create) return NULL;
+
+    // Grow and rehash; nodes hold no pointers into the table
+    uint32_t new_cap = wait_node_cap ? wait_node_cap * 2 : 64;
+    WaitNode* new_nodes = calloc(new_cap, sizeof(WaitNode));
+    if (!new_nodes) return NULL;
+
+    for (uint32_t j = 0; j < wait_node_cap; j++) {
+        if (wait_nodes[j].pid == 0) continue;
+        uint32_t i = ((uint32_t)wait_nodes[j].pid * 2654435761u) & (new_cap - 1);
+        while (new_nodes[i].pid != 0) i = (i + 1) & (new_cap - 1);
+        new_nodes[i] = wait_nodes[j];
+    }
+    free(wait_nodes);
+    wait_nodes = new_nodes;
+    wait_node_cap = new_cap;
+    return wait_node(pid, true);
+}
+
+
+// True if a PID holding m is itself waiting, i.e. waiting on m extends a chain of
+// waits that may lead back to the waiter. Caller holds graph_lock.
+static bool holder_is_waiting(const Mutex* m) {
+    if (!mutex_locked(m)) return false;
+    if (m->reader_count == 0) {
+        WaitNode* n = wait_node(mutex_owner(m), false);
+        return n != NULL && n->parked_count > 0;
+    }
+    for (int i = 0; i < m->reader_count; i++) {
+        WaitNode* n = wait_node(readers_of(m)[i].pid, false);
+        if (n != NULL && n->parked_count > 0) return true;
+    }
+    return false;
+}
+
+
+// Add / remove a parked waiter to / from its PID's graph node (caller holds graph_lock)
+static void graph_add(MutexWaiter* w) {
+    WaitNode* n = wait_node(w->client_pid, true);
+    if (n == NULL) return;  // Out of memory: this wait goes undetected
+
+    w->graph_prev = NULL;
+    w->graph_next = n->parked;
+    if (n->parked) n->parked->graph_prev = w;
+    n->parked = w;
+    n->parked_count++;
+    w->in_graph = true;
+    w->park_seq = ++park_seq;
+}
+
+
+static void graph_remove(MutexWaiter* w) {
+    if (!w->in_graph) return;
+
+    WaitNode* n = wait_node(w->client_pid, false);
+    if (w->graph_prev) w->graph_prev->graph_next = w->graph_next;
+    else n->parked = w->graph_next;
+    if (w->graph_next) w->graph_next->graph_prev = w->graph_prev;
+    n->parked_count--;
+    w->in_graph = false;
+}
+
+
+// Queue w on m (caller holds the stripe lock, m has its extras) and note whether it may
+// close a cycle
+static void park(Stripe* st, Mutex* m, MutexWaiter* w) {
+    w->mutex = m;
+    w->park_ns = monotonic_ns();
+    m->cold->contentions++;
+    atomic_store(&w->stripe, st);
+    queue_push(&m->cold->extra->wait_head, &m->cold->extra->wait_tail, w);
+    atomic_store(&w->state, WAIT_QUEUED);
+
+    pthread_mutex_lock(&graph_lock);
+    graph_add(w);
+    if (holder_is_waiting(m)) atomic_store(&deadlock_check_pending, true);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+
+static void unpark(Mutex* m, MutexWaiter* w) {
+    queue_remove(&m->cold->extra->wait_head, &m->cold->extra->wait_tail, w);
+
+    pthread_mutex_lock(&graph_lock);
+    graph_remove(w);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+
+// pid was just handed m. If it is still waiting elsewhere, the clients queued behind
+// it now wait for a waiting PID.
+static void note_new_holder(const Mutex* m, int client_pid) {
+    if (first_waiter(m) == NULL) return;
+
+    pthread_mutex_lock(&graph_lock);
+    WaitNode* n = wait_node(client_pid, false);
+    if (n != NULL && n->parked_count > 0) atomic_store(&deadlock_check_pending, true);
+    pthread_mutex_unlock(&graph_lock);
+}
+
+
+// Grant m to the waiters at the head of its queue that fit: one exclusive waiter, or a
+// run of shared waiters. Waiters to wake are appended to the woken list.
+static void grant_waiters(Mutex* m, MutexWaiter** woken_head, MutexWaiter** woken_tail) {
+    MutexWaiter* w;
+    while ((w = first_waiter(m)) != NULL) {
+        if (mutex_locked(m) && !(w->shared && m->reader_count > 0)) break;
+
+        // A fast mutex can be grabbed through its lock word at any time; if that
+        // happened, its release rings the doorbell and the handoff is retried then
+        ShmSlot* word = lock_word(m);
+        if (word && !shm_acquire(word, w->client_pid, w->next != NULL)) {
+            if (!shm_flag_server_waiters(word)) continue;  // Released again already
+            sync_fast(m);
+            break;
+        }
+
+        unpark(m, w);
+        if (w->shared && !reserve_reader(m)) {
+            queue_woken(woken_head, woken_tail, w, WAIT_RETRY);  // Fails again with -5
+            continue;
+        }
+        grant(m, w->client_pid, w->owner_token, w->shared);
+        histogram_observe(&mutex_wait_time, monotonic_ns() - w->park_ns);
+        queue_woken(woken_head, woken_tail, w, 0);
+        note_new_holder(m, w->client_pid);
+        if (!w->shared) break;
+    }
+
+    if (!mutex_locked(m)) m->lock_time = 0;
+}
+
+
+// Drop the hold of client_pid on m (which it holds), then hand m to its waiters
+static void release_mutex(Mutex* m, int client_pid, MutexWaiter** woken_head, MutexWaiter** woken_tail) {
+    if (m->reader_count > 0) {
+        SharedHolder* readers = readers_of(m);
+        int i = find_reader(m, client_pid);
+        if (readers[i].acquired_ns) {
+            histogram_observe(&mutex_hold_time[1], monotonic_ns() - readers[i].acquired_ns);
+        }
+        readers[i] = readers[--m->reader_count];
+        set_state(m, mutex_owner(m), m->reader_count > 0);
+    } else {
+        if (m->acquired_ns) histogram_observe(&mutex_hold_time[0], monotonic_ns() - m->acquired_ns);
+        m->acquired_ns = 0;
+        if (lock_word(m)) shm_release(lock_word(m));
+        set_state(m, mutex_owner(m), false);
+        m->owner_token = 0;
+    }
+    notify(MUTEX_EVENT_UNLOCK, m, client_pid);
+
+    grant_waiters(m, woken_head, woken_tail);
+}
+
+
+// May m be locked and unlocked by CAS on its state word under the stripe read lock?
+// Not if that involves waiters, shared holders or a shared-memory lock word.
+static bool lock_free(const Mutex* m) {
+    const MutexExtra* x = m->cold->extra;
+    return m->reader_count == 0 && (x == NULL || (x->wait_head == NULL && x->shm == NULL));
+}
+
+
+// Lock-free exclusive lock (caller holds the stripe read lock). The CAS that takes the
+// state word also sets BUSY, which holds off other lock-free updates of m until the
+// bookkeeping and the event are done. Returns 0, -1 locked by another client, -2 locked
+// by this client, or 1 if m needs the stripe write lock.
+static int try_lock_free(Mutex* m, int client_pid, uint64_t owner_token) {
+    if (!lock_free(m)) return 1;
+
+    uint64_t state = atomic_load(&m->state);
+    while (1) {
+        if (state & MUTEX_STATE_BUSY) {
+            sched_yield();
+            state = atomic_load(&m->state);
+            continue;
+        }
+        if (state & MUTEX_STATE_LOCKED) return (int)(uint32_t)state == client_pid ? -2 : -1;
+
+        uint64_t taken = (uint32_t)client_pid | MUTEX_STATE_LOCKED | MUTEX_STATE_BUSY;
+        if (atomic_compare_exchange_weak(&m->state, &state, taken)) break;
+    }
+
+    grant(m, client_pid, owner_token, false);
+    atomic_fetch_and(&m->state, ~MUTEX_STATE_BUSY);
+    return 0;
+}
+
+
+// Set the BUSY bit of m (caller holds the stripe read lock), waiting out other lock-free
+// updates, and return the state word as it was
+static uint64_t claim_busy(Mutex* m) {
+    uint64_t state = atomic_load(&m->state);
+    while ((state & MUTEX_STATE_BUSY) ||
+           !atomic_compare_exchange_weak(&m->state, &state, state | MUTEX_STATE_BUSY)) {
+        if (state & MUTEX_STATE_BUSY) {
+            sched_yield();
+            state = atomic_load(&m->state);
+        }
+    }
+    return state;
+}
+
+
+// Lock-free unlock (caller holds the stripe read lock) of the hold of client_pid, or with
+// owner_token != 0 of the hold taken under that token. Returns 0, -1 not locked, -2 held
+// by someone else, or 1 if m needs the stripe write lock.
+static int try_unlock_free(Mutex* m, int client_pid, uint64_t owner_token) {
+    if (!lock_free(m)) return 1;
+
+    // Claim the entry first: the token is only stable while BUSY is ours
+    uint64_t state = claim_busy(m);
+
+    int rc = 0;
+    int owner = (int)(uint32_t)state;
+    if (!(state & MUTEX_STATE_LOCKED)) {
+        rc = -1;
+    } else if (owner_token != 0 ? m->owner_token != owner_token : owner != client_pid) {
+        rc = -2;
+    } else {
+        MutexWaiter* woken_head = NULL;   // Stays empty: there are no waiters
+        MutexWaiter* woken_tail = NULL;
+        release_mutex(m, owner, &woken_head, &woken_tail);
+    }
+    atomic_fetch_and(&m->state, ~MUTEX_STATE_BUSY);
+    return rc;
+}
+
+
+static int lock_wait(MutexWaiter* w);
+
+
+// Deliver wakeups collected under a lock. Retried waiters may park again instead.
+static void dispatch_woken(MutexWaiter* w) {
+    while (w != NULL) {
+        MutexWaiter* next = w->next;
+
+        if (w->status == WAIT_RETRY) {
+            int status = lock_wait(w);
+            if (status == 1) {  // Parked again
+                w = next;
+                continue;
+            }
+            w->status = status;
+        }
+
+        atomic_store(&w->state, WAIT_IDLE);
+        w->wake(w);
+        w = next;
+    }
+}
+
+
+// Depth-first search of the wait-for graph from n. Returns the youngest waiter on the
+// first cycle found, or NULL. via[d] is the waiter whose edge leaves the node at depth d.
+// Caller holds graph_lock only: the holders read may be stale, so a cycle found is
+// rechecked before its victim is aborted.
+static MutexWaiter* find_cycle_from(WaitNode* n, int depth, MutexWaiter** via) {
+    n->visit = visit_pass;
+    n->depth = depth;
+
+    for (MutexWaiter* w = n->parked; w != NULL; w = w->graph_next) {
+        // A parked waiter keeps its mutex and extras alive, and graph_lock keeps the
+        // readers array in place. A fast mutex's holder is the one in its lock word.
+        Mutex* m = w->mutex;
+        ShmSlot* word = lock_word(m);
+        int readers = word ? 0 : m->reader_count;
+        if (readers > m->cold->extra->reader_cap) readers = m->cold->extra->reader_cap;
+        int owner = word ? (int)shm_owner(word) : (mutex_locked(m) ? mutex_owner(m) : 0);
+        int holders = readers > 0 ? readers : (owner != 0 ? 1 : 0);
+
+        for (int i = 0; i < holders; i++) {
+            int pid = readers > 0 ? readers_of(m)[i].pid : owner;
+            WaitNode* next = wait_node(pid, false);
+            if (next == NULL || next->parked_count == 0) continue;  // Holder is not waiting
+
+            via[depth] = w;
+            if (next->visit == visit_pass) {
+                if (next->depth < 0) continue;  // Already searched, no cycle through it
+
+                // Back edge: the cycle runs from next's depth to here
+                MutexWaiter* victim = w;
+                for (int d = next->depth; d < depth; d++) {
+                    if (via[d]->park_seq > victim->park_seq) victim = via[d];
+                }
+                return victim;
+            }
+
+            MutexWaiter* victim = find_cycle_from(next, depth + 1, via);
+            if (victim != NULL) return victim;
+        }
+    }
+
+    n->depth = -1;
+    return NULL;
+}
+
+
+static MutexWaiter* find_cycle(MutexWaiter** via) {
+    visit_pass++;
+    for (uint32_t i = 0; i < wait_node_cap; i++) {
+        WaitNode* n = &wait_nodes[i];
+        if (n->pid == 0 || n->parked_count == 0 || n->visit == visit_pass) continue;
+
+        MutexWaiter* victim = find_cycle_from(n, 0, via);
+        if (victim != NULL) return victim;
+    }
+    return NULL;
+}
+
+
+// Abort the parked waiter of pid numbered park_seq with -6 if it still waits on a mutex
+// of st held by a waiting PID. Returns false if the waiter no longer closes a cycle.
+static bool abort_deadlocked(Stripe* st, int pid, uint64_t seq) {
+    MutexWaiter* woken_head = NULL;
+    MutexWaiter* woken_tail = NULL;
+    bool aborted = false;
+
+    pthread_rwlock_wrlock(&st->lock);
+    pthread_mutex_lock(&graph_lock);
+
+    // Only waiters still in the graph are known to be alive
+    WaitNode* n = wait_node(pid, false);
+    MutexWaiter* w = n != NULL ? n->parked : NULL;
+    while (w != NULL && w->park_seq != seq) w = w->graph_next;
+
+    if (w != NULL && atomic_load(&w->state) == WAIT_QUEUED && atomic_load(&w->stripe) == st) {
+        sync_fast(w->mutex);
+        if (holder_is_waiting(w->mutex)) {
+            MutexExtra* x = w->mutex->cold->extra;
+            queue_remove(&x->wait_head, &x->wait_tail, w);
+            graph_remove(w);
+            queue_woken(&woken_head, &woken_tail, w, -6);
+            aborted = true;
+        }
+    }
+
+    pthread_mutex_unlock(&graph_lock);
+    pthread_rwlock_unlock(&st->lock);
+
+    dispatch_woken(woken_head);
+    return aborted;
+}
+
+
+// If a new wait may have closed a cycle, search the whole wait-for graph and abort the
+// youngest waiter of every cycle with -6. The search holds graph_lock only; each victim
+// is rechecked under its own stripe lock. Called without locks held.
+static void check_deadlocks() {
+    if (!atomic_exchange(&deadlock_check_pending, false)) return;
+
+    while (1) {
+        pthread_mutex_lock(&graph_lock);
+        MutexWaiter** via = malloc((wait_node_used + 1) * sizeof(MutexWaiter*));
+        MutexWaiter* victim = via != NULL ? find_cycle(via) : NULL;
+        free(via);
+
+        // Identify the victim by value: once graph_lock is dropped it may be woken and freed
+        Stripe* st = victim != NULL ? atomic_load(&victim->stripe) : NULL;
+        int pid = victim != NULL ? victim->client_pid : 0;
+        uint64_t seq = victim != NULL ? victim->park_seq : 0;
+        pthread_mutex_unlock(&graph_lock);
+
+        if (victim == NULL) return;
+        if (!abort_deadlocked(st, pid, seq)) {
+            // The search saw stale holders: leave the rest to the next check
+            atomic_store(&deadlock_check_pending, true);
+            return;
+        }
+    }
+}
+
+
+static void init_stripes() {
+    // Lock-free paths hold the read lock only briefly: do not let them starve writers
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        pthread_rwlock_init(&stripes[s].lock, &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
 
 
 void mutex_init() {
-    // Lock the global mutex to prevent other threads from changing data
-    pthread_mutex_lock(&global_mutex_lock);  
+    pthread_once(&stripes_once, init_stripes);
+
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        Stripe* st = &stripes[s];
+
+        // Lock the stripe to prevent other threads from changing data
+        pthread_rwlock_wrlock(&st->lock);
+
+        for (int i = 0; i < st->slot_count; i++) {
+            if (slot_at(st, i)->cold) free_cold(slot_at(st, i)->cold);
+        }
+        for (int c = 0; c < st->chunk_count; c++) free(st->chunks[c]);
+        free(st->chunks);
+        free(st->buckets);
+
+        st->chunks = NULL;
+        st->chunk_count = 0;
+        st->slot_count = 0;
+        st->free_slot = -1;
+        st->buckets = NULL;
+        st->bucket_count = 0;
+        st->count = 0;
+
+        pthread_rwlock_unlock(&st->lock);
+    }
+
+    pthread_mutex_lock(&graph_lock);
+    free(wait_nodes);
+    wait_nodes = NULL;
+    wait_node_cap = wait_node_used = 0;
+    pthread_mutex_unlock(&graph_lock);
+
+    atomic_store(&mutex_count, 0);
+
+    uint64_t seed = (monotonic_ns() ^ (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid()) *
+                    0x9E3779B97F4A7C15ull;
+    incarnation_base = (uint32_t)(seed >> 32) ? (uint32_t)(seed >> 32) : 1;
+}
+
+
+// Returns 0, -1 empty name, -2 out of memory, -3 exists; fast mutexes also
+// -4 no shared-memory table, -5 table full
+static int create_mutex(const char* name, int client_pid, bool fast) {
+    if (strlen(name) == 0) return -1;   //If thread name empty
+    if (fast && shm_table == NULL) return -4;
+    
+    Stripe* st;
+    if (lookup_locked(name, &st) != NULL) {  //If mutex already exists
+        pthread_rwlock_unlock(&st->lock);
+        return -3;
+    }
+
+    // The cold part fits the name; a fast mutex needs its extras for the lock word
+    size_t name_len = strnlen(name, MAX_MUTEX_NAME - 1);
+    MutexCold* cold = calloc(1, sizeof(MutexCold) + name_len + 1);
+    if (cold) memcpy(cold->name, name, name_len);
+    if (cold && fast) cold->extra = calloc(1, sizeof(MutexExtra));
+    if (!cold || (fast && !cold->extra)) {
+        pthread_rwlock_unlock(&st->lock);
+        if (cold) free_cold(cold);
+        return -2;
+    }
+
+    // Keep the load factor at most 1 so chains stay short
+    if ((uint32_t)st->count >= st->bucket_count && grow_buckets(st) < 0) {
+        pthread_rwlock_unlock(&st->lock);
+        free_cold(cold);
+        return -2;
+    }
+
+    int i = alloc_slot(st);
+    if (i < 0) {  //If out of memory
+        pthread_rwlock_unlock(&st->lock);
+        free_cold(cold);
+        return -2;
+    }
+
+    if (fast) {
+        pthread_mutex_lock(&shm_slots_lock);
+        cold->extra->shm = shm_slot_insert(shm_table, name);
+        pthread_mutex_unlock(&shm_slots_lock);
+        if (cold->extra->shm == NULL) {
+            slot_at(st, i)->next = st->free_slot;  // Give the registry slot back
+            st->free_slot = i;
+            pthread_rwlock_unlock(&st->lock);
+            free_cold(cold);
+            return -5;
+        }
+    }
+
+    // Add new mutex
+    Mutex* m = slot_at(st, i);
+    uint32_t incarnation = m->incarnation;
+    memset(m, 0, sizeof(*m));
+    m->incarnation = incarnation;
+    m->cold = cold;
+    set_state(m, client_pid, false);
+    m->lock_time = 0;
+    m->hash = mutex_name_hash(cold->name);
+
+    uint32_t b = m->hash & (st->bucket_count - 1);
+    m->next = st->buckets[b];
+    st->buckets[b] = i;
+    st->count++;
+    atomic_fetch_add(&mutex_count, 1);
+    if (fast) {
+        st->fast_count++;
+        atomic_fetch_add(&fast_count, 1);
+    }
+    notify(MUTEX_EVENT_CREATE, m, client_pid);
+    
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+}
+
+
+int mutex_create(const char* name, int client_pid) {
+    return create_mutex(name, client_pid, false);
+}
+
+
+// Fast mutex: also lockable by local clients through the shared-memory table.
+// Exclusive locks only.
+int mutex_create_fast(const char* name, int client_pid) {
+    return create_mutex(name, client_pid, true);
+}
+
+
+// Can client_pid take m in this mode right now? Readers join other readers unless
+// a client is already waiting for the mutex.
+static bool can_grant(const Mutex* m, bool shared) {
+    return !mutex_locked(m) || (shared && m->reader_count > 0 && first_waiter(m) == NULL);
+}
 
-    mutex_count = 0;
 
-    for (int i = 0; i < MAX_MUTEXES; i++) {
-        mutexes[i].name[0] = '\0';  // Clear the name
-        mutexes[i].owner_pid = -1;  // No owner
-        mutexes[i].is_locked = false;  // Not locked
-        mutexes[i].lock_time = 0;   // No lock time
+// Lock without waiting, in exclusive or shared mode
+static int lock_mode(const MutexKey* k, int client_pid, uint64_t owner_token, bool shared) {
+    Stripe* st;
+    Mutex* m = lookup_key(k, &st, true);
+    if (m != NULL) {
+        if (holds(m, client_pid)) {
+            pthread_rwlock_unlock(&st->lock);
+            return -2; // Already locked by this client
+        }
+        ShmSlot* word = lock_word(m);
+        if (shared && word) {
+            pthread_rwlock_unlock(&st->lock);
+            return -3; // Fast mutexes have no shared mode
+        }
+        if (!can_grant(m, shared) || (word && !shm_acquire(word, client_pid, first_waiter(m) != NULL))) {
+            m->cold->contentions++;
+            pthread_rwlock_unlock(&st->lock);
+            return -1; // Locked by another client
+        }
+        if (shared && !reserve_reader(m)) {
+            pthread_rwlock_unlock(&st->lock);
+            return -5;
+        }
+
+        // Lock the mutex
+        grant(m, client_pid, owner_token, shared);
+
+        pthread_rwlock_unlock(&st->lock);
+        return 0;  // Successfully locked the mutex
+    }
+    
+    pthread_rwlock_unlock(&st->lock);
+    return -4; // Mutex not found
+}
+
+
+static int lock_key(const MutexKey* k, int client_pid, uint64_t owner_token) {
+    Stripe* st;
+    Mutex* m = lookup_key(k, &st, false);
+    int rc = m != NULL ? try_lock_free(m, client_pid, owner_token) : -4;
+    if (rc == -1) m->cold->contentions++;
+    pthread_rwlock_unlock(&st->lock);
+
+    return rc != 1 ? rc : lock_mode(k, client_pid, owner_token, false);
+}
+
+
+// Exclusive lock. owner_token identifies the acquiring session for mutex_release_token
+// (0 = none). Returns 0, -1 locked by another client, -2 already locked by this client,
+// -4 not found.
+int mutex_lock(const char* name, int client_pid, uint64_t owner_token) {
+    MutexKey k = { name, 0, NULL };
+    return lock_key(&k, client_pid, owner_token);
+}
+
+
+// Shared lock: any number of clients may hold it together, but not while another
+// client holds or waits for it exclusively. Same return codes as mutex_lock, plus
+// -3 fast mutex, -5 out of memory.
+int mutex_lock_shared(const char* name, int client_pid, uint64_t owner_token) {
+    MutexKey k = { name, 0, NULL };
+    return lock_mode(&k, client_pid, owner_token, true);
+}
+
+
+// Lock by handle, in either mode; name (if not NULL) receives the mutex's name when the
+// handle is valid. Same return codes as mutex_lock and mutex_lock_shared.
+int mutex_lock_handle(MutexHandle handle, int client_pid, uint64_t owner_token, bool shared,
+                      char* name) {
+    MutexKey k = { NULL, handle, name };
+    return shared ? lock_mode(&k, client_pid, owner_token, true)
+                  : lock_key(&k, client_pid, owner_token);
+}
+
+
+// Lock every name (shared[i] asks for a shared hold; shared may be NULL) or none of
+// them. Returns 0, or for the first name that cannot be locked (*failed = its index):
+// -1 locked by another client, -2 already locked by this client (or named twice),
+// -4 not found, -5 out of memory, -3 shared hold of a fast mutex or count not within
+// 1..MUTEX_MAX_LOCK_ALL.
+int mutex_lock_all(const char* const* names, const bool* shared, int count,
+                   int client_pid, uint64_t owner_token, int* failed) {
+    uint32_t hashes[MUTEX_MAX_LOCK_ALL];
+    Mutex* found[MUTEX_MAX_LOCK_ALL];
+    bool used[MUTEX_STRIPES] = { false };
+    int rc = 0;
+
+    *failed = 0;
+    if (count < 1 || count > MUTEX_MAX_LOCK_ALL) return -3;
+
+    // Lock every stripe involved, in stripe order so concurrent calls cannot deadlock
+    for (int i = 0; i < count; i++) {
+        hashes[i] = mutex_name_hash(names[i]);
+        used[stripe_of(hashes[i]) - stripes] = true;
+    }
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        if (used[s]) pthread_rwlock_wrlock(&stripes[s].lock);
+    }
+
+    for (int i = 0; i < count && rc == 0; i++) {
+        bool sh = shared && shared[i];
+        Mutex* m = find_mutex(stripe_of(hashes[i]), names[i], hashes[i]);
+        *failed = i;
+        sync_fast(m);
+
+        if (m == NULL) {
+            rc = -4;
+        } else if (sh && lock_word(m)) {
+            rc = -3;
+        } else if (holds(m, client_pid)) {
+            rc = -2;
+        } else if (!can_grant(m, sh)) {
+            m->cold->contentions++;
+            rc = -1;
+        } else if (sh && !reserve_reader(m)) {
+            rc = -5;
+        }
+        for (int j = 0; j < i && rc == 0; j++) {
+            if (found[j] == m) rc = -2;
+        }
+        found[i] = m;
+    }
+
+    // Fast mutexes can still be taken through their lock words: claim those first
+    int claimed = 0;
+    for (; rc == 0 && claimed < count; claimed++) {
+        Mutex* m = found[claimed];
+        if (lock_word(m) && !shm_acquire(lock_word(m), client_pid, first_waiter(m) != NULL)) {
+            m->cold->contentions++;
+            *failed = claimed;
+            rc = -1;
+            break;
+        }
+    }
+
+    if (rc == 0) {
+        for (int i = 0; i < count; i++) grant(found[i], client_pid, owner_token, shared && shared[i]);
+    } else {
+        // Give back the words already claimed; their waiters wait for the doorbell
+        for (int i = 0; i < claimed; i++) {
+            if (lock_word(found[i])) shm_release(lock_word(found[i]));
+        }
+    }
+
+    for (int s = MUTEX_STRIPES - 1; s >= 0; s--) {
+        if (used[s]) pthread_rwlock_unlock(&stripes[s].lock);
+    }
+    return rc;
+}
+
+
+// Lock a mutex (shared if w->shared), parking w at the tail of its FIFO wait queue if
+// another client holds it. Returns 0 if locked now, 1 if parked (w->wake is called
+// later, possibly before this returns), -2 if already locked by this client, -3 for a
+// shared lock of a fast mutex, -4 if the mutex does not exist, -5 if out of memory.
+// A parked waiter that closes a cycle of waiting clients is woken with -6 (deadlock).
+static int lock_wait(MutexWaiter* w) {
+    MutexKey k = { w->handle ? NULL : w->name, w->handle, w->name };
+    int client_pid = w->client_pid;
+
+    // An idle plain mutex is taken lock-free; waiting needs the write lock
+    Stripe* st;
+    Mutex* m;
+    if (!w->shared) {
+        m = lookup_key(&k, &st, false);
+        int rc = m != NULL ? try_lock_free(m, client_pid, w->owner_token) : -4;
+        pthread_rwlock_unlock(&st->lock);
+        if (rc != 1 && rc != -1) return rc;
+    }
+
+    m = lookup_key(&k, &st, true);
+    if (m == NULL) {
+        pthread_rwlock_unlock(&st->lock);
+        return -4; // Mutex not found
     }
 
-    //Unlock the global mutex
-    pthread_mutex_unlock(&global_mutex_lock);
-}
+    if (holds(m, client_pid)) {
+        pthread_rwlock_unlock(&st->lock);
+        return -2; // Already locked by this client
+    }
 
+    ShmSlot* word = lock_word(m);
+    if (w->shared && word) {
+        pthread_rwlock_unlock(&st->lock);
+        return -3;
+    }
 
-int mutex_create(const char* name, int client_pid) {
-    if (strlen(name) == 0) return -1;   //If thread name empty
-    
-    pthread_mutex_lock(&global_mutex_lock);  
-    
-    if (mutex_count >= MAX_MUTEXES) {  //If too many mutexes
-        pthread_mutex_unlock(&global_mutex_lock);
-        return -2;
+    // A fast mutex may change hands through its lock word at any time: claim the word,
+    // or flag it so that its release rings the doorbell, whichever works first
+    while (word) {
+        if (shm_acquire(word, client_pid, first_waiter(m) != NULL)) {
+            grant(m, client_pid, w->owner_token, false);
+            pthread_rwlock_unlock(&st->lock);
+            return 0;
+        }
+        if (shm_flag_server_waiters(word)) {
+            sync_fast(m);
+            park(st, m, w);
+            pthread_rwlock_unlock(&st->lock);
+            check_deadlocks();
+            return 1;
+        }
     }
 
-    for (int i = 0; i < mutex_count; i++) {  //If mutex already exists
-        if (strcmp(mutexes[i].name, name) == 0) {
-            pthread_mutex_unlock(&global_mutex_lock);
-            return -3;
+    if (!can_grant(m, w->shared)) {
+        // Wait for the holder to hand it over
+        if (need_extra(m) == NULL) {
+            pthread_rwlock_unlock(&st->lock);
+            return -5;
         }
+        park(st, m, w);
+        pthread_rwlock_unlock(&st->lock);
+        check_deadlocks();
+        return 1;
     }
 
-    // Add new mutex
-    strncpy(mutexes[mutex_count].name, name, MAX_MUTEX_NAME - 1);
-    mutexes[mutex_count].owner_pid = client_pid;
-    mutexes[mutex_count].is_locked = false;
-    mutexes[mutex_count].lock_time = 0;
-    mutex_count++;
-    
-    pthread_mutex_unlock(&global_mutex_lock);
+    if (w->shared && !reserve_reader(m)) {
+        pthread_rwlock_unlock(&st->lock);
+        return -5;
+    }
+    grant(m, client_pid, w->owner_token, w->shared);
+    pthread_rwlock_unlock(&st->lock);
     return 0;
 }
 
 
-int mutex_lock(const char* name, int client_pid) {
+int mutex_lock_wait(const char* name, int client_pid, MutexWaiter* w) {
+    w->client_pid = client_pid;
+    w->handle = 0;
+    if (name != w->name) {
+        strncpy(w->name, name, MAX_MUTEX_NAME - 1);
+        w->name[MAX_MUTEX_NAME - 1] = '\0';
+    }
+    return lock_wait(w);
+}
+
+
+// mutex_lock_wait by handle; w->name receives the mutex's name
+int mutex_lock_wait_handle(MutexHandle handle, int client_pid, MutexWaiter* w) {
+    w->client_pid = client_pid;
+    w->handle = handle;
+    w->name[0] = '\0';
+    return lock_wait(w);
+}
 
-    pthread_mutex_lock(&global_mutex_lock);
 
-    // If any mutex is locked and does not belong to this client, do not lock other mutexes
-    for (int i = 0; i < mutex_count; i++) {
-        if (mutexes[i].is_locked && mutexes[i].owner_pid != client_pid) {
-            pthread_mutex_unlock(&global_mutex_lock);
-            return -3; // There is another mutex locked by another client
+// Take a parked waiter out of its queue (e.g. on timeout). Returns false if it is
+// already being woken, in which case wake() will still be called.
+bool mutex_cancel_wait(MutexWaiter* w) {
+    while (atomic_load(&w->state) == WAIT_QUEUED) {
+        Stripe* st = atomic_load(&w->stripe);
+        pthread_rwlock_wrlock(&st->lock);
+        if (atomic_load(&w->state) == WAIT_QUEUED && atomic_load(&w->stripe) == st) {
+            unpark(w->mutex, w);
+            atomic_store(&w->state, WAIT_IDLE);
+            pthread_rwlock_unlock(&st->lock);
+            return true;
         }
+        pthread_rwlock_unlock(&st->lock);
     }
+    return false;
+}
 
-    for (int i = 0; i < mutex_count; i++) {
-        if (strcmp(mutexes[i].name, name) == 0) {
-            if (mutexes[i].is_locked) {
-                if (mutexes[i].owner_pid == client_pid) {
-                    pthread_mutex_unlock(&global_mutex_lock);
-                    return -2; // Already locked by this client
-                }
-                pthread_mutex_unlock(&global_mutex_lock);
-                return -1; // Locked by another client
-            }
 
-            // Lock the mutex
-            mutexes[i].is_locked = true;
-            mutexes[i].owner_pid = client_pid;
-            mutexes[i].lock_time = time(NULL);
+// Release the hold of client_pid on m and deliver the resulting wakeups
+// (called with st->lock held, returns unlocked)
+static void unlock_and_dispatch(Stripe* st, Mutex* m, int client_pid) {
+    MutexWaiter* woken_head = NULL;
+    MutexWaiter* woken_tail = NULL;
+    release_mutex(m, client_pid, &woken_head, &woken_tail);
+
+    pthread_rwlock_unlock(&st->lock);
 
-            pthread_mutex_unlock(&global_mutex_lock);
-            return 0;  // Successfully locked the mutex
+    dispatch_woken(woken_head);
+    check_deadlocks();
+}
+
+
+static int unlock_key(const MutexKey* k, int client_pid) {
+    Stripe* st;
+    Mutex* m = lookup_key(k, &st, false);
+    int rc = m != NULL ? try_unlock_free(m, client_pid, 0) : -3;
+    pthread_rwlock_unlock(&st->lock);
+    if (rc != 1) return rc;
+
+    m = lookup_key(k, &st, true);
+    if (m != NULL) {
+        if (!mutex_locked(m)) {
+            pthread_rwlock_unlock(&st->lock);
+            return -1; // Already unlocked
         }
+        if (!holds(m, client_pid)) {
+            pthread_rwlock_unlock(&st->lock);
+            return -2; // Not owned by this client
+        }
+        
+        // Unlock the mutex (shared: drop this client's hold), or hand it to the next waiter
+        unlock_and_dispatch(st, m, client_pid);
+        return 0; // Successfully unlocked the mutex
     }
     
-    pthread_mutex_unlock(&global_mutex_lock);
-    return -2; // Mutex not found
+    pthread_rwlock_unlock(&st->lock);
+    return -3; // Mutex not found
 }
 
 
 int mutex_unlock(const char* name, int client_pid) {
-    pthread_mutex_lock(&global_mutex_lock);
-    
-    for (int i = 0; i < mutex_count; i++) {
-        if (strcmp(mutexes[i].name, name) == 0) {
-            if (!mutexes[i].is_locked) {
-                pthread_mutex_unlock(&global_mutex_lock);
-                return -1; // Already unlocked
-            }
-            if (mutexes[i].owner_pid != client_pid) {
-                pthread_mutex_unlock(&global_mutex_lock);
-                return -2; // Not owned by this client
-            }
-            
-            // Unlock the mutex
-            mutexes[i].is_locked = false;
-            mutexes[i].lock_time = 0;
+    MutexKey k = { name, 0, NULL };
+    return unlock_key(&k, client_pid);
+}
+
+
+// Unlock by handle; name (if not NULL) receives the mutex's name when the handle is valid
+int mutex_unlock_handle(MutexHandle handle, int client_pid, char* name) {
+    MutexKey k = { NULL, handle, name };
+    return unlock_key(&k, client_pid);
+}
+
+
+// PID holding m under the acquisition of owner_token, -1 if none
+static int token_holder(const Mutex* m, uint64_t owner_token) {
+    if (!mutex_locked(m) || owner_token == 0) return -1;
+    if (m->reader_count == 0) return m->owner_token == owner_token ? mutex_owner(m) : -1;
+
+    for (int i = 0; i < m->reader_count; i++) {
+        if (readers_of(m)[i].owner_token == owner_token) return readers_of(m)[i].pid;
+    }
+    return -1;
+}
+
+
+// Unlock a mutex only if it is still held under the lock acquisition of owner_token
+// (expired lease, closed connection). Returns 0 if released, -1 if not.
+int mutex_release_token(const char* name, uint64_t owner_token) {
+    if (owner_token == 0) return -1;
+
+    Stripe* st;
+    Mutex* m = lookup_shared(name, &st);
+    int rc = m != NULL ? try_unlock_free(m, 0, owner_token) : -1;
+    pthread_rwlock_unlock(&st->lock);
+    if (rc != 1) return rc == 0 ? 0 : -1;
+
+    m = lookup_locked(name, &st);
+    int pid = m != NULL ? token_holder(m, owner_token) : -1;
+    if (pid != -1) {
+        unlock_and_dispatch(st, m, pid);
+        return 0;
+    }
+
+    pthread_rwlock_unlock(&st->lock);
+    return -1; // Unlocked, deleted or acquired again by someone else meanwhile
+}
+
+
+bool mutex_held_by(const char* name, uint64_t owner_token) {
+    Stripe* st;
+    Mutex* m = lookup_shared(name, &st);
+    bool fast = (m != NULL && lock_word(m) != NULL);
+    bool result = (m != NULL && !fast && token_holder(m, owner_token) != -1);
+    pthread_rwlock_unlock(&st->lock);
+    if (!fast) return result;
+
+    // Fast mutex: its lock word may have been released by a client, sync it first
+    m = lookup_locked(name, &st);
+    result = (m != NULL && token_holder(m, owner_token) != -1);
+    pthread_rwlock_unlock(&st->lock);
+    return result;
+}
+
+
+// Take m (its lock word already killed) out of the registry. Waiting clients are
+// appended to the woken list and fail with "not found".
+static void remove_mutex(Stripe* st, Mutex* m, int client_pid,
+                         MutexWaiter** woken_head, MutexWaiter** woken_tail) {
+    if (lock_word(m)) {
+        pthread_mutex_lock(&shm_slots_lock);
+        shm_slot_remove(lock_word(m));
+        pthread_mutex_unlock(&shm_slots_lock);
+        st->fast_count--;
+        atomic_fetch_sub(&fast_count, 1);
+    }
+
+    MutexWaiter* w;
+    while ((w = first_waiter(m)) != NULL) {
+        unpark(m, w);
+        queue_woken(woken_head, woken_tail, w, -4);
+    }
+    if (m->cold->extra && m->cold->extra->subscribers) end_subscriptions(m, client_pid);
+    notify(MUTEX_EVENT_DELETE, m, client_pid);
+
+    // Release the slot for reuse
+    free_mutex(st, m);
+
+    st->count--;
+    atomic_fetch_sub(&mutex_count, 1);
+}
+
 
-            pthread_mutex_unlock(&global_mutex_lock);
-            return 0; // Successfully unlocked the mutex
+static int delete_key(const MutexKey* k, int client_pid) {
+    Stripe* st;
+    Mutex* m = lookup_key(k, &st, true);
+    if (m != NULL) {
+        bool sole_holder = m->reader_count > 0 ? (m->reader_count == 1 && readers_of(m)[0].pid == client_pid)
+                                               : mutex_owner(m) == client_pid;
+        if ((mutex_locked(m) && !sole_holder) || (lock_word(m) && !shm_kill(lock_word(m), client_pid))) {
+            pthread_rwlock_unlock(&st->lock);
+            return -1; // Locked by another client
         }
+        MutexWaiter* woken_head = NULL;
+        MutexWaiter* woken_tail = NULL;
+        remove_mutex(st, m, client_pid, &woken_head, &woken_tail);
+        pthread_rwlock_unlock(&st->lock);
+
+        dispatch_woken(woken_head);
+        return 0;  // Successfully deleted the mutex
     }
     
-    pthread_mutex_unlock(&global_mutex_lock);
-    return -3; // Mutex not found
+    pthread_rwlock_unlock(&st->lock);
+    return -2; // Mutex not found
 }
 
 
 int mutex_delete(const char* name, int client_pid) {
-    pthread_mutex_lock(&global_mutex_lock);
-    
-    for (int i = 0; i < mutex_count; i++) {
-        if (strcmp(mutexes[i].name, name) == 0) {
-            if (mutexes[i].is_locked && mutexes[i].owner_pid != client_pid) {
-                pthread_mutex_unlock(&global_mutex_lock);
-                return -1; // Locked by another client
+    MutexKey k = { name, 0, NULL };
+    return delete_key(&k, client_pid);
+}
+
+
+// Delete by handle; name (if not NULL) receives the mutex's name when the handle is valid
+int mutex_delete_handle(MutexHandle handle, int client_pid, char* name) {
+    MutexKey k = { NULL, handle, name };
+    return delete_key(&k, client_pid);
+}
+
+
+// A mutex as copied by snapshot_stripe: hot part, cold part with room for any name, and
+// of the extras only the newest message
+typedef struct {
+    Mutex hot;
+    MutexExtra extra;
+    _Alignas(MutexCold) char cold[sizeof(MutexCold) + MAX_MUTEX_NAME];
+} MutexCopy;
+
+
+// Show in the copy c of a fast mutex the holder its lock word names, the way sync_fast
+// would record it, without touching the registry. Returns false if they agree already.
+static bool sync_fast_copy(Mutex* c, ShmSlot* word) {
+    int owner = (int)shm_owner(word);
+    bool changed = false;
+    if (mutex_locked(c) && mutex_owner(c) != owner) {
+        set_state(c, mutex_owner(c), false);
+        c->owner_token = 0;
+        c->lock_time = 0;
+        c->acquired_ns = 0;
+        changed = true;
+    }
+    if (owner != 0 && !mutex_locked(c)) {
+        set_state(c, owner, true);
+        c->owner_token = 0;
+        c->lock_time = time(NULL);
+        changed = true;
+    }
+    return changed;
+}
+
+
+// Copy the mutexes of st changed after generation since into *copies (grown as needed)
+// and return how many, -1 if out of memory. Only the stripe read lock is taken, so
+// lockers of st are not held up; each entry is copied under its BUSY bit, which keeps
+// lock-free updates of it out meanwhile. Fast mutexes are copied as their lock words
+// show them (and reported while the registry has not caught up with the word).
+// Wait queues, reader lists, lock words, message rings and subscribers are not part of
+// the copies; their last_message holds a reference of its own.
+static int snapshot_stripe(Stripe* st, uint64_t since, MutexCopy** copies, int* cap) {
+    pthread_rwlock_rdlock(&st->lock);
+    while (st->count > *cap) {
+        int want = st->count * 2;
+        pthread_rwlock_unlock(&st->lock);
+
+        MutexCopy* grown = realloc(*copies, want * sizeof(MutexCopy));
+        if (!grown) return -1;
+        *copies = grown;
+        *cap = want;
+        pthread_rwlock_rdlock(&st->lock);
+    }
+
+    // Stripes without newer changes are skipped, unless fast mutexes may be out of sync.
+    // A lock-free change takes its generation before it raises the stripe's: while one is
+    // in flight, its generation may already be covered by the caller's, so look anyway.
+    // (notifying is read first: once it is 0, every change it counted has raised ours.)
+    int n = 0;
+    bool in_flight = atomic_load(&st->notifying) > 0;
+    if (in_flight || atomic_load(&st->generation) > since || st->fast_count > 0) {
+        for (int i = 0; i < st->slot_count; i++) {
+            Mutex* m = slot_at(st, i);
+            if (m->cold == NULL) continue;
+
+            MutexCopy* copy = &(*copies)[n];
+            claim_busy(m);
+            copy->hot = *m;
+            atomic_fetch_and(&copy->hot.state, ~MUTEX_STATE_BUSY);
+
+            bool word_changed = lock_word(m) && sync_fast_copy(&copy->hot, lock_word(m));
+            if (copy->hot.changed_gen <= since && !word_changed) {
+                atomic_fetch_and(&m->state, ~MUTEX_STATE_BUSY);
+                continue;
             }
-            
-            // Shift remaining mutexes
-            for (int j = i; j < mutex_count - 1; j++) {
-                mutexes[j] = mutexes[j + 1];
+
+            MutexCold* cold = (MutexCold*)copy->cold;
+            copy->hot.cold = cold;
+            memcpy(cold, m->cold, sizeof(MutexCold) + strlen(m->cold->name) + 1);
+            atomic_fetch_and(&m->state, ~MUTEX_STATE_BUSY);
+            cold->extra = NULL;
+            n++;
+
+            MutexMessage* last = mutex_last_message(m);
+            if (last) {
+                memset(&copy->extra, 0, sizeof(copy->extra));
+                copy->extra.last_message = last;
+                cold->extra = &copy->extra;
+                shared_retain(&last->frame);
             }
+        }
+    }
+
+    pthread_rwlock_unlock(&st->lock);
+    return n;
+}
 
-            mutex_count--;  
-            pthread_mutex_unlock(&global_mutex_lock);
-            return 0;  // Successfully deleted the mutex
+
+// Like mutex_foreach, for the mutexes changed after generation since
+void mutex_foreach_since(uint64_t since, void (*fn)(const Mutex* m, void* ctx), void* ctx) {
+    MutexCopy* copies = NULL;
+    int cap = 0;
+
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        int n = snapshot_stripe(&stripes[s], since, &copies, &cap);
+        for (int i = 0; i < n; i++) {
+            MutexMessage* last = mutex_last_message(&copies[i].hot);
+            fn(&copies[i].hot, ctx);
+            if (last) shared_release(&last->frame);
         }
     }
-    
-    pthread_mutex_unlock(&global_mutex_lock);
-    return -2; // Mutex not found
+    free(copies);
 }
 
 
-void mutex_list(char* buffer, size_t buf_size) {
-    pthread_mutex_lock(&global_mutex_lock);
+// Call fn for a copy of every mutex. Each stripe is copied under its read lock and fn runs
+// outside any lock, so formatting never holds up lock and unlock requests.
+void mutex_foreach(void (*fn)(const Mutex* m, void* ctx), void* ctx) {
+    mutex_foreach_since(0, fn, ctx);
+}
+
+
+uint64_t mutex_generation() {
+    return atomic_load(&generation);
+}
+
+
+bool mutex_has_fast() {
+    return atomic_load(&fast_count) > 0;
+}
+
+
+bool mutex_foreach_deleted(uint64_t since, void (*fn)(const char* name, void* ctx), void* ctx) {
+    pthread_mutex_lock(&delete_log_lock);
+    if (since < delete_floor) {
+        pthread_mutex_unlock(&delete_log_lock);
+        return false;
+    }
+
+    uint64_t first = delete_count > MUTEX_DELETE_LOG ? delete_count - MUTEX_DELETE_LOG : 0;
+    for (uint64_t i = first; i < delete_count; i++) {
+        DeletedMutex* d = &delete_log[i % MUTEX_DELETE_LOG];
+        if (d->generation > since) fn(d->name, ctx);
+    }
+    pthread_mutex_unlock(&delete_log_lock);
+    return true;
+}
+
+
+// Output buffer state for mutex_list
+typedef struct {
+    char* buffer;
+    size_t size;
+    size_t offset;
+    size_t needed;      // Length of the whole list
+    int left_out;       // Rows that did not fit
+} ListBuilder;
+
+#define LIST_TAIL 64    // Room kept for the line counting the rows left out
+
+
+// mutex_foreach callback: append one table row, or count it once the buffer is full
+static void append_list_line(const Mutex* m, void* ctx) {
+    ListBuilder* list = ctx;
+
+    char line[200];
+    char time_buf[20];
+    
+    if (m->lock_time > 0) {
+        struct tm tm_info;
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", 
+                localtime_r(&m->lock_time, &tm_info));
+    } else {
+        strcpy(time_buf, "N/A");
+    }
+    
+    char mode[20];
+    if (!mutex_locked(m)) {
+        strcpy(mode, "-");
+    } else if (m->reader_count > 0) {
+        snprintf(mode, sizeof(mode), "Shared(%d)", m->reader_count);
+    } else {
+        strcpy(mode, "Exclusive");
+    }
+    
+    snprintf(line, sizeof(line), "%-20s %-10d %-10s %-12s %-20s\n",
+            mutex_name(m),
+            mutex_owner(m),
+            mutex_locked(m) ? "Yes" : "No",
+            mode,
+            time_buf);
     
+    size_t len = strlen(line);
+    list->needed += len;
+    if (list->left_out > 0 || list->offset + len + LIST_TAIL >= list->size) {
+        list->left_out++;
+        return;
+    }
+    memcpy(list->buffer + list->offset, line, len + 1);
+    list->offset += len;
+}
+
+
+// Returns the buffer size that fits the whole list. A smaller buffer gets the rows that
+// fit, then a line saying how many were left out.
+size_t mutex_list(char* buffer, size_t buf_size) {
     char header[256];
     snprintf(header, sizeof(header), 
              "Mutex List (Total: %d)\n"
-             "%-20s %-10s %-10s %-20s\n"
-             "--------------------------------------------------\n",
-             mutex_count, "Name", "Owner PID", "Locked", "Lock Time");
+             "%-20s %-10s %-10s %-12s %-20s\n"
+             "----------------------------------------------------------------\n",
+             atomic_load(&mutex_count), "Name", "Owner PID", "Locked", "Mode", "Lock Time");
     
-    size_t offset = strlen(header);
     strncpy(buffer, header, buf_size - 1);
+    buffer[buf_size - 1] = '\0';
     
     // Add mutex info
-    for (int i = 0; i < mutex_count && offset < buf_size - 200; i++) {
-        char line[200];
-        char time_buf[20];
+    ListBuilder list = { buffer, buf_size, strlen(buffer), strlen(buffer), 0 };
+    mutex_foreach(append_list_line, &list);
+    if (list.left_out > 0) {
+        snprintf(buffer + list.offset, buf_size - list.offset,
+                 "... %d more mutexes not listed\n", list.left_out);
+    }
+    return list.needed + LIST_TAIL + 1;
+}
+
+
+static int send_key(const MutexKey* k, int client_pid, const char* message,
+                    char* response, size_t resp_size, char* welcome_msg, size_t welcome_size) {
+    char name[MAX_MUTEX_NAME];
+    Stripe* st;
+    Mutex* m = lookup_key(k, &st, true);
+    if (m != NULL) {
+        strcpy(name, m->cold->name);
+
+        // Check permissions (exclusive holder only)
+        if (!mutex_locked(m) || m->reader_count > 0 || mutex_owner(m) != client_pid) {
+            pthread_rwlock_unlock(&st->lock);
+            snprintf(response, resp_size, "Cannot send: you don't own mutex '%.20s'", name);
+            return -1;
+        }
         
-        if (mutexes[i].lock_time > 0) {
-            strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", 
-                    localtime(&mutexes[i].lock_time));
-        } else {
-            strcpy(time_buf, "N/A");
+        MutexMessage* msg = new_message(name, STATUS_OK, newest_seq(m) + 1, client_pid,
+                                        time(NULL), message);
+        if (msg == NULL || !keep_message(m, msg)) {
+            pthread_rwlock_unlock(&st->lock);
+            if (msg) shared_release(&msg->frame);
+            snprintf(response, resp_size, "Cannot send: out of memory");
+            return -3;
+        }
+        notify(MUTEX_EVENT_SEND, m, client_pid);
+
+        pthread_rwlock_unlock(&st->lock);
+
+        // Safe message formatting with proper size_t comparison
+        int msg_len = snprintf(response, resp_size, 
+                             "Message received via mutex '%.20s' from PID %d: %.200s",
+                             name, client_pid, message);
+        if (msg_len >= 0 && (size_t)msg_len >= resp_size) {
+            response[resp_size - 1] = '\0';
         }
         
-        snprintf(line, sizeof(line), "%-20s %-10d %-10s %-20s\n",
-                mutexes[i].name,
-                mutexes[i].owner_pid,
-                mutexes[i].is_locked ? "Yes" : "No",
-                time_buf);
+        // Create welcome message with proper size_t comparison
+        time_t now = time(NULL);
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        char time_str[20];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm_info);
+        
+        int welcome_len = snprintf(welcome_msg, welcome_size,
+                                 "Welcome client PID %d! Sent message successfully at %s",
+                                 client_pid, time_str);
+        if (welcome_len >= 0 && (size_t)welcome_len >= welcome_size) {
+            welcome_msg[welcome_size - 1] = '\0';
+        }
         
-        strncat(buffer + offset, line, buf_size - offset - 1);
-        offset += strlen(line);
+        return 0;
     }
     
-    pthread_mutex_unlock(&global_mutex_lock);
+    pthread_rwlock_unlock(&st->lock);
+    if (k->name) {
+        snprintf(response, resp_size, "Mutex '%.20s' not found", k->name);
+    } else {
+        snprintf(response, resp_size, "No mutex with handle %#llx", (unsigned long long)k->handle);
+    }
+    return -2;
 }
 
 
+// Add message to the ring of name and push it to its subscribers. Returns 0, -1 not the
+// exclusive holder, -2 not found, -3 out of memory.
 int mutex_send(const char* name, int client_pid, const char* message, 
                char* response, size_t resp_size, char* welcome_msg, size_t welcome_size) {
-    pthread_mutex_lock(&global_mutex_lock);
-    
-    for (int i = 0; i < mutex_count; i++) {
-        if (strcmp(mutexes[i].name, name) == 0) {
-            // Check permissions
-            if (!mutexes[i].is_locked || mutexes[i].owner_pid != client_pid) {
-                pthread_mutex_unlock(&global_mutex_lock);
-                snprintf(response, resp_size, "Cannot send: you don't own mutex '%.20s'", name);
-                return -1;
+    MutexKey k = { name, 0, NULL };
+    return send_key(&k, client_pid, message, response, resp_size, welcome_msg, welcome_size);
+}
+
+
+int mutex_send_handle(MutexHandle handle, int client_pid, const char* message,
+                      char* response, size_t resp_size, char* welcome_msg, size_t welcome_size) {
+    MutexKey k = { NULL, handle, NULL };
+    return send_key(&k, client_pid, message, response, resp_size, welcome_msg, welcome_size);
+}
+
+
+// Handle of the mutex called name. Returns 0, or -1 if not found.
+int mutex_open(const char* name, MutexHandle* handle) {
+    uint32_t h = mutex_name_hash(name);
+    Stripe* st = stripe_of(h);
+
+    pthread_rwlock_rdlock(&st->lock);
+    int i = find_slot(st, name, h);
+    if (i != -1) *handle = handle_of(st, i);
+    pthread_rwlock_unlock(&st->lock);
+    return i != -1 ? 0 : -1;
+}
+
+
+bool mutex_has_permission(const char* name, int client_pid) {
+    Stripe* st;
+    Mutex* m = lookup_shared(name, &st);
+    if (m != NULL && lock_word(m) == NULL) {
+        // The owner is set in the same CAS that locks the word. Waiting out BUSY keeps
+        // the answer from reflecting a change that is not logged yet.
+        uint64_t state;
+        while ((state = atomic_load(&m->state)) & MUTEX_STATE_BUSY) sched_yield();
+        bool result = (!(state & MUTEX_STATE_LOCKED) ||
+                       (m->reader_count == 0 && (int)(uint32_t)state == client_pid));
+        pthread_rwlock_unlock(&st->lock);
+        return result;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    if (m == NULL) return false;  // Mutex not found, no permission
+
+    // Fast mutex: sync its lock word first
+    m = lookup_locked(name, &st);
+    bool result = m != NULL && (!mutex_locked(m) ||
+                                (m->reader_count == 0 && mutex_owner(m) == client_pid));
+    pthread_rwlock_unlock(&st->lock);
+    return result;
+}
+
+
+int mutex_subscribe(const char* name, MutexSubscriber* s, uint64_t after, uint64_t* newest) {
+    Stripe* st;
+    Mutex* m = lookup_locked(name, &st);
+    if (m == NULL || need_extra(m) == NULL) {
+        pthread_rwlock_unlock(&st->lock);
+        return m == NULL ? -1 : -2;
+    }
+
+    *newest = newest_seq(m);
+    if (after < *newest) {
+        uint64_t oldest = oldest_seq(m);
+        for (uint64_t seq = after + 1 > oldest ? after + 1 : oldest; seq <= *newest; seq++) {
+            MutexMessage* msg = kept_message(m, seq);
+            if (msg) s->deliver(s, msg);
+        }
+    }
+    s->next = m->cold->extra->subscribers;
+    m->cold->extra->subscribers = s;
+
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+}
+
+
+int mutex_unsubscribe(const char* name, MutexSubscriber* s) {
+    Stripe* st;
+    Mutex* m = lookup_locked(name, &st);
+    int result = -1;
+
+    if (m != NULL && m->cold->extra != NULL) {
+        for (MutexSubscriber** link = &m->cold->extra->subscribers; *link != NULL; link = &(*link)->next) {
+            if (*link == s) {
+                *link = s->next;
+                result = 0;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return result;
+}
+
+
+void mutex_set_observer(mutex_observer fn) {
+    observer = fn;
+}
+
+
+// Registry entry of a fast mutex's slot with its stripe write-locked, NULL (nothing
+// locked) if the slot is no longer live. The name is copied under shm_slots_lock, which
+// serializes slot reuse; the lookup then checks that the entry still owns the slot.
+static Mutex* fast_mutex_of(ShmSlot* slot, Stripe** out) {
+    char name[MAX_MUTEX_NAME];
+
+    pthread_mutex_lock(&shm_slots_lock);
+    bool live = (atomic_load(&slot->state) == SHM_LIVE);
+    if (live) memcpy(name, slot->name, MAX_MUTEX_NAME);
+    pthread_mutex_unlock(&shm_slots_lock);
+    if (!live) return NULL;
+
+    Mutex* m = lookup_locked(name, out);
+    if (m == NULL || lock_word(m) != slot) {
+        pthread_rwlock_unlock(&(*out)->lock);
+        return NULL;
+    }
+    return m;
+}
+
+
+// Hand a client-released fast mutex to its server-side waiters. Returns false if the
+// word kept changing hands between clients: the caller retries later, so the stripe is
+// not held while racing them.
+#define FAST_HANDOFF_TRIES 16
+static bool handoff_fast_slot(ShmSlot* slot) {
+    Stripe* st;
+    MutexWaiter* woken_head = NULL;
+    MutexWaiter* woken_tail = NULL;
+    bool settled = false;
+
+    Mutex* m = fast_mutex_of(slot, &st);
+    if (m == NULL) return true;
+
+    for (int i = 0; i < FAST_HANDOFF_TRIES && !settled; i++) {
+        if (i > 0) sync_fast(m);
+        if (first_waiter(m) == NULL) settled = true;
+        else if (!mutex_locked(m)) { grant_waiters(m, &woken_head, &woken_tail); settled = true; }
+        else settled = shm_flag_server_waiters(slot);  // Its holder will ring again
+    }
+    pthread_rwlock_unlock(&st->lock);
+
+    dispatch_woken(woken_head);
+    return settled;
+}
+
+
+// Run a handoff for every fast mutex a client released while others waited for it
+// through the server (the doorbell rang): shm_unlock marks those slots rung.
+static void handoff_fast_waiters() {
+    bool retry = true;
+
+    while (retry) {
+        retry = false;
+        for (uint32_t i = 0; i < shm_table->capacity; i++) {
+            ShmSlot* slot = &shm_table->slots[i];
+            if (!shm_take_rung(slot)) continue;
+            if (!handoff_fast_slot(slot)) {
+                atomic_store(&slot->rung, 1);
+                retry = true;
+            }
+        }
+        if (retry) sched_yield();
+    }
+    check_deadlocks();
+}
+
+
+static void* shm_watch(void* arg) {
+    (void)arg;
+    uint32_t seen = atomic_load(&shm_table->doorbell);
+
+    while (1) {
+        uint32_t now = shm_doorbell_wait(shm_table, seen);
+        if (now == seen) continue;  // Spurious wakeup
+        seen = now;
+        handoff_fast_waiters();
+    }
+    return NULL;
+}
+
+
+int mutex_shm_start(uint32_t capacity) {
+    pthread_once(&stripes_once, init_stripes);
+
+    shm_table = shm_table_create(capacity);
+    if (shm_table == NULL) return -1;
+
+    if (pthread_create(&shm_thread, NULL, shm_watch, NULL) != 0) {
+        shm_table_destroy(shm_table);
+        shm_table = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+// Remove the table name so that clients stop finding it (the mapping stays valid)
+void mutex_shm_stop() {
+    if (shm_table != NULL) shm_table_unlink();
+}
+
+
+// Release the fast mutexes whose lock word names client_pid (a client that detached or
+// died). Only those slots' stripes are locked.
+void mutex_release_pid(int client_pid) {
+    if (shm_table == NULL) return;
+
+    for (uint32_t i = 0; i < shm_table->capacity; i++) {
+        ShmSlot* slot = &shm_table->slots[i];
+        if (shm_owner(slot) != (uint32_t)client_pid) continue;
+
+        Stripe* st;
+        MutexWaiter* woken_head = NULL;
+        MutexWaiter* woken_tail = NULL;
+        Mutex* m = fast_mutex_of(slot, &st);
+        if (m == NULL) continue;
+
+        if (mutex_locked(m) && mutex_owner(m) == client_pid) {
+            printf("Released fast mutex '%s' held by PID %d\n", m->cold->name, client_pid);
+            release_mutex(m, client_pid, &woken_head, &woken_tail);
+        }
+        pthread_rwlock_unlock(&st->lock);
+
+        dispatch_woken(woken_head);
+    }
+    check_deadlocks();
+}
+
+
+// Give up every hold on m (no waiters: replay runs before clients connect, and clients
+// of a backup cannot lock)
+static void drop_holds(Mutex* m) {
+    MutexWaiter* woken_head = NULL;
+    MutexWaiter* woken_tail = NULL;
+
+    while (mutex_locked(m)) {
+        int pid = m->reader_count > 0 ? readers_of(m)[0].pid : mutex_owner(m);
+        release_mutex(m, pid, &woken_head, &woken_tail);
+    }
+}
+
+
+// wal_apply_fn: bring the registry in line with one record. Records describe the state
+// a change left behind, so applying one the snapshot already contains is harmless.
+static void apply_record(const WalRecord* r) {
+    Stripe* st;
+    Mutex* m = lookup_locked(r->name, &st);
+
+    switch (r->type) {
+        case MUTEX_EVENT_CREATE:
+            // Already there if the snapshot ran after this record: start over
+            if (m != NULL) {
+                MutexWaiter* woken_head = NULL;
+                MutexWaiter* woken_tail = NULL;
+                drop_holds(m);
+                if (lock_word(m)) shm_kill(lock_word(m), 0);
+                remove_mutex(st, m, r->pid, &woken_head, &woken_tail);
             }
-            
-            // Safe message formatting with proper size_t comparison
-            int msg_len = snprintf(response, resp_size, 
-                                 "Message received via mutex '%.20s' from PID %d: %.200s",
-                                 name, client_pid, message);
-            if (msg_len >= 0 && (size_t)msg_len >= resp_size) {
-                response[resp_size - 1] = '\0';
+            pthread_rwlock_unlock(&st->lock);
+
+            // Without a shared-memory table (or room in it) a fast mutex comes back plain
+            if (!(r->flags & WAL_FAST) || create_mutex(r->name, r->pid, true) != 0) {
+                create_mutex(r->name, r->pid, false);
             }
-            
-            // Create welcome message with proper size_t comparison
-            time_t now = time(NULL);
-            struct tm *tm_info = localtime(&now);
-            char time_str[20];
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
-            
-            int welcome_len = snprintf(welcome_msg, welcome_size,
-                                     "Welcome client PID %d! Sent message successfully at %s",
-                                     client_pid, time_str);
-            if (welcome_len >= 0 && (size_t)welcome_len >= welcome_size) {
-                welcome_msg[welcome_size - 1] = '\0';
+            return;
+
+        case MUTEX_EVENT_LOCK:
+            if (m == NULL) break;
+            if (r->flags & WAL_SHARED) {
+                if (mutex_locked(m) && m->reader_count == 0) drop_holds(m);
+                if (find_reader(m, r->pid) < 0 && reserve_reader(m)) {
+                    grant(m, r->pid, 0, true);
+                    readers_of(m)[m->reader_count - 1].acquired_ns = 0;  // Hold time unknown
+                }
+            } else {
+                drop_holds(m);  // The previous holder let go before this record
+                if (lock_word(m) && !shm_acquire(lock_word(m), r->pid, false)) break;
+                grant(m, r->pid, 0, false);
+                m->acquired_ns = 0;
             }
-            
-            // add info about mes  to mutex
-            strncpy(mutexes[i].last_message, message, MAX_MSG_SIZE);
-            mutexes[i].last_message_time = time(NULL);
+            m->lock_time = r->time;
+            break;
 
-            pthread_mutex_unlock(&global_mutex_lock);
-            return 0;
+        case MUTEX_EVENT_UNLOCK:
+            if (m != NULL && holds(m, r->pid)) {
+                MutexWaiter* woken_head = NULL;
+                MutexWaiter* woken_tail = NULL;
+                release_mutex(m, r->pid, &woken_head, &woken_tail);
+            }
+            break;
+
+        case MUTEX_EVENT_DELETE:
+            if (m != NULL) {
+                MutexWaiter* woken_head = NULL;
+                MutexWaiter* woken_tail = NULL;
+                drop_holds(m);
+                if (lock_word(m)) shm_kill(lock_word(m), 0);
+                remove_mutex(st, m, r->pid, &woken_head, &woken_tail);
+            }
+            break;
+
+        case MUTEX_EVENT_SEND: {
+            // Skip messages the ring already has (replay from before a snapshot)
+            if (m == NULL || r->seq <= newest_seq(m)) break;
+            MutexMessage* msg = new_message(r->name, STATUS_OK, r->seq, r->pid, r->time, r->message);
+            if (msg == NULL || !keep_message(m, msg)) {
+                if (msg) shared_release(&msg->frame);
+                break;
+            }
+            notify(MUTEX_EVENT_SEND, m, r->pid);
+            break;
         }
     }
-    
-    pthread_mutex_unlock(&global_mutex_lock);
-    snprintf(response, resp_size, "Mutex '%.20s' not found", name);
-    return -2;
+    pthread_rwlock_unlock(&st->lock);
 }
 
 
-bool mutex_has_permission(const char* name, int client_pid) {
-    pthread_mutex_lock(&global_mutex_lock);
-    
-    for (int i = 0; i < mutex_count; i++) {
-        if (strcmp(mutexes[i].name, name) == 0) {
-            bool result = (!mutexes[i].is_locked || mutexes[i].owner_pid == client_pid);
-            pthread_mutex_unlock(&global_mutex_lock);
-            return result;
+// wal_dump_fn: records that recreate every mutex, its holds and its kept messages. Each
+// stripe is locked while its records are encoded (memory only, no I/O).
+static void dump_registry(Buffer* snapshot) {
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        Stripe* st = &stripes[s];
+
+        pthread_rwlock_wrlock(&st->lock);
+        for (int i = 0; i < st->slot_count; i++) {
+            Mutex* m = slot_at(st, i);
+            if (m->cold == NULL) continue;
+            sync_fast(m);
+
+            int owner = mutex_owner(m);
+            WalRecord r = { .type = MUTEX_EVENT_CREATE, .pid = owner, .name = m->cold->name, .message = "" };
+            if (lock_word(m)) r.flags = WAL_FAST;
+            wal_snapshot_add(snapshot, &r);
+
+            // Holds: the owner field shows the last one granted, so that one goes last
+            r.type = MUTEX_EVENT_LOCK;
+            r.time = m->lock_time;
+            bool owner_holds = mutex_locked(m) && m->reader_count == 0;
+            if (m->reader_count > 0) r.flags |= WAL_SHARED;
+            for (int j = 0; j < m->reader_count; j++) {
+                r.pid = readers_of(m)[j].pid;
+                if (r.pid == owner) owner_holds = true;
+                else wal_snapshot_add(snapshot, &r);
+            }
+            r.pid = owner;
+            if (owner_holds) wal_snapshot_add(snapshot, &r);
+
+            r.type = MUTEX_EVENT_SEND;
+            r.flags &= ~WAL_SHARED;
+            for (uint64_t seq = oldest_seq(m); seq <= newest_seq(m); seq++) {
+                MutexMessage* msg = kept_message(m, seq);
+                if (msg == NULL) continue;
+                r.pid = msg->pid;
+                r.seq = seq;
+                r.time = msg->time;
+                r.message = msg->text;
+                wal_snapshot_add(snapshot, &r);
+            }
         }
+        pthread_rwlock_unlock(&st->lock);
     }
-    
-    pthread_mutex_unlock(&global_mutex_lock);
-    return false;  // Mutex not found, no permission
+}
+
+
+// repl_reset_fn: remove every mutex, before a backup loads the primary's snapshot
+static void clear_registry() {
+    for (int s = 0; s < MUTEX_STRIPES; s++) {
+        Stripe* st = &stripes[s];
+        MutexWaiter* woken_head = NULL;
+        MutexWaiter* woken_tail = NULL;
+
+        pthread_rwlock_wrlock(&st->lock);
+        for (int i = 0; i < st->slot_count; i++) {
+            Mutex* m = slot_at(st, i);
+            if (m->cold == NULL) continue;
+            drop_holds(m);
+            if (lock_word(m)) shm_kill(lock_word(m), 0);
+            remove_mutex(st, m, 0, &woken_head, &woken_tail);
+        }
+        pthread_rwlock_unlock(&st->lock);
+    }
+}
+
+
+int mutex_persist_open(const char* dir) {
+    return wal_open(dir, apply_record, dump_registry);
+}
+
+
+int mutex_follow(const char* primary) {
+    return repl_follow(primary, apply_record, clear_registry);
 }
 
 
@@ -259,6 +2250,13 @@ CommandType parse_command(const char* cmd) {
     if (strcasecmp(cmd, "delete") == 0) return CMD_DELETE;
     if (strcasecmp(cmd, "send") == 0) return CMD_SEND;
     if (strcasecmp(cmd, "exit") == 0) return CMD_EXIT;
+    if (strcasecmp(cmd, "batch") == 0) return CMD_BATCH;
+    if (strcasecmp(cmd, "renew") == 0) return CMD_RENEW;
+    if (strcasecmp(cmd, "rlock") == 0) return CMD_LOCK_SHARED;
+    if (strcasecmp(cmd, "lockall") == 0) return CMD_LOCK_ALL;
+    if (strcasecmp(cmd, "subscribe") == 0) return CMD_SUBSCRIBE;
+    if (strcasecmp(cmd, "unsubscribe") == 0) return CMD_UNSUBSCRIBE;
+    if (strcasecmp(cmd, "open") == 0) return CMD_OPEN;
     return CMD_INVALID;
 }
 
@@ -274,6 +2272,16 @@ const char* command_to_string(CommandType cmd) {
         case CMD_DELETE: return "DELETE";
         case CMD_SEND: return "SEND";
         case CMD_EXIT: return "EXIT";
+        case CMD_HELLO: return "HELLO";
+        case CMD_BATCH: return "BATCH";
+        case CMD_RENEW: return "RENEW";
+        case CMD_LOCK_SHARED: return "RLOCK";
+        case CMD_LOCK_ALL: return "LOCKALL";
+        case CMD_ATTACH: return "ATTACH";
+        case CMD_SUBSCRIBE: return "SUBSCRIBE";
+        case CMD_UNSUBSCRIBE: return "UNSUBSCRIBE";
+        case CMD_MESSAGE: return "MESSAGE";
+        case CMD_OPEN: return "OPEN";
         default: return "INVALID";
     }
 }
@@ -283,10 +2291,26 @@ void print_help() {
     printf("\nAvailable commands:\n");
     printf("help                 - Show this help message\n");
     printf("create <mutex_name>  - Create a new mutex\n");
+    printf("create <mutex> fast  - Create a mutex local clients lock in shared memory\n");
     printf("lock <mutex_name>    - Lock a mutex (gain ownership)\n");
+    printf("lock <mutex> wait    - Block until the mutex is free (FIFO order)\n");
+    printf("lock <mutex> <ms>    - Block for at most <ms> milliseconds\n");
+    printf("lock <mutex> [wait|<ms>] ttl <ms>\n");
+    printf("                     - Lock with a lease: released after <ms> unless renewed\n");
+    printf("renew <mutex> <ms>   - Extend the lease of a held mutex to <ms> from now\n");
+    printf("rlock <mutex> ...    - Lock in shared (read) mode, same options as lock\n");
+    printf("lockall <mutex> [<mutex> ...] [wait|<ms>]\n");
+    printf("                     - Lock every listed mutex, or none of them\n");
     printf("unlock <mutex_name>  - Unlock a mutex (release ownership)\n");
     printf("list                 - List all mutexes and their status\n");
     printf("delete <mutex_name>  - Delete a mutex\n");
+    printf("open <mutex_name>    - Get the mutex's handle: lock, unlock, send and delete\n");
+    printf("                       take #<handle> in place of the name\n");
     printf("send <mutex> <msg>   - Send message (requires ownership)\n");
+    printf("subscribe <mutex> [all]\n");
+    printf("                     - Print messages sent via the mutex (all: kept ones first)\n");
+    printf("unsubscribe <mutex>  - Stop printing its messages\n");
+    printf("batch <cmd> <mutex> [<cmd> <mutex> ...]\n");
+    printf("                     - Create/lock/unlock/delete several mutexes in one request\n");
     printf("exit                 - Exit the client\n\n");
 }
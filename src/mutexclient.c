@@ -0,0 +1,625 @@
+#include "../inc/mutexclient.h"
+#include "../inc/shmtable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Request waiting for its response; responses arrive in request order
+typedef struct PendingCall {
+    mc_callback cb;
+    void* ctx;
+    struct PendingCall* next;
+} PendingCall;
+
+struct MutexClient {
+    int fd;
+    pid_t pid;                  // Process that opened the connection
+    bool failed;                // Connection is unusable; pending calls got MC_ERROR
+    pthread_mutex_t lock;       // Recursive, so callbacks may issue new requests
+    Buffer in;                  // Received bytes not dispatched yet
+    Buffer out;                 // Requests the socket did not accept yet
+    PendingCall* head;
+    PendingCall* tail;
+    int pending;
+    ShmTable* shm;              // Mapped fast mutex table, NULL until first needed
+    bool attached;              // Server frees our fast mutexes when this connection closes
+    bool no_fast;               // ATTACH failed (remote server, table disabled)
+    mc_message_fn on_message;   // Handler of pushed messages, NULL = drop them
+    void* message_ctx;
+};
+
+// Result of a synchronous call, filled in by sync_done
+typedef struct {
+    bool done;
+    int status;
+    char* out;                  // Optional copy of the payload, NUL-terminated
+    size_t out_size;
+} SyncResult;
+
+static MutexClient* default_client = NULL;
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Connect a blocking socket to the server, then switch it to non-blocking mode
+static int open_socket(const char* host, int port) {
+    int fd = proto_connect(host, port);
+    if (fd < 0) return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+// Mark the connection failed and complete every pending call with MC_ERROR
+static void fail_client(MutexClient* c, int err) {
+    c->failed = true;
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+    buf_consume(&c->in, c->in.len);
+    buf_consume(&c->out, c->out.len);
+
+    while (c->head != NULL) {
+        PendingCall* call = c->head;
+        c->head = call->next;
+        c->pending--;
+        if (call->cb) call->cb(c, MC_ERROR, NULL, 0, call->ctx);
+        free(call);
+    }
+    c->tail = NULL;
+    errno = err;
+}
+
+
+// Send what the socket accepts without blocking
+static void flush_output(MutexClient* c) {
+    while (!c->failed && c->out.len > 0) {
+        ssize_t n = send(c->fd, c->out.data, c->out.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            buf_consume(&c->out, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            fail_client(c, errno);
+        }
+    }
+}
+
+
+// Receive what is available without blocking
+static void read_input(MutexClient* c) {
+    uint8_t chunk[16384];
+
+    while (!c->failed) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n > 0) {
+            if (buf_append(&c->in, chunk, n) < 0) fail_client(c, ENOMEM);
+            if ((size_t)n < sizeof(chunk)) break;
+        } else if (n == 0) {
+            fail_client(c, ECONNRESET);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            fail_client(c, errno);
+        }
+    }
+}
+
+
+// Pass a pushed message (the frame at the front of c->in) to the handler
+static void dispatch_message(MutexClient* c, const ProtoResponse* resp, int size) {
+    ProtoMessage msg;
+    uint8_t* payload = NULL;
+    mc_message_fn fn = c->on_message;
+
+    // Copy it out of the input buffer first, as for responses
+    if (fn && resp->payload_len > 0 && (payload = malloc(resp->payload_len)) != NULL) {
+        memcpy(payload, resp->payload, resp->payload_len);
+    }
+    ProtoResponse copy = { resp->version, resp->op, resp->status, payload, resp->payload_len };
+    int16_t status = resp->status;
+    buf_consume(&c->in, size);
+
+    if (payload && proto_get_message(&copy, &msg) == 0) fn(c, status, &msg, c->message_ctx);
+    free(payload);
+}
+
+
+// Run the callbacks of the complete responses received so far
+static int dispatch(MutexClient* c) {
+    int count = 0;
+    ProtoResponse resp;
+
+    while (!c->failed) {
+        int size = proto_get_response(&c->in, &resp);
+        if (size == 0) break;
+        if (size < 0 || (resp.op != CMD_MESSAGE && c->head == NULL)) {
+            fail_client(c, EPROTO);
+            break;
+        }
+        if (resp.op == CMD_MESSAGE) {
+            dispatch_message(c, &resp, size);
+            count++;
+            continue;
+        }
+
+        // Take the response out of the input buffer first: the callback may
+        // issue requests on this client and read more input
+        PendingCall* call = c->head;
+        c->head = call->next;
+        if (c->head == NULL) c->tail = NULL;
+        c->pending--;
+
+        int status = resp.status;
+        size_t payload_len = resp.payload_len;
+        void* payload = NULL;
+        if (payload_len > 0 && (payload = malloc(payload_len)) != NULL) {
+            memcpy(payload, resp.payload, payload_len);
+        }
+        if (payload_len > 0 && payload == NULL) {
+            status = STATUS_NO_MEMORY;
+            payload_len = 0;
+        }
+        buf_consume(&c->in, size);
+
+        if (call->cb) call->cb(c, status, payload, payload_len, call->ctx);
+        free(payload);
+        free(call);
+        count++;
+    }
+    return count;
+}
+
+
+// Block until *done is set (by a callback) or the connection fails
+static void wait_for(MutexClient* c, const bool* done) {
+    while (!*done && !c->failed) {
+        flush_output(c);
+        dispatch(c);
+        if (*done || c->failed) break;
+
+        struct pollfd pfd = { c->fd, POLLIN | (c->out.len > 0 ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            fail_client(c, errno);
+            break;
+        }
+        read_input(c);
+    }
+}
+
+
+static void sync_done(MutexClient* c, int status, const void* payload,
+                      size_t payload_len, void* ctx) {
+    SyncResult* r = ctx;
+    (void)c;
+
+    r->done = true;
+    r->status = status;
+    if (r->out && r->out_size > 0) {
+        size_t n = payload_len < r->out_size - 1 ? payload_len : r->out_size - 1;
+        if (n > 0) memcpy(r->out, payload, n);
+        r->out[n] = '\0';
+    }
+}
+
+
+// Queue a request for the mutex name, or handle if it is not 0; the caller holds c->lock
+static int submit_locked(MutexClient* c, CommandType op, const char* name, MutexHandle handle,
+                         int32_t arg, const void* payload, uint32_t payload_len,
+                         mc_callback cb, void* ctx) {
+    if (c->failed) {
+        errno = ENOTCONN;
+        return MC_ERROR;
+    }
+    if (name && strlen(name) >= MAX_MUTEX_NAME) {
+        errno = ENAMETOOLONG;
+        return MC_ERROR;
+    }
+
+    PendingCall* call = malloc(sizeof(PendingCall));
+    int rc = !call ? -1
+           : handle ? proto_put_handle_request(&c->out, op, arg, handle, payload, payload_len)
+                    : proto_put_request(&c->out, op, arg, name, payload, payload_len);
+    if (rc < 0) {
+        free(call);
+        errno = ENOMEM;
+        return MC_ERROR;
+    }
+    call->cb = cb;
+    call->ctx = ctx;
+    call->next = NULL;
+    if (c->tail) {
+        c->tail->next = call;
+    } else {
+        c->head = call;
+    }
+    c->tail = call;
+    c->pending++;
+
+    flush_output(c);
+    return 0;
+}
+
+
+// Open the socket and send HELLO; the caller holds c->lock
+static int open_locked(MutexClient* c, const char* host, int port) {
+    c->fd = open_socket(host, port);
+    if (c->fd < 0) return MC_ERROR;
+    c->failed = false;
+    c->pid = getpid();
+    c->attached = c->no_fast = false;
+
+    SyncResult r = { false, MC_ERROR, NULL, 0 };
+    if (submit_locked(c, CMD_HELLO, NULL, 0, c->pid, NULL, 0, sync_done, &r) == 0) {
+        wait_for(c, &r.done);
+    }
+    if (r.status != STATUS_OK) {
+        if (!c->failed) fail_client(c, ECONNREFUSED);
+        return MC_ERROR;
+    }
+    return 0;
+}
+
+
+MutexClient* mc_connect(const char* host, int port) {
+    MutexClient* c = calloc(1, sizeof(MutexClient));
+    if (!c) return NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (open_locked(c, host, port) < 0) {
+        int err = errno;
+        mc_close(c);
+        errno = err;
+        return NULL;
+    }
+    return c;
+}
+
+
+// Resolve NULL to the process-wide connection, opening it on first use and reopening
+// it after a failure or in a forked child
+static MutexClient* get_client(MutexClient* c) {
+    if (c != NULL) return c;
+
+    pthread_mutex_lock(&default_lock);
+    if (default_client == NULL) {
+        default_client = mc_connect(getenv("MUTEX_SERVER_HOST"), SERVER_PORT);
+    }
+    c = default_client;
+    pthread_mutex_unlock(&default_lock);
+    if (c == NULL) return NULL;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->pid != getpid() && !c->failed) {
+        // Forked child: leave the parent's connection alone
+        close(c->fd);
+        c->fd = -1;
+        c->failed = true;
+    }
+    if (c->failed) {
+        open_locked(c, getenv("MUTEX_SERVER_HOST"), SERVER_PORT);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return c;
+}
+
+
+void mc_close(MutexClient* c) {
+    if (c == NULL) {
+        pthread_mutex_lock(&default_lock);
+        c = default_client;
+        default_client = NULL;
+        pthread_mutex_unlock(&default_lock);
+        if (c == NULL) return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (c->fd != -1 || c->head != NULL) fail_client(c, ECANCELED);
+    pthread_mutex_unlock(&c->lock);
+
+    buf_free(&c->in);
+    buf_free(&c->out);
+    if (c->shm) shm_table_close(c->shm);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+
+// Run one request to completion, copying its payload into out if given
+static int call_key(MutexClient* c, CommandType op, const char* name, MutexHandle handle,
+                    int32_t arg, const void* payload, uint32_t payload_len,
+                    char* out, size_t out_size) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    SyncResult r = { false, MC_ERROR, out, out_size };
+    pthread_mutex_lock(&c->lock);
+    if (submit_locked(c, op, name, handle, arg, payload, payload_len, sync_done, &r) == 0) {
+        wait_for(c, &r.done);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return r.status;
+}
+
+
+static int call(MutexClient* c, CommandType op, const char* name, int32_t arg,
+                const void* payload, uint32_t payload_len, char* out, size_t out_size) {
+    return call_key(c, op, name, 0, arg, payload, payload_len, out, out_size);
+}
+
+
+// CREATE or OPEN, and the handle they answer with
+static int call_open(MutexClient* c, CommandType op, const char* name, MutexHandle* handle) {
+    char out[9] = { 0 };
+    int status = call(c, op, name, 0, NULL, 0, out, sizeof(out));
+    if (status == STATUS_OK) *handle = proto_get_u64((const uint8_t*)out);
+    return status;
+}
+
+
+int mc_create(MutexClient* c, const char* name) {
+    return call(c, CMD_CREATE, name, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_lock(MutexClient* c, const char* name, int timeout_ms) {
+    return call(c, CMD_LOCK, name, timeout_ms, NULL, 0, NULL, 0);
+}
+
+
+// Lock with a lease: the server releases the mutex ttl_ms after it is granted
+// unless mc_renew extends it
+int mc_lock_lease(MutexClient* c, const char* name, int timeout_ms, uint32_t ttl_ms) {
+    uint8_t ttl[4];
+    proto_put_u32(ttl, ttl_ms);
+    return call(c, CMD_LOCK, name, timeout_ms, ttl, sizeof(ttl), NULL, 0);
+}
+
+
+// Shared (read) lock: held together with other readers, released with mc_unlock
+int mc_lock_shared(MutexClient* c, const char* name, int timeout_ms, uint32_t ttl_ms) {
+    uint8_t ttl[4];
+    proto_put_u32(ttl, ttl_ms);
+    return call(c, CMD_LOCK_SHARED, name, timeout_ms, ttl, ttl_ms ? sizeof(ttl) : 0, NULL, 0);
+}
+
+
+int mc_renew(MutexClient* c, const char* name, uint32_t ttl_ms) {
+    return call(c, CMD_RENEW, name, (int32_t)ttl_ms, NULL, 0, NULL, 0);
+}
+
+
+// Lock every name, or none of them. While one is busy and timeout_ms allows waiting,
+// the server takes them one at a time in name order. On failure *failed (if given) is
+// the index of the name that could not be locked.
+int mc_lock_all(MutexClient* c, const char* const* names, int count, int timeout_ms, int* failed) {
+    Buffer payload = {0};
+    char reply[4] = {0};
+
+    for (int i = 0; i < count; i++) {
+        if (proto_put_batch_op(&payload, CMD_LOCK, names[i]) < 0) {
+            buf_free(&payload);
+            errno = EINVAL;
+            return MC_ERROR;
+        }
+    }
+
+    int status = call(c, CMD_LOCK_ALL, NULL, timeout_ms, payload.data, payload.len,
+                      reply, sizeof(reply));
+    buf_free(&payload);
+    if (failed) *failed = (int16_t)(((uint8_t)reply[0] << 8) | (uint8_t)reply[1]);
+    return status;
+}
+
+
+int mc_unlock(MutexClient* c, const char* name) {
+    return call(c, CMD_UNLOCK, name, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_delete(MutexClient* c, const char* name) {
+    return call(c, CMD_DELETE, name, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_send(MutexClient* c, const char* name, const char* message, char* reply, size_t reply_size) {
+    return call(c, CMD_SEND, name, 0, message, strlen(message), reply, reply_size);
+}
+
+
+int mc_create_handle(MutexClient* c, const char* name, MutexHandle* handle) {
+    return call_open(c, CMD_CREATE, name, handle);
+}
+
+
+int mc_open(MutexClient* c, const char* name, MutexHandle* handle) {
+    return call_open(c, CMD_OPEN, name, handle);
+}
+
+
+int mc_lock_handle(MutexClient* c, MutexHandle handle, int timeout_ms) {
+    return call_key(c, CMD_LOCK, NULL, handle, timeout_ms, NULL, 0, NULL, 0);
+}
+
+
+int mc_unlock_handle(MutexClient* c, MutexHandle handle) {
+    return call_key(c, CMD_UNLOCK, NULL, handle, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_delete_handle(MutexClient* c, MutexHandle handle) {
+    return call_key(c, CMD_DELETE, NULL, handle, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_send_handle(MutexClient* c, MutexHandle handle, const char* message, char* reply,
+                   size_t reply_size) {
+    return call_key(c, CMD_SEND, NULL, handle, 0, message, strlen(message), reply, reply_size);
+}
+
+
+int mc_list(MutexClient* c, char* out, size_t out_size) {
+    return call(c, CMD_LIST, NULL, 0, NULL, 0, out, out_size);
+}
+
+
+void mc_on_message(MutexClient* c, mc_message_fn fn, void* ctx) {
+    c = get_client(c);
+    if (c == NULL) return;
+
+    pthread_mutex_lock(&c->lock);
+    c->on_message = fn;
+    c->message_ctx = ctx;
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+int mc_subscribe(MutexClient* c, const char* name, uint64_t after, uint64_t* newest) {
+    uint8_t payload[8];
+    char out[sizeof(payload) + 1];
+
+    proto_put_u64(payload, after);
+    int status = call(c, CMD_SUBSCRIBE, name, 0, payload, sizeof(payload), out, sizeof(out));
+    if (status == STATUS_OK && newest) *newest = proto_get_u64((const uint8_t*)out);
+    return status;
+}
+
+
+int mc_unsubscribe(MutexClient* c, const char* name) {
+    return call(c, CMD_UNSUBSCRIBE, name, 0, NULL, 0, NULL, 0);
+}
+
+
+int mc_create_fast(MutexClient* c, const char* name) {
+    return call(c, CMD_CREATE, name, 1, NULL, 0, NULL, 0);
+}
+
+
+// The fast mutex table, once the server agreed to clean up after this process.
+// NULL if fast locking is not available over c.
+static ShmTable* fast_table(MutexClient* c) {
+    pthread_mutex_lock(&c->lock);
+    if (!c->attached && !c->no_fast) {
+        if (call(c, CMD_ATTACH, NULL, 0, NULL, 0, NULL, 0) == STATUS_OK &&
+            (c->shm != NULL || (c->shm = shm_table_open()) != NULL)) {
+            c->attached = true;
+        } else {
+            c->no_fast = true;
+        }
+    }
+    ShmTable* t = c->attached ? c->shm : NULL;
+    pthread_mutex_unlock(&c->lock);
+    return t;
+}
+
+
+int mc_fast_lock(MutexClient* c, const char* name, int timeout_ms) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    ShmTable* t = fast_table(c);
+    uint32_t generation;
+    ShmSlot* s = t ? shm_slot_find(t, name, &generation) : NULL;
+    if (s != NULL) {
+        switch (shm_lock(t, s, generation, c->pid, timeout_ms)) {
+            case 0: return STATUS_OK;
+            case -1: return STATUS_LOCKED_OTHER;
+            case -2: return STATUS_LOCKED_SELF;
+            case -3: return STATUS_TIMEOUT;
+            default: break;  // Deleted meanwhile: let the server answer
+        }
+    }
+    return mc_lock(c, name, timeout_ms);
+}
+
+
+int mc_fast_unlock(MutexClient* c, const char* name) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    ShmTable* t = fast_table(c);
+    uint32_t generation;
+    ShmSlot* s = t ? shm_slot_find(t, name, &generation) : NULL;
+    if (s != NULL) {
+        switch (shm_unlock(t, s, c->pid)) {
+            case 0: return STATUS_OK;
+            case -2: return STATUS_NOT_OWNER;
+            default: break;  // Not locked, or deleted: let the server answer
+        }
+    }
+    return mc_unlock(c, name);
+}
+
+
+int mc_submit(MutexClient* c, CommandType op, const char* name, int32_t arg,
+              const void* payload, uint32_t payload_len, mc_callback cb, void* ctx) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    pthread_mutex_lock(&c->lock);
+    int rc = submit_locked(c, op, name, 0, arg, payload, payload_len, cb, ctx);
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+
+int mc_submit_handle(MutexClient* c, CommandType op, MutexHandle handle, int32_t arg,
+                     const void* payload, uint32_t payload_len, mc_callback cb, void* ctx) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    pthread_mutex_lock(&c->lock);
+    int rc = submit_locked(c, op, NULL, handle, arg, payload, payload_len, cb, ctx);
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+
+int mc_fd(MutexClient* c) {
+    c = get_client(c);
+    return c ? c->fd : MC_ERROR;
+}
+
+
+bool mc_want_write(MutexClient* c) {
+    c = get_client(c);
+    if (c == NULL) return false;
+
+    pthread_mutex_lock(&c->lock);
+    bool want = c->out.len > 0;
+    pthread_mutex_unlock(&c->lock);
+    return want;
+}
+
+
+int mc_pending(MutexClient* c) {
+    c = get_client(c);
+    if (c == NULL) return 0;
+
+    pthread_mutex_lock(&c->lock);
+    int pending = c->pending;
+    pthread_mutex_unlock(&c->lock);
+    return pending;
+}
+
+
+int mc_process(MutexClient* c) {
+    c = get_client(c);
+    if (c == NULL) return MC_ERROR;
+
+    pthread_mutex_lock(&c->lock);
+    flush_output(c);
+    read_input(c);
+    int count = dispatch(c);
+    int rc = c->failed ? MC_ERROR : count;
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
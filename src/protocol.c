@@ -0,0 +1,402 @@
+#include "../inc/protocol.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+
+int buf_append(Buffer* b, const void* data, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t new_cap = b->cap ? b->cap : 256;
+        while (new_cap < b->len + n) new_cap *= 2;
+
+        uint8_t* new_data = realloc(b->data, new_cap);
+        if (!new_data) return -1;
+        b->data = new_data;
+        b->cap = new_cap;
+    }
+
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+
+// Drop n bytes from the front of the buffer
+void buf_consume(Buffer* b, size_t n) {
+    if (n >= b->len) {
+        b->len = 0;
+        return;
+    }
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+
+void buf_free(Buffer* b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+
+void shared_retain(SharedBuf* b) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+
+void shared_release(SharedBuf* b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) b->destroy(b);
+}
+
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+
+void proto_put_u32(uint8_t* p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+
+static uint16_t get_u16(const uint8_t* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+
+uint32_t proto_get_u32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+
+void proto_put_u64(uint8_t* p, uint64_t v) {
+    proto_put_u32(p, (uint32_t)(v >> 32));
+    proto_put_u32(p + 4, (uint32_t)v);
+}
+
+
+uint64_t proto_get_u64(const uint8_t* p) {
+    return (uint64_t)proto_get_u32(p) << 32 | proto_get_u32(p + 4);
+}
+
+
+// Request whose name field is `field` (field_len bytes), with name_len as given
+static int put_request(Buffer* out, uint8_t op, int32_t arg, uint16_t name_len,
+                       const void* field, size_t field_len, const void* payload,
+                       uint32_t payload_len) {
+    uint8_t header[PROTO_REQUEST_HEADER];
+    proto_put_u32(header, PROTO_REQUEST_HEADER - 4 + field_len + payload_len);
+    header[4] = PROTO_VERSION;
+    header[5] = op;
+    put_u16(header + 6, name_len);
+    proto_put_u32(header + 8, (uint32_t)arg);
+
+    if (buf_append(out, header, sizeof(header)) < 0) return -1;
+    if (field_len > 0 && buf_append(out, field, field_len) < 0) return -1;
+    if (payload_len > 0 && buf_append(out, payload, payload_len) < 0) return -1;
+    return 0;
+}
+
+
+int proto_put_request(Buffer* out, uint8_t op, int32_t arg, const char* name,
+                      const void* payload, uint32_t payload_len) {
+    size_t name_len = name ? strlen(name) : 0;
+    if (name_len >= PROTO_NAME_HANDLE) return -1;
+
+    return put_request(out, op, arg, (uint16_t)name_len, name, name_len, payload, payload_len);
+}
+
+
+int proto_put_handle_request(Buffer* out, uint8_t op, int32_t arg, MutexHandle handle,
+                             const void* payload, uint32_t payload_len) {
+    uint8_t field[8];
+    proto_put_u64(field, handle);
+    return put_request(out, op, arg, PROTO_NAME_HANDLE | sizeof(field), field, sizeof(field),
+                       payload, payload_len);
+}
+
+
+int proto_put_response(Buffer* out, uint8_t op, int16_t status,
+                       const void* payload, uint32_t payload_len) {
+    uint8_t header[PROTO_RESPONSE_HEADER];
+    proto_put_u32(header, PROTO_RESPONSE_HEADER - 4 + payload_len);
+    header[4] = PROTO_VERSION;
+    header[5] = op;
+    put_u16(header + 6, (uint16_t)status);
+
+    if (buf_append(out, header, sizeof(header)) < 0) return -1;
+    if (payload_len > 0 && buf_append(out, payload, payload_len) < 0) return -1;
+    return 0;
+}
+
+
+// Size of the complete frame at the start of `in`, 0 if incomplete, -1 if invalid
+static int frame_size(const Buffer* in, size_t header_size) {
+    if (in->len < 4) return 0;
+
+    uint32_t length = proto_get_u32(in->data);
+    if (length < header_size - 4 || length > PROTO_MAX_FRAME) return -1;
+    if (in->len < 4 + (size_t)length) return 0;
+    return (int)(4 + length);
+}
+
+
+int proto_get_request(const Buffer* in, ProtoRequest* req) {
+    int size = frame_size(in, PROTO_REQUEST_HEADER);
+    if (size <= 0) return size;
+
+    const uint8_t* p = in->data;
+    req->version = p[4];
+    req->op = p[5];
+    req->name_len = get_u16(p + 6);
+    req->arg = (int32_t)proto_get_u32(p + 8);
+    req->handle = 0;
+
+    // A handle instead of the name: the name stays empty
+    size_t field_len = req->name_len & ~PROTO_NAME_HANDLE;
+    if (PROTO_REQUEST_HEADER + field_len > (size_t)size) return -1;
+    if (req->name_len & PROTO_NAME_HANDLE) {
+        if (field_len == 8) req->handle = proto_get_u64(p + PROTO_REQUEST_HEADER);
+        req->name_len = 0;
+    }
+
+    // Over-long names are left empty; the server answers STATUS_INVALID
+    req->name[0] = '\0';
+    if (req->name_len < MAX_MUTEX_NAME) {
+        memcpy(req->name, p + PROTO_REQUEST_HEADER, req->name_len);
+        req->name[req->name_len] = '\0';
+    }
+
+    req->payload = p + PROTO_REQUEST_HEADER + field_len;
+    req->payload_len = size - PROTO_REQUEST_HEADER - field_len;
+    return size;
+}
+
+
+int proto_get_response(const Buffer* in, ProtoResponse* resp) {
+    int size = frame_size(in, PROTO_RESPONSE_HEADER);
+    if (size <= 0) return size;
+
+    const uint8_t* p = in->data;
+    resp->version = p[4];
+    resp->op = p[5];
+    resp->status = (int16_t)get_u16(p + 6);
+    resp->payload = p + PROTO_RESPONSE_HEADER;
+    resp->payload_len = size - PROTO_RESPONSE_HEADER;
+    return size;
+}
+
+
+int proto_put_batch_op(Buffer* out, uint8_t op, const char* name) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= MAX_MUTEX_NAME) return -1;
+
+    uint8_t header[2] = { op, (uint8_t)name_len };
+    if (buf_append(out, header, sizeof(header)) < 0) return -1;
+    return buf_append(out, name, name_len);
+}
+
+
+int proto_get_batch_op(const uint8_t** p, const uint8_t* end, uint8_t* op, char* name) {
+    const uint8_t* q = *p;
+    if (q == end) return 0;
+    if (end - q < 2) return -1;
+
+    size_t name_len = q[1];
+    if (name_len == 0 || name_len >= MAX_MUTEX_NAME || (size_t)(end - q - 2) < name_len) return -1;
+
+    *op = q[0];
+    memcpy(name, q + 2, name_len);
+    name[name_len] = '\0';
+    *p = q + 2 + name_len;
+    return 1;
+}
+
+
+int proto_put_batch_status(Buffer* out, int16_t status) {
+    uint8_t p[2];
+    put_u16(p, (uint16_t)status);
+    return buf_append(out, p, sizeof(p));
+}
+
+
+// Status of the index-th batch operation (STATUS_INVALID past the end)
+int16_t proto_get_batch_status(const ProtoResponse* resp, uint32_t index) {
+    if ((uint64_t)index * 2 + 2 > resp->payload_len) return STATUS_INVALID;
+    return (int16_t)get_u16(resp->payload + index * 2);
+}
+
+
+size_t proto_message_size(size_t name_len, size_t text_len) {
+    return PROTO_RESPONSE_HEADER + PROTO_MESSAGE_HEADER + name_len + text_len;
+}
+
+
+// Encode a whole CMD_MESSAGE frame in place (name shorter than MAX_MUTEX_NAME), so the
+// server can build it once and queue it on every subscriber
+void proto_put_message(uint8_t* out, int16_t status, uint64_t seq, int64_t time, int32_t pid,
+                       const char* name, const char* text, size_t text_len) {
+    size_t name_len = strlen(name);
+
+    proto_put_u32(out, proto_message_size(name_len, text_len) - 4);
+    out[4] = PROTO_VERSION;
+    out[5] = CMD_MESSAGE;
+    put_u16(out + 6, (uint16_t)status);
+
+    uint8_t* p = out + PROTO_RESPONSE_HEADER;
+    proto_put_u64(p, seq);
+    proto_put_u64(p + 8, (uint64_t)time);
+    proto_put_u32(p + 16, (uint32_t)pid);
+    p[20] = (uint8_t)name_len;
+    memcpy(p + PROTO_MESSAGE_HEADER, name, name_len);
+    if (text_len > 0) memcpy(p + PROTO_MESSAGE_HEADER + name_len, text, text_len);
+}
+
+
+int proto_get_message(const ProtoResponse* resp, ProtoMessage* msg) {
+    const uint8_t* p = resp->payload;
+    if (resp->payload_len < PROTO_MESSAGE_HEADER) return -1;
+
+    size_t name_len = p[20];
+    if (name_len >= MAX_MUTEX_NAME || resp->payload_len < PROTO_MESSAGE_HEADER + name_len) return -1;
+
+    msg->seq = proto_get_u64(p);
+    msg->time = (int64_t)proto_get_u64(p + 8);
+    msg->pid = (int32_t)proto_get_u32(p + 16);
+    memcpy(msg->name, p + PROTO_MESSAGE_HEADER, name_len);
+    msg->name[name_len] = '\0';
+    msg->text = (const char*)p + PROTO_MESSAGE_HEADER + name_len;
+    msg->text_len = resp->payload_len - PROTO_MESSAGE_HEADER - name_len;
+    return 0;
+}
+
+
+static int connect_unix(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+
+int proto_connect(const char* host, int port) {
+    if (host != NULL && strncmp(host, "unix:", 5) == 0) return connect_unix(host + 5);
+
+    // Local server: skip the TCP/IP stack when its Unix socket is there
+    if (host == NULL) {
+        int fd = connect_unix(SERVER_SOCKET_PATH);
+        if (fd >= 0) return fd;
+    }
+
+    // "host:port" overrides the port (a single colon only, so IPv6 addresses pass as is)
+    char name[256];
+    const char* colon = host ? strrchr(host, ':') : NULL;
+    if (colon != NULL && colon == strchr(host, ':') && (size_t)(colon - host) < sizeof(name)) {
+        memcpy(name, host, colon - host);
+        name[colon - host] = '\0';
+        port = atoi(colon + 1);
+        host = name;
+    }
+
+    struct addrinfo hints = {0};
+    struct addrinfo* addrs;
+    char service[16];
+    int fd = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host ? host : "127.0.0.1", service, &hints, &addrs) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (struct addrinfo* a = addrs; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) return -1;
+
+    // Small request/response frames: do not wait to coalesce them
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return fd;
+}
+
+
+int proto_send_all(int fd, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Read from fd until `in` holds at least one complete frame (whatever its direction).
+// Returns the frame size, 0 if the peer closed the connection, -1 on error.
+int proto_recv_frame(int fd, Buffer* in) {
+    while (1) {
+        int size = frame_size(in, 4);
+        if (size != 0) return size;
+
+        uint8_t chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (buf_append(in, chunk, n) < 0) return -1;
+    }
+}
+
+
+const char* status_to_string(Status status) {
+    switch (status) {
+        case STATUS_OK: return "OK";
+        case STATUS_NOT_FOUND: return "NOT_FOUND";
+        case STATUS_EXISTS: return "EXISTS";
+        case STATUS_LOCKED_OTHER: return "LOCKED_OTHER";
+        case STATUS_LOCKED_SELF: return "LOCKED_SELF";
+        case STATUS_SYSTEM_BUSY: return "SYSTEM_BUSY";
+        case STATUS_NOT_LOCKED: return "NOT_LOCKED";
+        case STATUS_NOT_OWNER: return "NOT_OWNER";
+        case STATUS_TIMEOUT: return "TIMEOUT";
+        case STATUS_NO_MEMORY: return "NO_MEMORY";
+        case STATUS_INVALID: return "INVALID";
+        case STATUS_BAD_VERSION: return "BAD_VERSION";
+        case STATUS_DEADLOCK: return "DEADLOCK";
+        case STATUS_READ_ONLY: return "READ_ONLY";
+        default: return "UNKNOWN";
+    }
+}
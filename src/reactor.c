@@ -0,0 +1,406 @@
+#define _GNU_SOURCE  // accept4
+#include "../inc/reactor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 16384
+#define MAX_IOV 64          // Output pieces per sendmsg
+
+// Epoll tags: data.ptr points to a Listener or a Conn, both starting with `kind`
+enum { KIND_LISTENER = 1, KIND_CONN };
+
+typedef struct {
+    int kind;
+    int fd;
+    const ConnOps* ops;
+} Listener;
+
+
+Reactor* reactor_create(int id) {
+    Reactor* r = calloc(1, sizeof(Reactor));
+    if (!r) return NULL;
+
+    r->id = id;
+    r->epoll_fd = epoll_create1(0);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->epoll_fd < 0 || r->wake_fd < 0) {
+        perror("reactor");
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->inbox_lock, NULL);
+    wheel_init(&r->timers, monotonic_ms());
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev);
+    return r;
+}
+
+
+// Accept connections from listen_fd (must be non-blocking) and serve them with ops.
+// A listener shared by several reactors wakes only one of them per connection.
+int reactor_listen(Reactor* r, int listen_fd, const ConnOps* ops) {
+    Listener* l = malloc(sizeof(Listener));
+    if (!l) return -1;
+    l->kind = KIND_LISTENER;
+    l->fd = listen_fd;
+    l->ops = ops;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = l };
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+
+void reactor_add_timer(Reactor* r, TimerEntry* t, uint64_t deadline_ms) {
+    wheel_add(&r->timers, t, deadline_ms);
+}
+
+
+void reactor_cancel_timer(Reactor* r, TimerEntry* t) {
+    wheel_remove(&r->timers, t);
+}
+
+
+// Free connections released during the last batch of events (the batch may still
+// hold pointers to them)
+static void free_released(Reactor* r) {
+    while (r->released != NULL) {
+        Conn* c = r->released;
+        r->released = c->released_next;
+
+        buf_free(&c->in);
+        buf_free(&c->out);
+        for (size_t i = c->shared_head; i < c->shared_count; i++) shared_release(c->shared[i]);
+        free(c->shared);
+        free(c->session);
+        free(c);
+    }
+}
+
+
+void conn_hold(Conn* c) {
+    c->refs++;
+}
+
+
+void conn_release(Conn* c) {
+    if (--c->refs == 0) {
+        c->released_next = c->reactor->released;
+        c->reactor->released = c;
+    }
+}
+
+
+void conn_close(Conn* c) {
+    if (c->closed) return;
+    c->closed = true;
+
+    epoll_ctl(c->reactor->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->reactor->conn_count--;
+
+    c->ops->on_close(c);
+    conn_release(c);  // Drop the reactor's reference
+}
+
+
+void conn_pause(Conn* c) {
+    c->paused = true;
+}
+
+
+// Deliver input again, including requests that arrived while paused
+void conn_resume(Conn* c) {
+    c->paused = false;
+    if (!c->closed && c->in.len > 0) c->ops->on_data(c);
+}
+
+
+void conn_post(Conn* c) {
+    Reactor* r = c->reactor;
+
+    pthread_mutex_lock(&r->inbox_lock);
+    bool first = (r->inbox == NULL);
+    if (!c->in_inbox) {
+        c->in_inbox = true;
+        c->inbox_next = r->inbox;
+        r->inbox = c;
+    }
+    pthread_mutex_unlock(&r->inbox_lock);
+
+    if (first) {
+        uint64_t one = 1;
+        ssize_t n = write(r->wake_fd, &one, sizeof(one));
+        (void)n;  // Already signalled if the counter is saturated
+    }
+}
+
+
+// Queue b to be sent after the output so far, without copying it. Takes over the
+// caller's reference. Frames never interleave: c->out is only sent between them.
+void conn_send_shared(Conn* c, SharedBuf* b) {
+    if (c->closed) {
+        shared_release(b);
+        return;
+    }
+
+    if (c->shared_count == c->shared_cap && c->shared_head > 0) {
+        c->shared_count -= c->shared_head;
+        memmove(c->shared, c->shared + c->shared_head, c->shared_count * sizeof(SharedBuf*));
+        c->shared_head = 0;
+    }
+    if (c->shared_count == c->shared_cap) {
+        size_t cap = c->shared_cap ? c->shared_cap * 2 : 16;
+        SharedBuf** grown = realloc(c->shared, cap * sizeof(SharedBuf*));
+        if (!grown) {
+            shared_release(b);
+            conn_close(c);
+            return;
+        }
+        c->shared = grown;
+        c->shared_cap = cap;
+    }
+    c->shared[c->shared_count++] = b;
+    c->shared_bytes += b->len;
+}
+
+
+// Output in sending order: the rest of a partly sent shared frame, c->out, then the
+// other shared frames
+static int gather_output(Conn* c, struct iovec* iov) {
+    int n = 0;
+    size_t i = c->shared_head;
+
+    if (c->shared_offset > 0) {
+        SharedBuf* b = c->shared[i++];
+        iov[n++] = (struct iovec){ (void*)(b->data + c->shared_offset), b->len - c->shared_offset };
+    }
+    if (c->out.len > 0) iov[n++] = (struct iovec){ c->out.data, c->out.len };
+    for (; i < c->shared_count && n < MAX_IOV; i++) {
+        iov[n++] = (struct iovec){ (void*)c->shared[i]->data, c->shared[i]->len };
+    }
+    return n;
+}
+
+
+// Drop n sent bytes from the head shared frame; returns the bytes left over
+static size_t consume_shared(Conn* c, size_t n) {
+    SharedBuf* b = c->shared[c->shared_head];
+    size_t k = b->len - c->shared_offset;
+    if (n < k) k = n;
+
+    c->shared_offset += k;
+    c->shared_bytes -= k;
+    if (c->shared_offset == b->len) {
+        shared_release(b);
+        c->shared_offset = 0;
+        if (++c->shared_head == c->shared_count) c->shared_head = c->shared_count = 0;
+    }
+    return n - k;
+}
+
+
+// Drop n sent bytes, in the order of gather_output
+static void consume_output(Conn* c, size_t n) {
+    if (c->shared_offset > 0) n = consume_shared(c, n);
+
+    size_t k = n < c->out.len ? n : c->out.len;
+    buf_consume(&c->out, k);
+    n -= k;
+    while (n > 0) n = consume_shared(c, n);
+}
+
+
+// Write what the socket accepts, close when done, and update the epoll interest
+void conn_flush(Conn* c) {
+    if (c->closed) return;
+
+    while (c->out.len > 0 || c->shared_bytes > 0) {
+        ssize_t n;
+        if (c->shared_bytes == 0) {
+            n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        } else {
+            struct iovec iov[MAX_IOV];
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = gather_output(c, iov) };
+            n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        }
+        if (n > 0) {
+            consume_output(c, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        conn_close(c);  // Peer is gone
+        return;
+    }
+
+    bool pending = c->out.len > 0 || c->shared_bytes > 0;
+    if (!pending && (c->close_after_flush || c->peer_closed)) {
+        conn_close(c);
+        return;
+    }
+
+    // Nothing more to read once the peer shut down its side
+    uint32_t events = (pending ? EPOLLOUT : 0);
+    if (!c->peer_closed) events |= EPOLLRDHUP | (c->paused ? 0 : EPOLLIN);
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+        epoll_ctl(c->reactor->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+
+static void conn_read(Conn* c) {
+    uint8_t chunk[READ_CHUNK];
+
+    while (1) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            if (buf_append(&c->in, chunk, n) < 0) {
+                conn_close(c);
+                return;
+            }
+            if ((size_t)n < sizeof(chunk)) break;
+            continue;
+        }
+        if (n == 0) {
+            c->peer_closed = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(c);
+            return;
+        }
+        break;
+    }
+
+    if (!c->paused) c->ops->on_data(c);
+}
+
+
+static void accept_all(Reactor* r, Listener* l) {
+    while (1) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        // Small request/response frames: do not wait to coalesce them (fails harmlessly
+        // on Unix-domain sockets)
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        Conn* c = calloc(1, sizeof(Conn));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->kind = KIND_CONN;
+        c->fd = fd;
+        c->reactor = r;
+        c->ops = l->ops;
+        c->refs = 1;
+        c->events = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+            continue;
+        }
+        r->conn_count++;
+        c->ops->on_open(c);
+        conn_flush(c);
+    }
+}
+
+
+// Run work posted by other threads
+static void drain_inbox(Reactor* r) {
+    uint64_t count;
+    ssize_t n = read(r->wake_fd, &count, sizeof(count));
+    (void)n;
+
+    pthread_mutex_lock(&r->inbox_lock);
+    Conn* c = r->inbox;
+    r->inbox = NULL;
+    for (Conn* p = c; p != NULL; p = p->inbox_next) p->in_inbox = false;
+    pthread_mutex_unlock(&r->inbox_lock);
+
+    while (c != NULL) {
+        Conn* next = c->inbox_next;
+        conn_hold(c);
+        c->ops->on_wake(c);
+        conn_flush(c);
+        conn_release(c);
+        c = next;
+    }
+}
+
+
+static void* reactor_thread(void* arg) {
+    reactor_run(arg);
+    return NULL;
+}
+
+
+// Run the event loop on a thread of its own
+int reactor_start(Reactor* r) {
+    return pthread_create(&r->thread, NULL, reactor_thread, r);
+}
+
+
+void reactor_run(Reactor* r) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Only tick while timers are armed
+        int timeout = r->timers.count > 0 ? WHEEL_TICK_MS : -1;
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int* kind = events[i].data.ptr;
+
+            if (kind == NULL) {
+                drain_inbox(r);
+            } else if (*kind == KIND_LISTENER) {
+                accept_all(r, (Listener*)kind);
+            } else {
+                Conn* c = (Conn*)kind;
+                if (c->closed) continue;
+
+                conn_hold(c);  // Keep c alive while callbacks run
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    conn_close(c);
+                } else {
+                    if (events[i].events & EPOLLIN) conn_read(c);
+                    if (events[i].events & EPOLLRDHUP) c->peer_closed = true;
+                    conn_flush(c);
+                }
+                conn_release(c);
+            }
+        }
+
+        // One at a time: a fire() may cancel (and free) other due timers
+        wheel_expire(&r->timers, monotonic_ms());
+        TimerEntry* t;
+        while ((t = wheel_next_due(&r->timers)) != NULL) t->fire(t);
+
+        free_released(r);
+    }
+}
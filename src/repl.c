@@ -0,0 +1,428 @@
+#define _GNU_SOURCE  // accept4
+#include "../inc/repl.h"
+#include "../inc/protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define REPL_RETRY_SECONDS 1    // Pause between attempts to reach the primary
+
+// A connected backup, as the primary sees it
+typedef struct Backup {
+    int fd;
+    int wake_fd;            // eventfd, signalled when the queue stops being empty
+    char peer[64];
+    Buffer queue;           // Records not yet sent
+    bool ready;             // Snapshot loaded: acked counts for synchronous replication
+    bool dropped;           // Fell behind: its connection is shut down
+    uint64_t acked;         // Last LSN the backup applied
+    struct Backup* next;
+} Backup;
+
+// Primary side: backups_lock guards the list and everything in it
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static Backup* backups = NULL;
+static int backup_count = 0;
+static bool sync_mode = false;
+static int listen_fd = -1;
+
+// Backup side: follow_lock is held while records are applied, so that nothing from the
+// old primary lands after repl_promote returns
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char* primary_addr = NULL;
+static wal_apply_fn follow_apply = NULL;
+static repl_reset_fn follow_reset = NULL;
+static int follow_fd = -1;
+static _Atomic bool following = false;
+
+
+static int recv_all(int fd, void* data, size_t len) {
+    uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// Commit point of synchronous replication: the newest LSN a ready backup applied.
+// Caller holds backups_lock.
+static void update_replica_lsn() {
+    if (!sync_mode) return;
+
+    uint64_t newest = UINT64_MAX;
+    for (Backup* b = backups; b != NULL; b = b->next) {
+        if (!b->ready || b->dropped) continue;
+        if (newest == UINT64_MAX || b->acked > newest) newest = b->acked;
+    }
+    wal_set_replica_lsn(newest);
+}
+
+
+// wal_tap_fn: queue the batch for every backup
+static void ship(const uint8_t* records, size_t len) {
+    pthread_mutex_lock(&backups_lock);
+    for (Backup* b = backups; b != NULL; b = b->next) {
+        if (b->dropped) continue;
+
+        bool was_empty = b->queue.len == 0;
+        if (b->queue.len + len > REPL_MAX_BACKLOG || buf_append(&b->queue, records, len) < 0) {
+            // It reconnects and starts over from a fresh snapshot
+            printf("Dropping backup %s that fell behind\n", b->peer);
+            b->dropped = true;
+            buf_free(&b->queue);
+            shutdown(b->fd, SHUT_RDWR);
+            update_replica_lsn();
+            continue;
+        }
+        uint64_t one = 1;
+        if (was_empty && write(b->wake_fd, &one, sizeof(one)) < 0) perror("replication wakeup");
+    }
+    pthread_mutex_unlock(&backups_lock);
+}
+
+
+// Serve one backup: the snapshot, then queued records as they come, reading its
+// acknowledgements in between
+static void serve_backup(Backup* b) {
+    uint32_t hello[2];
+    if (recv_all(b->fd, hello, sizeof(hello)) < 0 || hello[0] != REPL_MAGIC ||
+        hello[1] != REPL_VERSION) {
+        printf("Replication peer %s is not a backup of this version\n", b->peer);
+        return;
+    }
+
+    // Once on the list it gets every batch the log thread takes from now on; records
+    // up to lsn are in the registry already, so the snapshot contains them
+    pthread_mutex_lock(&backups_lock);
+    b->next = backups;
+    backups = b;
+    backup_count++;
+    pthread_mutex_unlock(&backups_lock);
+
+    Buffer out = {0};
+    if (wal_snapshot(&out, wal_last_lsn()) < 0 || proto_send_all(b->fd, out.data, out.len) < 0) {
+        buf_free(&out);
+        return;
+    }
+    printf("Backup %s connected (%zu byte snapshot)\n", b->peer, out.len);
+    buf_consume(&out, out.len);
+
+    uint8_t acks[64];
+    size_t ack_len = 0;
+    while (1) {
+        struct pollfd p[2] = { { b->fd, POLLIN, 0 }, { b->wake_fd, POLLIN, 0 } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (p[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(b->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) break;
+
+            // Take the queue, leaving the emptied buffer of the previous round in its place
+            pthread_mutex_lock(&backups_lock);
+            Buffer taken = b->queue;
+            b->queue = out;
+            out = taken;
+            bool dropped = b->dropped;
+            pthread_mutex_unlock(&backups_lock);
+
+            if (dropped || proto_send_all(b->fd, out.data, out.len) < 0) break;
+            buf_consume(&out, out.len);
+        }
+
+        if (p[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(b->fd, acks + ack_len, sizeof(acks) - ack_len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            ack_len += n;
+
+            // Only the newest acknowledgement matters
+            size_t whole = ack_len - ack_len % sizeof(uint64_t);
+            if (whole == 0) continue;
+            uint64_t lsn;
+            memcpy(&lsn, acks + whole - sizeof(lsn), sizeof(lsn));
+            memmove(acks, acks + whole, ack_len - whole);
+            ack_len -= whole;
+
+            pthread_mutex_lock(&backups_lock);
+            b->acked = lsn;
+            b->ready = true;
+            update_replica_lsn();
+            pthread_mutex_unlock(&backups_lock);
+        }
+    }
+    buf_free(&out);
+}
+
+
+static void* backup_thread(void* arg) {
+    Backup* b = arg;
+    serve_backup(b);
+
+    pthread_mutex_lock(&backups_lock);
+    for (Backup** link = &backups; *link != NULL; link = &(*link)->next) {
+        if (*link == b) {
+            *link = b->next;
+            backup_count--;
+            break;
+        }
+    }
+    update_replica_lsn();
+    pthread_mutex_unlock(&backups_lock);
+
+    printf("Backup %s disconnected\n", b->peer);
+    close(b->fd);
+    close(b->wake_fd);
+    buf_free(&b->queue);
+    free(b);
+    return NULL;
+}
+
+
+static void* accept_thread(void* arg) {
+    (void)arg;
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept4(listen_fd, (struct sockaddr*)&addr, &len, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("replication accept");
+                sleep(REPL_RETRY_SECONDS);
+            }
+            continue;
+        }
+
+        // Acknowledgements are tiny and latency-bound
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        Backup* b = calloc(1, sizeof(Backup));
+        int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        pthread_t tid;
+        if (b == NULL || wake_fd < 0) {
+            perror("replication backup");
+            free(b);
+            if (wake_fd >= 0) close(wake_fd);
+            close(fd);
+            continue;
+        }
+        b->fd = fd;
+        b->wake_fd = wake_fd;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        snprintf(b->peer, sizeof(b->peer), "%s:%d", ip, ntohs(addr.sin_port));
+
+        if (pthread_create(&tid, NULL, backup_thread, b) != 0) {
+            perror("replication thread");
+            close(fd);
+            close(wake_fd);
+            free(b);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+
+int repl_serve(int port, bool sync) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY,
+                                   .sin_port = htons(port) };
+    int opt = 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return -1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        int err = errno;
+        close(listen_fd);
+        listen_fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    sync_mode = sync;
+    wal_set_tap(ship);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, accept_thread, NULL) != 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+
+static int send_ack(int fd, uint64_t lsn) {
+    return proto_send_all(fd, &lsn, sizeof(lsn));
+}
+
+
+// Apply the records at the start of in that are complete. Records up to skip are in
+// the snapshot already. Returns the bytes used, or -1 if the stream is damaged.
+static long apply_records(const Buffer* in, uint64_t skip, uint64_t* last) {
+    char name[MAX_MUTEX_NAME], message[MAX_MSG_SIZE];
+    size_t off = 0;
+
+    while (off < in->len) {
+        WalRecord r;
+        size_t n = wal_decode(in->data + off, in->len - off, &r, name, message);
+        if (n == 0) break;
+        if (r.lsn > skip) follow_apply(&r);
+        *last = r.lsn;
+        off += n;
+    }
+    // A record that does not decode although all of it is there is garbage
+    if (in->len - off >= WAL_MAX_RECORD) return -1;
+    return off;
+}
+
+
+// One connection to the primary: start over from its snapshot, then apply records
+// until the connection ends or this server is promoted
+static void follow_primary(int fd) {
+    uint32_t hello[2] = { REPL_MAGIC, REPL_VERSION };
+    uint8_t header[WAL_SNAPSHOT_HEADER];
+    if (proto_send_all(fd, hello, sizeof(hello)) < 0 || recv_all(fd, header, sizeof(header)) < 0) {
+        return;
+    }
+
+    size_t size = wal_snapshot_size(header);
+    uint8_t* snapshot = size > 0 ? malloc(size) : NULL;
+    if (snapshot == NULL) {
+        fprintf(stderr, "Replication: no usable snapshot from %s\n", primary_addr);
+        return;
+    }
+    memcpy(snapshot, header, sizeof(header));
+    if (recv_all(fd, snapshot + sizeof(header), size - sizeof(header)) < 0) {
+        free(snapshot);
+        return;
+    }
+
+    // Whatever this server had is stale
+    uint64_t start = 0;
+    int loaded = -1;
+    pthread_mutex_lock(&follow_lock);
+    if (atomic_load(&following)) {
+        follow_reset();
+        loaded = wal_load_snapshot(snapshot, size, follow_apply, &start);
+    }
+    pthread_mutex_unlock(&follow_lock);
+    free(snapshot);
+    if (loaded < 0) {
+        if (atomic_load(&following)) fprintf(stderr, "Replication: damaged snapshot\n");
+        return;
+    }
+    printf("Replication: loaded %d records from %s\n", loaded, primary_addr);
+    if (send_ack(fd, start) < 0) return;
+
+    Buffer in = {0};
+    uint8_t chunk[64 * 1024];
+    while (1) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || buf_append(&in, chunk, n) < 0) break;
+
+        uint64_t last = 0;
+        long used = -1;
+        pthread_mutex_lock(&follow_lock);
+        if (atomic_load(&following)) used = apply_records(&in, start, &last);
+        pthread_mutex_unlock(&follow_lock);
+        if (used < 0) {
+            if (atomic_load(&following)) fprintf(stderr, "Replication: damaged record stream\n");
+            break;
+        }
+
+        buf_consume(&in, used);
+        if (last > 0 && send_ack(fd, last) < 0) break;
+    }
+    buf_free(&in);
+}
+
+
+static void* follow_thread(void* arg) {
+    (void)arg;
+
+    while (atomic_load(&following)) {
+        int fd = proto_connect(primary_addr, 0);
+        if (fd >= 0) {
+            pthread_mutex_lock(&follow_lock);
+            follow_fd = fd;
+            pthread_mutex_unlock(&follow_lock);
+
+            // repl_promote may have run before follow_fd was set
+            if (atomic_load(&following)) {
+                printf("Replication: following %s\n", primary_addr);
+                follow_primary(fd);
+            }
+
+            pthread_mutex_lock(&follow_lock);
+            follow_fd = -1;
+            pthread_mutex_unlock(&follow_lock);
+            close(fd);
+            if (atomic_load(&following)) {
+                printf("Replication: lost %s, reconnecting\n", primary_addr);
+            }
+        }
+        if (atomic_load(&following)) sleep(REPL_RETRY_SECONDS);
+    }
+    return NULL;
+}
+
+
+int repl_follow(const char* primary, wal_apply_fn apply, repl_reset_fn reset) {
+    primary_addr = primary;
+    follow_apply = apply;
+    follow_reset = reset;
+    atomic_store(&following, true);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, follow_thread, NULL) != 0) {
+        atomic_store(&following, false);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+
+bool repl_is_backup() {
+    return atomic_load(&following);
+}
+
+
+int repl_backup_count() {
+    pthread_mutex_lock(&backups_lock);
+    int count = backup_count;
+    pthread_mutex_unlock(&backups_lock);
+    return count;
+}
+
+
+int repl_promote() {
+    pthread_mutex_lock(&follow_lock);
+    bool was_backup = atomic_exchange(&following, false);
+    if (follow_fd >= 0) shutdown(follow_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&follow_lock);
+
+    if (!was_backup) return -1;
+    printf("Promoted to primary\n");
+    return 0;
+}
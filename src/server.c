@@ -1,366 +1,1718 @@
+#define _GNU_SOURCE  // memmem
 #include "../inc/common.h"
 #include "../inc/mutex.h"
+#include "../inc/protocol.h"
+#include "../inc/reactor.h"
+#include "../inc/repl.h"
+#include "../inc/wal.h"
 #include <signal.h>
-#include <sys/select.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/un.h>
 
-// Server socket file descriptors
-static int server_fd = -1;
+#define MAX_REACTORS 256
+#define PUSH_MAX_BACKLOG (4 << 20)  // Drop a subscriber that falls this far behind
+
+// Server socket file descriptors (one mutex listener per reactor)
+static int server_fds[MAX_REACTORS];
+static int server_fd_count = 0;
+static int server_port = SERVER_PORT;  // Mutex port; the web interface is on the next one
+static const char* log_dir = NULL;     // Write-ahead log directory, NULL = not durable
+static int repl_port = 0;              // Port for backups, 0 = none
+static bool repl_sync = false;
+static const char* primary = NULL;     // host:port of the primary when this is a backup
 static int web_fd = -1;
+static int unix_fd = -1;
+static const char* unix_path = SERVER_SOCKET_PATH;  // NULL = no Unix-domain listener
+static bool shm_enabled = false;
 
 
 // Close open sockets
 void cleanup() {
-    if (server_fd != -1) close(server_fd);
+    for (int i = 0; i < server_fd_count; i++) close(server_fds[i]);
+    server_fd_count = 0;
     if (web_fd != -1) close(web_fd);
+    mutex_shm_stop();
+    if (unix_fd != -1) {
+        close(unix_fd);
+        unlink(unix_path);
+        unix_fd = -1;
+    }
     printf("Server sockets closed\n");
+
+    // Records of the last changes (e.g. releases of clients that just left) may still be
+    // waiting for the group commit
+    wal_flush();
 }
 
 
-// Signal handler for graceful shutdown
-void handle_signal(int sig) {
-    (void)sig; // Explicitly mark as unused
+// Graceful shutdown on SIGINT or SIGTERM. The signals are blocked in every other thread
+// and taken here with sigwait, so cleanup() may wait for the log like any thread.
+static void* signal_thread(void* arg) {
+    sigset_t* set = arg;
+    int sig;
+    sigwait(set, &sig);
+
     printf("\nServer shutting down...\n");
-    cleanup();
-    exit(EXIT_SUCCESS);
+    exit(EXIT_SUCCESS);  // Runs cleanup()
 }
 
 
-// Thread function to handle a single client
-void* handle_client(void* arg) {
-    int client_socket = *((int*)arg);
-    free(arg);  // Free the allocated memory for client socket
-    
-    int client_pid = -1;
+struct Session;
+
+// Lock acquired over a connection: released when its lease runs out or the connection drops
+typedef struct HeldLock {
+    char name[MAX_MUTEX_NAME];
+    struct Session* session;
+    TimerEntry lease_timer;     // Armed while the lock has a lease TTL
+    struct HeldLock* next;
+} HeldLock;
+
+// Blocking LOCK_ALL in progress: the mutexes are taken one at a time in name order
+typedef struct {
+    int count;
+    int next;                   // Entries before this one are held
+    char names[MUTEX_MAX_LOCK_ALL][MAX_MUTEX_NAME];
+    bool shared[MUTEX_MAX_LOCK_ALL];
+    int16_t index[MUTEX_MAX_LOCK_ALL];  // Position of each entry in the request
+} MultiLock;
+
+// SUBSCRIBE of a connection to the messages of a mutex
+typedef struct Subscription {
+    char name[MAX_MUTEX_NAME];
+    MutexSubscriber sub;        // sub.ctx is the Session
+    struct Subscription* next;
+} Subscription;
+
+// Per-connection state of a mutex client
+typedef struct Session {
+    Conn* conn;
+    int client_pid;             // -1 until the HELLO frame arrives
+    int peer_pid;               // PID from SO_PEERCRED on Unix-domain connections, else 0
+    uid_t peer_uid;             // Its user, valid if peer_pid != 0
+    bool attached;              // Process uses the shared-memory table through this connection
+    uint64_t token;             // Owner token of locks acquired over this connection
+    HeldLock* held;
+    MutexWaiter waiter;         // LOCK parked in a mutex's wait queue
+    TimerEntry wait_timer;      // Timeout of the parked LOCK / LOCK_ALL
+    uint32_t wait_ttl;          // Lease TTL to apply once the parked LOCK is granted
+    MultiLock* multi;           // Set while a blocking LOCK_ALL runs
+    bool parked;                // Input is paused until the parked request is answered
+    bool waiting;               // waiter is queued on a mutex
+    _Atomic bool woken;         // Set by the waiter's wake callback, possibly on another thread
+    Buffer unsynced;            // Responses held back until the log is on disk up to unsynced_lsn
+    uint64_t unsynced_lsn;
+    WalWaiter commit;           // Registered with the log while `syncing`
+    bool syncing;
+    _Atomic bool committed;     // Set by the commit callback on the log thread
+    Subscription* subs;
+    bool subscribed;            // Holds the connection for deliveries until the mailbox closes
+    pthread_mutex_t mail_lock;  // Guards the mailbox below; taken inside stripe locks
+    MutexMessage** mail;        // Messages delivered and not pushed yet, in arrival order
+    int mail_count;
+    int mail_cap;
+    bool mail_posted;           // conn_post issued and mutex_on_wake not run yet
+    bool mail_closed;           // Connection gone: mutex_on_wake drops the hold
+    bool mail_failed;           // A delivery did not fit into memory
+} Session;
+
+static _Atomic uint64_t next_session_token = 1;
+
+// Counters for GET /metrics, updated with relaxed atomic adds from every reactor
+static _Atomic uint64_t responses[CMD_INVALID + 1][STATUS_READ_ONLY + 1];  // By op and status
+static _Atomic int client_connections = 0;
+static int reactor_total = 0;
+
+
+static void count_response(uint8_t op, Status status) {
+    if (op > CMD_INVALID) op = CMD_INVALID;
+    if (status > STATUS_READ_ONLY) return;
+    atomic_fetch_add_explicit(&responses[op][status], 1, memory_order_relaxed);
+}
+
+
+// Queue a response frame and count it
+static void put_response(Buffer* out, uint8_t op, Status status, const void* payload,
+                         uint32_t payload_len) {
+    count_response(op, status);
+    proto_put_response(out, op, status, payload, payload_len);
+}
+
+
+// WalWaiter callback (log thread): the responses held back may go out now
+static void commit_done(WalWaiter* w) {
+    Session* s = w->ctx;
+    atomic_store(&s->committed, true);
+    conn_post(s->conn);
+}
+
+
+// With a write-ahead log, a response leaves only once every change logged before it is
+// on disk, so no client acts on a change that a crash would undo. Call after queueing
+// responses: the output is held back until the group commit that covers it.
+static void hold_for_commit(Conn* c, Session* s) {
+    if (!wal_enabled() || c->closed) return;
+    if (c->out.len == 0 && s->unsynced.len == 0) return;
+
+    uint64_t lsn = wal_last_lsn();
+    if (s->unsynced.len == 0 && wal_durable(lsn)) return;
+
+    if (c->out.len > 0) {
+        if (buf_append(&s->unsynced, c->out.data, c->out.len) < 0) {
+            conn_close(c);
+            return;
+        }
+        buf_consume(&c->out, c->out.len);
+        s->unsynced_lsn = lsn;
+    }
+    if (!s->syncing) {
+        s->syncing = true;
+        conn_hold(c);
+        wal_wait(&s->commit, s->unsynced_lsn);
+    }
+}
 
-    // Receive client PID
-    if (recv(client_socket, &client_pid, sizeof(client_pid), 0) != sizeof(client_pid)) {
-        perror("Failed to receive client PID");
-        close(client_socket);
-        return NULL;
+
+// The log is on disk up to where the held responses need it: release them
+static void commit_reached(Conn* c, Session* s) {
+    s->syncing = false;
+    if (!c->closed && wal_durable(s->unsynced_lsn)) {
+        if (buf_append(&c->out, s->unsynced.data, s->unsynced.len) < 0) conn_close(c);
+        buf_consume(&s->unsynced, s->unsynced.len);
     }
-    
-    printf("Client connected (PID: %d)\n", client_pid);
-    
-    ClientCommand cmd;
-    char response[BUFFER_SIZE];
-    
-    // Initialize response buffer
-    while (1) {
-        // Receive command from client
-        ssize_t bytes_received = recv(client_socket, &cmd, sizeof(cmd), 0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                printf("Client (PID: %d) disconnected\n", client_pid);
-            } else {
-                perror("recv failed");
+    conn_release(c);  // Drop the hold taken by hold_for_commit
+}
+
+
+// Map mutex.c return codes of each command to wire status codes
+static Status create_status(int rc) {
+    switch (rc) {
+        case 0: return STATUS_OK;
+        case -2: case -5: return STATUS_NO_MEMORY;
+        case -3: return STATUS_EXISTS;
+        default: return STATUS_INVALID;
+    }
+}
+
+
+static Status lock_status(int rc) {
+    switch (rc) {
+        case 0: return STATUS_OK;
+        case -1: return STATUS_LOCKED_OTHER;
+        case -2: return STATUS_LOCKED_SELF;
+        case -3: return STATUS_INVALID;
+        case -5: return STATUS_NO_MEMORY;
+        case -6: return STATUS_DEADLOCK;
+        default: return STATUS_NOT_FOUND;
+    }
+}
+
+
+static Status unlock_status(int rc) {
+    switch (rc) {
+        case 0: return STATUS_OK;
+        case -1: return STATUS_NOT_LOCKED;
+        case -2: return STATUS_NOT_OWNER;
+        default: return STATUS_NOT_FOUND;
+    }
+}
+
+
+static Status delete_status(int rc) {
+    switch (rc) {
+        case 0: return STATUS_OK;
+        case -1: return STATUS_LOCKED_OTHER;
+        default: return STATUS_NOT_FOUND;
+    }
+}
+
+
+static HeldLock** find_held(Session* s, const char* name) {
+    HeldLock** link = &s->held;
+    while (*link != NULL && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    return link;
+}
+
+
+static void forget_held(Session* s, HeldLock** link) {
+    HeldLock* h = *link;
+    *link = h->next;
+    reactor_cancel_timer(s->conn->reactor, &h->lease_timer);
+    free(h);
+}
+
+
+// Timer callback: the lease ran out without a RENEW
+static void lease_expired(TimerEntry* t) {
+    HeldLock* h = (HeldLock*)((char*)t - offsetof(HeldLock, lease_timer));
+    Session* s = h->session;
+
+    if (mutex_release_token(h->name, s->token) == 0) {
+        printf("Lease on mutex '%s' held by PID %d expired\n", h->name, s->client_pid);
+    }
+    forget_held(s, find_held(s, h->name));
+}
+
+
+// (Re)arm the lease of a held lock; ttl_ms == 0 means no lease
+static void set_lease(Session* s, HeldLock* h, uint32_t ttl_ms) {
+    if (ttl_ms == 0) {
+        reactor_cancel_timer(s->conn->reactor, &h->lease_timer);
+        return;
+    }
+    h->lease_timer.fire = lease_expired;
+    reactor_add_timer(s->conn->reactor, &h->lease_timer, monotonic_ms() + ttl_ms);
+}
+
+
+// Remember a lock acquired over this connection. Without memory for the record the
+// lock is given back, so a dropped connection cannot leave it held.
+static Status note_acquired(Session* s, const char* name, uint32_t ttl_ms) {
+    HeldLock* h = *find_held(s, name);
+    if (h == NULL) {
+        h = calloc(1, sizeof(HeldLock));
+        if (!h) {
+            mutex_release_token(name, s->token);
+            return STATUS_NO_MEMORY;
+        }
+        strncpy(h->name, name, MAX_MUTEX_NAME - 1);
+        h->session = s;
+        h->next = s->held;
+        s->held = h;
+    }
+    set_lease(s, h, ttl_ms);
+    return STATUS_OK;
+}
+
+
+// Lock a mutex without waiting and track it for lease expiry and disconnect
+static Status try_lock(Session* s, const char* name, uint32_t ttl_ms, bool shared) {
+    int rc = shared ? mutex_lock_shared(name, s->client_pid, s->token)
+                    : mutex_lock(name, s->client_pid, s->token);
+    Status status = lock_status(rc);
+    return status == STATUS_OK ? note_acquired(s, name, ttl_ms) : status;
+}
+
+
+// try_lock by handle
+static Status try_lock_handle(Session* s, MutexHandle handle, uint32_t ttl_ms, bool shared) {
+    char name[MAX_MUTEX_NAME];
+    Status status = lock_status(mutex_lock_handle(handle, s->client_pid, s->token, shared, name));
+    return status == STATUS_OK ? note_acquired(s, name, ttl_ms) : status;
+}
+
+
+// Unlock and delete end the tracking of a held lock
+static void drop_held(Session* s, const char* name) {
+    HeldLock** link = find_held(s, name);
+    if (*link != NULL) forget_held(s, link);
+}
+
+
+// RENEW: restart the lease of a lock this connection holds
+static Status renew_lease(Session* s, const char* name, int32_t ttl_ms) {
+    HeldLock** link = find_held(s, name);
+    if (ttl_ms <= 0) return STATUS_INVALID;
+    if (*link == NULL) return STATUS_NOT_OWNER;
+
+    // Unlocked through another connection of the same client meanwhile
+    if (!mutex_held_by(name, s->token)) {
+        forget_held(s, link);
+        return STATUS_NOT_OWNER;
+    }
+    set_lease(s, *link, ttl_ms);
+    return STATUS_OK;
+}
+
+
+// Connection closed: give back every lock acquired over it
+static void release_all_held(Session* s) {
+    while (s->held != NULL) {
+        HeldLock* h = s->held;
+        if (mutex_release_token(h->name, s->token) == 0) {
+            printf("Released mutex '%s' held by disconnected PID %d\n", h->name, s->client_pid);
+        }
+        forget_held(s, &s->held);
+    }
+}
+
+
+// MutexWaiter wake callback (any thread): let the connection's reactor answer the LOCK
+static void wake_session(MutexWaiter* w) {
+    Session* s = w->ctx;
+    atomic_store(&s->woken, true);
+    conn_post(s->conn);
+}
+
+
+// MutexSubscriber callback (any thread, stripe lock held): queue the message in the
+// mailbox; the connection's reactor pushes it
+static void deliver_message(MutexSubscriber* sub, MutexMessage* msg) {
+    Session* s = sub->ctx;
+
+    pthread_mutex_lock(&s->mail_lock);
+    if (s->mail_count == s->mail_cap) {
+        int cap = s->mail_cap ? s->mail_cap * 2 : 16;
+        MutexMessage** grown = realloc(s->mail, cap * sizeof(MutexMessage*));
+        if (grown) {
+            s->mail = grown;
+            s->mail_cap = cap;
+        }
+    }
+    if (s->mail_count < s->mail_cap) {
+        shared_retain(&msg->frame);
+        s->mail[s->mail_count++] = msg;
+    } else {
+        s->mail_failed = true;
+    }
+    if (!s->mail_posted) {
+        s->mail_posted = true;
+        conn_post(s->conn);  // Under mail_lock, so the connection cannot go away meanwhile
+    }
+    pthread_mutex_unlock(&s->mail_lock);
+}
+
+
+static Subscription** find_subscription(Session* s, const char* name) {
+    Subscription** link = &s->subs;
+    while (*link != NULL && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    return link;
+}
+
+
+// SUBSCRIBE: push the messages of name to this connection. Subscribing again restarts
+// the subscription, e.g. for a mutex that was deleted and created anew.
+static Status subscribe(Session* s, const char* name, uint64_t after, uint64_t* newest) {
+    Subscription** link = find_subscription(s, name);
+    Subscription* sub = *link;
+
+    if (sub != NULL) {
+        mutex_unsubscribe(name, &sub->sub);
+        *link = sub->next;
+    } else if ((sub = calloc(1, sizeof(Subscription))) == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+    strcpy(sub->name, name);
+    sub->sub.deliver = deliver_message;
+    sub->sub.ctx = s;
+
+    if (!s->subscribed) {
+        s->subscribed = true;
+        conn_hold(s->conn);  // deliver_message may post to the connection from now on
+    }
+    int rc = mutex_subscribe(name, &sub->sub, after, newest);
+    if (rc < 0) {
+        free(sub);
+        return rc == -1 ? STATUS_NOT_FOUND : STATUS_NO_MEMORY;
+    }
+    sub->next = s->subs;
+    s->subs = sub;
+    return STATUS_OK;
+}
+
+
+static Status unsubscribe(Session* s, const char* name) {
+    Subscription** link = find_subscription(s, name);
+    Subscription* sub = *link;
+    if (sub == NULL) return STATUS_NOT_FOUND;
+
+    mutex_unsubscribe(name, &sub->sub);  // Fails harmlessly once the mutex is deleted
+    *link = sub->next;
+    free(sub);
+    return STATUS_OK;
+}
+
+
+// Move delivered messages to the output, once the log has committed them (like the
+// responses, see hold_for_commit). Only mutex_on_wake (woken) consumes the post.
+static void send_pushes(Conn* c, Session* s, bool woken) {
+    pthread_mutex_lock(&s->mail_lock);
+    bool posted = s->mail_posted;
+    if (woken) s->mail_posted = false;
+    if (s->mail_closed) {
+        pthread_mutex_unlock(&s->mail_lock);
+        if (woken && posted) conn_release(c);  // mutex_on_close left the hold to us
+        return;
+    }
+
+    int sent = 0;
+    while (sent < s->mail_count && wal_durable(s->mail[sent]->lsn)) {
+        conn_send_shared(c, &s->mail[sent++]->frame);
+    }
+    uint64_t wait_lsn = 0;
+    for (int i = sent; i < s->mail_count; i++) {
+        if (s->mail[i]->lsn > wait_lsn) wait_lsn = s->mail[i]->lsn;
+    }
+    s->mail_count -= sent;
+    memmove(s->mail, s->mail + sent, s->mail_count * sizeof(MutexMessage*));
+    bool failed = s->mail_failed;
+    pthread_mutex_unlock(&s->mail_lock);
+
+    if (failed || c->shared_bytes > PUSH_MAX_BACKLOG) {
+        printf("Dropping subscriber PID %d: %s\n", s->client_pid,
+               failed ? "out of memory" : "it fell behind");
+        conn_close(c);
+        return;
+    }
+    if (wait_lsn > 0 && !s->syncing) {
+        s->syncing = true;
+        conn_hold(c);
+        wal_wait(&s->commit, wait_lsn);
+    }
+}
+
+
+// Connection closed: end its subscriptions and empty the mailbox
+static void drop_subscriptions(Conn* c, Session* s) {
+    while (s->subs != NULL) unsubscribe(s, s->subs->name);
+    if (!s->subscribed) return;
+
+    // No delivery runs any more: only a pending post can still refer to the connection
+    pthread_mutex_lock(&s->mail_lock);
+    s->mail_closed = true;
+    bool posted = s->mail_posted;
+    for (int i = 0; i < s->mail_count; i++) shared_release(&s->mail[i]->frame);
+    free(s->mail);
+    s->mail = NULL;
+    s->mail_count = s->mail_cap = 0;
+    pthread_mutex_unlock(&s->mail_lock);
+
+    if (!posted) conn_release(c);  // Else send_pushes drops the hold
+}
+
+
+static void wait_timeout(TimerEntry* t);
+
+
+// Stop handling requests until the parked request is answered
+static void park_session(Conn* c, Session* s, int timeout_ms) {
+    if (s->parked) return;
+
+    s->parked = true;
+    conn_hold(c);
+    conn_pause(c);
+    if (timeout_ms > 0) {
+        s->wait_timer.fire = wait_timeout;
+        reactor_add_timer(c->reactor, &s->wait_timer, monotonic_ms() + timeout_ms);
+    }
+}
+
+
+// Answer the request (parked or not) and resume reading requests
+static void finish_request(Session* s, uint8_t op, Status status, const void* payload,
+                           uint32_t payload_len) {
+    Conn* c = s->conn;
+
+    free(s->multi);
+    s->multi = NULL;
+
+    if (!s->parked) {
+        put_response(&c->out, op, status, payload, payload_len);
+        return;
+    }
+
+    s->parked = false;
+    reactor_cancel_timer(c->reactor, &s->wait_timer);
+    if (!c->closed) {
+        put_response(&c->out, op, status, payload, payload_len);
+        conn_resume(c);
+    }
+    conn_release(c);  // Drop the hold taken when parking
+}
+
+
+// LOCK_ALL failed at the current entry: give back the entries already taken
+static void multi_fail(Session* s, Status status) {
+    MultiLock* ml = s->multi;
+    Buffer payload = {0};
+
+    for (int i = 0; i < ml->next; i++) {
+        mutex_release_token(ml->names[i], s->token);
+        drop_held(s, ml->names[i]);
+    }
+    proto_put_batch_status(&payload, ml->index[ml->next]);
+    finish_request(s, CMD_LOCK_ALL, status, payload.data, payload.len);
+    buf_free(&payload);
+}
+
+
+// Take the remaining LOCK_ALL entries, parking whenever one is held by another client
+static void multi_advance(Session* s, int timeout_ms) {
+    MultiLock* ml = s->multi;
+
+    while (ml->next < ml->count) {
+        s->waiter.shared = ml->shared[ml->next];
+        atomic_store(&s->woken, false);
+
+        int rc = mutex_lock_wait(ml->names[ml->next], s->client_pid, &s->waiter);
+        if (rc == 1) {
+            s->waiting = true;
+            park_session(s->conn, s, timeout_ms);
+            return;
+        }
+
+        Status status = lock_status(rc);
+        if (status == STATUS_OK) status = note_acquired(s, ml->names[ml->next], 0);
+        if (status != STATUS_OK) {
+            multi_fail(s, status);
+            return;
+        }
+        ml->next++;
+    }
+    finish_request(s, CMD_LOCK_ALL, STATUS_OK, NULL, 0);
+}
+
+
+// The parked waiter was answered (granted, deleted, deadlock, ...)
+static void wait_done(Session* s, Status status) {
+    Conn* c = s->conn;
+    s->waiting = false;
+
+    if (c->closed) {
+        // Client went away while waiting: give the lock back
+        if (status == STATUS_OK) mutex_release_token(s->waiter.name, s->token);
+        finish_request(s, CMD_LOCK, status, NULL, 0);
+        return;
+    }
+
+    if (status == STATUS_OK) {
+        status = note_acquired(s, s->waiter.name, s->multi ? 0 : s->wait_ttl);
+    }
+    if (s->multi == NULL) {
+        finish_request(s, s->waiter.shared ? CMD_LOCK_SHARED : CMD_LOCK, status, NULL, 0);
+    } else if (status != STATUS_OK) {
+        multi_fail(s, status);
+    } else {
+        s->multi->next++;
+        multi_advance(s, 0);
+    }
+}
+
+
+// Timer callback: the timeout passed before the mutex was handed over
+static void wait_timeout(TimerEntry* t) {
+    Session* s = (Session*)((char*)t - offsetof(Session, wait_timer));
+    Conn* c = s->conn;
+
+    // If the cancel fails a wakeup is already on its way and answers instead
+    if (s->waiting && mutex_cancel_wait(&s->waiter)) {
+        s->waiting = false;
+        if (s->multi) multi_fail(s, STATUS_TIMEOUT);
+        else finish_request(s, s->waiter.shared ? CMD_LOCK_SHARED : CMD_LOCK, STATUS_TIMEOUT, NULL, 0);
+        hold_for_commit(c, s);
+        conn_flush(c);
+    }
+}
+
+
+// Blocking LOCK: park in the mutex's FIFO queue, forever (timeout_ms < 0) or up to timeout_ms.
+// The mutex is req's name, or its handle.
+static void start_wait(Conn* c, Session* s, const ProtoRequest* req, int timeout_ms,
+                       uint32_t ttl_ms, bool shared) {
+    s->waiter.shared = shared;
+    s->wait_ttl = ttl_ms;
+    atomic_store(&s->woken, false);
+
+    int rc = req->handle ? mutex_lock_wait_handle(req->handle, s->client_pid, &s->waiter)
+                         : mutex_lock_wait(req->name, s->client_pid, &s->waiter);
+    if (rc != 1) {
+        Status status = lock_status(rc);
+        if (status == STATUS_OK) status = note_acquired(s, s->waiter.name, ttl_ms);
+        put_response(&c->out, shared ? CMD_LOCK_SHARED : CMD_LOCK, status, NULL, 0);
+        return;
+    }
+
+    // Parked: answer once woken, and handle no further requests until then
+    s->waiting = true;
+    park_session(c, s, timeout_ms);
+}
+
+
+static int compare_multi_entries(const void* a, const void* b, void* ctx) {
+    const MultiLock* ml = ctx;
+    return strcmp(ml->names[*(const int16_t*)a], ml->names[*(const int16_t*)b]);
+}
+
+
+// LOCK_ALL: all of the mutexes at once, or (if one is busy and arg allows waiting)
+// one by one in name order, so that concurrent LOCK_ALLs cannot deadlock each other
+static void execute_lock_all(Conn* c, const ProtoRequest* req) {
+    Session* s = c->session;
+    const uint8_t* p = req->payload;
+    const uint8_t* end = req->payload + req->payload_len;
+    const char* names[MUTEX_MAX_LOCK_ALL];
+    MultiLock* ml = calloc(1, sizeof(MultiLock));
+    Buffer payload = {0};
+    uint8_t op;
+    int rc, failed = 0;
+
+    if (!ml) {
+        put_response(&c->out, req->op, STATUS_NO_MEMORY, NULL, 0);
+        return;
+    }
+
+    while (ml->count < MUTEX_MAX_LOCK_ALL &&
+           (rc = proto_get_batch_op(&p, end, &op, ml->names[ml->count])) == 1) {
+        if (op != CMD_LOCK && op != CMD_LOCK_SHARED) break;
+        ml->shared[ml->count] = (op == CMD_LOCK_SHARED);
+        names[ml->count] = ml->names[ml->count];
+        ml->count++;
+    }
+    if (p != end || ml->count == 0) {
+        free(ml);
+        put_response(&c->out, req->op, STATUS_INVALID, NULL, 0);
+        return;
+    }
+
+    rc = mutex_lock_all(names, ml->shared, ml->count, s->client_pid, s->token, &failed);
+    if (rc == 0) {
+        Status status = STATUS_OK;
+        int i;
+        for (i = 0; i < ml->count && status == STATUS_OK; i++) status = note_acquired(s, names[i], 0);
+        if (status != STATUS_OK) {
+            // note_acquired gave back names[i - 1]; give back the others too
+            for (int j = 0; j < ml->count; j++) {
+                if (j == i - 1) continue;
+                mutex_release_token(names[j], s->token);
+                drop_held(s, names[j]);
             }
+        }
+        free(ml);
+        put_response(&c->out, req->op, status, NULL, 0);
+        return;
+    }
+
+    if (rc != -1 || req->arg == 0) {
+        free(ml);
+        proto_put_batch_status(&payload, (int16_t)failed);
+        put_response(&c->out, req->op, lock_status(rc), payload.data, payload.len);
+        buf_free(&payload);
+        return;
+    }
+
+    // Busy: take the mutexes one at a time in name order
+    int16_t order[MUTEX_MAX_LOCK_ALL];
+    for (int i = 0; i < ml->count; i++) order[i] = i;
+    qsort_r(order, ml->count, sizeof(int16_t), compare_multi_entries, ml);
+
+    MultiLock* sorted = calloc(1, sizeof(MultiLock));
+    if (!sorted) {
+        free(ml);
+        put_response(&c->out, req->op, STATUS_NO_MEMORY, NULL, 0);
+        return;
+    }
+    for (int i = 0; i < ml->count; i++) {
+        memcpy(sorted->names[i], ml->names[order[i]], MAX_MUTEX_NAME);
+        sorted->shared[i] = ml->shared[order[i]];
+        sorted->index[i] = order[i];
+    }
+    sorted->count = ml->count;
+    free(ml);
+
+    s->multi = sorted;
+    multi_advance(s, req->arg);
+}
+
+
+// Apply each operation of a BATCH request in order and answer with their statuses
+static void execute_batch(Conn* c, const ProtoRequest* req) {
+    Session* s = c->session;
+    const uint8_t* p = req->payload;
+    const uint8_t* end = req->payload + req->payload_len;
+    Buffer statuses = {0};
+    char name[MAX_MUTEX_NAME];
+    uint8_t op;
+    int rc;
+
+    while ((rc = proto_get_batch_op(&p, end, &op, name)) == 1) {
+        Status status;
+        switch (op) {
+            case CMD_CREATE: status = create_status(mutex_create(name, s->client_pid)); break;
+            case CMD_LOCK: status = try_lock(s, name, 0, false); break;
+            case CMD_LOCK_SHARED: status = try_lock(s, name, 0, true); break;
+            case CMD_UNLOCK: status = unlock_status(mutex_unlock(name, s->client_pid)); break;
+            case CMD_DELETE: status = delete_status(mutex_delete(name, s->client_pid)); break;
+            default: status = STATUS_INVALID; break;
+        }
+        if (status == STATUS_OK && (op == CMD_UNLOCK || op == CMD_DELETE)) drop_held(s, name);
+        count_response(op, status);
+        if (proto_put_batch_status(&statuses, status) < 0) {
+            rc = -2;
             break;
         }
-        
-        response[0] = '\0';
-        int status = 0;
-        
-        // Handle command type
-        switch (cmd.type) {
+    }
 
-            case CMD_HELP:
-                snprintf(response, sizeof(response), 
-                        "Available commands: create, lock, unlock, list, delete, send");
-                break;
-                
-            case CMD_CREATE:
-                status = mutex_create(cmd.mutex_name, client_pid);
-                if (status == 0) {
-                    snprintf(response, sizeof(response), "Mutex '%s' created", cmd.mutex_name);
-                } else if (status == -2) {
-                    strcpy(response, "Cannot create mutex: maximum limit reached");
-                } else {
-                    snprintf(response, sizeof(response), "Mutex '%s' already exists", cmd.mutex_name);
-                }
-                break;
-                
-            case CMD_LOCK:
-                status = mutex_lock(cmd.mutex_name, client_pid);
-                if (status == 0) {
-                    snprintf(response, sizeof(response), "Mutex '%s' locked", cmd.mutex_name);
-                } else if (status == -1) {
-                    snprintf(response, sizeof(response), 
-                            "Mutex '%s' already locked by another client", cmd.mutex_name);
-                } else if (status == -2) {
-                    snprintf(response, sizeof(response), 
-                            "Mutex '%s' already locked by this client", cmd.mutex_name);
-                } else if (status == -3) {
-                    snprintf(response, sizeof(response), "There is already a mutex in the system");
-                } else {
-                    snprintf(response, sizeof(response), "Mutex '%s' not found", cmd.mutex_name);
-                }
+    if (rc == 0) {
+        put_response(&c->out, req->op, STATUS_OK, statuses.data, statuses.len);
+    } else {
+        // Operations before the malformed entry (or the allocation failure) were applied
+        put_response(&c->out, req->op, rc == -1 ? STATUS_INVALID : STATUS_NO_MEMORY,
+                           statuses.data, statuses.len);
+    }
+    buf_free(&statuses);
+}
+
+
+// Run one request and append its response frame to c->out (unless the LOCK is parked)
+static void execute_request(Conn* c, const ProtoRequest* req) {
+    Session* s = c->session;
+    Buffer* out = &c->out;
+    int client_pid = s->client_pid;
+    bool takes_handle = (req->op == CMD_LOCK || req->op == CMD_LOCK_SHARED ||
+                         req->op == CMD_UNLOCK || req->op == CMD_DELETE || req->op == CMD_SEND);
+    bool needs_name = (req->op == CMD_CREATE || req->op == CMD_LOCK || req->op == CMD_UNLOCK ||
+                       req->op == CMD_DELETE || req->op == CMD_SEND || req->op == CMD_RENEW ||
+                       req->op == CMD_LOCK_SHARED || req->op == CMD_SUBSCRIBE ||
+                       req->op == CMD_UNSUBSCRIBE || req->op == CMD_OPEN);
+    char found[MAX_MUTEX_NAME];     // Name of the mutex a handle refers to
+
+    if (client_pid == -1 && req->op != CMD_HELLO) {
+        printf("Failed to receive client hello\n");
+        c->close_after_flush = true;
+        return;
+    }
+    if (req->version != PROTO_VERSION) {
+        put_response(out, req->op, STATUS_BAD_VERSION, NULL, 0);
+        c->close_after_flush = true;
+        return;
+    }
+    if (req->handle ? !takes_handle
+                    : needs_name && (req->name_len == 0 || req->name_len >= MAX_MUTEX_NAME)) {
+        put_response(out, req->op, STATUS_INVALID, NULL, 0);
+        return;
+    }
+    // A backup only mirrors its primary until it is promoted
+    if (repl_is_backup() && req->op != CMD_HELLO && req->op != CMD_HELP &&
+        req->op != CMD_LIST && req->op != CMD_EXIT && req->op != CMD_SUBSCRIBE &&
+        req->op != CMD_UNSUBSCRIBE && req->op != CMD_OPEN) {
+        put_response(out, req->op, STATUS_READ_ONLY, NULL, 0);
+        return;
+    }
+
+    Status status = STATUS_OK;
+    
+    // Handle command type
+    switch (req->op) {
+
+        case CMD_HELP:
+            break;
+            
+        case CMD_HELLO:
+            // -1 means "no HELLO yet" and 0 a free lock word: neither names a client
+            if (!s->peer_pid && req->arg <= 0) {
+                status = STATUS_INVALID;
                 break;
-                
-            case CMD_UNLOCK:
-                status = mutex_unlock(cmd.mutex_name, client_pid);
-                if (status == 0) {
-                    snprintf(response, sizeof(response), "Mutex '%s' unlocked", cmd.mutex_name);
-                } else if (status == -1) {
-                    snprintf(response, sizeof(response), "Mutex '%s' already unlocked", cmd.mutex_name);
-                } else if (status == -2) {
-                    snprintf(response, sizeof(response), 
-                            "Cannot unlock: you don't own mutex '%s'", cmd.mutex_name);
-                } else {
-                    snprintf(response, sizeof(response), "Mutex '%s' not found", cmd.mutex_name);
-                }
+            }
+            // The kernel's word beats the client's on local sockets
+            s->client_pid = s->peer_pid ? s->peer_pid : req->arg;
+            if (s->peer_pid && req->arg != s->peer_pid) {
+                printf("Client claimed PID %d, using peer PID %d\n", req->arg, s->peer_pid);
+            }
+            printf("Client connected (PID: %d)\n", s->client_pid);
+            break;
+            
+        case CMD_CREATE:
+        case CMD_OPEN: {
+            // Both answer with the mutex's handle
+            MutexHandle handle;
+            uint8_t payload[8];
+            if (req->op == CMD_CREATE) {
+                status = create_status(req->arg == 1 ? mutex_create_fast(req->name, client_pid)
+                                                     : mutex_create(req->name, client_pid));
+            }
+            if (status != STATUS_OK) break;
+            if (mutex_open(req->name, &handle) < 0) {
+                status = req->op == CMD_OPEN ? STATUS_NOT_FOUND : STATUS_OK;  // Deleted meanwhile
                 break;
-                
-            case CMD_LIST:
-                mutex_list(response, sizeof(response));
+            }
+            proto_put_u64(payload, handle);
+            put_response(out, req->op, STATUS_OK, payload, sizeof(payload));
+            return;
+        }
+            
+        case CMD_LOCK:
+        case CMD_LOCK_SHARED: {
+            uint32_t ttl_ms = req->payload_len >= 4 ? proto_get_u32(req->payload) : 0;
+            bool shared = (req->op == CMD_LOCK_SHARED);
+            if (req->arg != 0) {
+                start_wait(c, s, req, req->arg, ttl_ms, shared);
+                return;
+            }
+            status = req->handle ? try_lock_handle(s, req->handle, ttl_ms, shared)
+                                 : try_lock(s, req->name, ttl_ms, shared);
+            break;
+        }
+            
+        case CMD_UNLOCK:
+            if (req->handle) {
+                status = unlock_status(mutex_unlock_handle(req->handle, client_pid, found));
+                if (status == STATUS_OK) drop_held(s, found);
                 break;
-                
-            case CMD_DELETE:
-                status = mutex_delete(cmd.mutex_name, client_pid);
-                if (status == 0) {
-                    snprintf(response, sizeof(response), "Mutex '%s' deleted", cmd.mutex_name);
-                } else if (status == -1) {
-                    snprintf(response, sizeof(response), 
-                            "Cannot delete: mutex '%s' is locked by another client", cmd.mutex_name);
-                } else {
-                    snprintf(response, sizeof(response), "Mutex '%s' not found", cmd.mutex_name);
-                }
+            }
+            status = unlock_status(mutex_unlock(req->name, client_pid));
+            if (status == STATUS_OK) drop_held(s, req->name);
+            break;
+            
+        case CMD_RENEW:
+            status = renew_lease(s, req->name, req->arg);
+            break;
+            
+        case CMD_LIST: {
+            // Grow until the whole list fits (mutexes may be created meanwhile), up to the
+            // largest frame clients accept; past that the list ends with a line saying
+            // how many mutexes it leaves out
+            size_t list_size = 64 * 1024;
+            size_t max_size = PROTO_MAX_FRAME - 64;
+            char* list = NULL;
+            while (1) {
+                char* grown = realloc(list, list_size);
+                if (!grown) break;
+                list = grown;
+
+                size_t needed = mutex_list(list, list_size);
+                if (needed <= list_size || list_size == max_size) break;
+                list_size = needed + needed / 4;
+                if (list_size > max_size) list_size = max_size;
+            }
+            if (!list) {
+                status = STATUS_NO_MEMORY;
                 break;
-                
-            case CMD_SEND: {
-                char detailed_response[BUFFER_SIZE];
-                char welcome_message[BUFFER_SIZE];
-                
-                status = mutex_send(cmd.mutex_name, cmd.client_pid, cmd.message, 
-                                detailed_response, sizeof(detailed_response),
-                                welcome_message, sizeof(welcome_message));
-                
-                // Display on server console (safe truncated output)
-                printf("%.200s\n", detailed_response);
-                printf("Sending message to PID %d\n", cmd.client_pid);
-                
-                if (status == 0) {
-                    // Calculate space needed for each part
-                    size_t available = sizeof(response);
-                    size_t used = 0;
-                    
-                    // Format SUCCESS header
-                    used = snprintf(response, available, "SUCCESS:\n");
-                    
-                    // Add detailed response if space available
-                    if (used < available) {
-                        int needed = snprintf(NULL, 0, "%.*s\n", 
-                                            (int)(available - used - 50), detailed_response);
-                        used += snprintf(response + used, available - used, "%.*s\n",
-                                    needed < (int)(available - used) ? needed : (int)(available - used - 1),
-                                    detailed_response);
-                    }
-                    
-                    // Add SERVER REPLY header if space available
-                    if (used < available) {
-                        used += snprintf(response + used, available - used, "SERVER REPLY:\n");
-                    }
-                    
-                    // Add welcome message if space available
-                    if (used < available) {
-                        snprintf(response + used, available - used, "%.*s",
-                            (int)(available - used - 1), welcome_message);
-                    }
-                } else {
-                    // If failed, just send the error message
-                    strncpy(response, detailed_response, sizeof(response) - 1);
-                    response[sizeof(response) - 1] = '\0';
-                }
+            }
+            put_response(out, req->op, STATUS_OK, list, strlen(list));
+            free(list);
+            return;
+        }
+            
+        case CMD_DELETE:
+            if (req->handle) {
+                status = delete_status(mutex_delete_handle(req->handle, client_pid, found));
+                if (status == STATUS_OK) drop_held(s, found);
                 break;
             }
-                
-            case CMD_EXIT:
-                printf("Client (PID: %d) requested exit\n", client_pid);
-                strcpy(response, "Goodbye!");
-                send(client_socket, response, strlen(response), 0);
-                close(client_socket);
-                return NULL;
-                
-            default:
-                strcpy(response, "Invalid command. Type 'help' for available commands.");
+            status = delete_status(mutex_delete(req->name, client_pid));
+            if (status == STATUS_OK) drop_held(s, req->name);
+            break;
+            
+        case CMD_SEND: {
+            char message[MAX_MSG_SIZE];
+            char detailed_response[BUFFER_SIZE];
+            char welcome_message[BUFFER_SIZE];
+            
+            size_t msg_len = req->payload_len < MAX_MSG_SIZE - 1 ? req->payload_len : MAX_MSG_SIZE - 1;
+            memcpy(message, req->payload, msg_len);
+            message[msg_len] = '\0';
+            
+            int rc = req->handle
+                ? mutex_send_handle(req->handle, client_pid, message,
+                                    detailed_response, sizeof(detailed_response),
+                                    welcome_message, sizeof(welcome_message))
+                : mutex_send(req->name, client_pid, message, 
+                             detailed_response, sizeof(detailed_response),
+                             welcome_message, sizeof(welcome_message));
+            
+            // Display on server console (safe truncated output)
+            printf("%.200s\n", detailed_response);
+            printf("Sending message to PID %d\n", client_pid);
+            
+            if (rc == 0) {
+                // The server's reply text travels back as the payload
+                put_response(out, req->op, STATUS_OK, welcome_message, strlen(welcome_message));
+                return;
+            }
+            status = (rc == -1) ? STATUS_NOT_OWNER : (rc == -2 ? STATUS_NOT_FOUND : STATUS_NO_MEMORY);
+            break;
+        }
+            
+        case CMD_SUBSCRIBE: {
+            uint64_t after = req->payload_len >= 8 ? proto_get_u64(req->payload) : UINT64_MAX;
+            uint64_t newest;
+            uint8_t payload[8];
+            status = subscribe(s, req->name, after, &newest);
+            if (status != STATUS_OK) break;
+            proto_put_u64(payload, newest);
+            put_response(out, req->op, STATUS_OK, payload, sizeof(payload));
+            return;
+        }
+            
+        case CMD_UNSUBSCRIBE:
+            status = unsubscribe(s, req->name);
+            break;
+            
+        case CMD_BATCH:
+            execute_batch(c, req);
+            return;
+            
+        case CMD_LOCK_ALL:
+            execute_lock_all(c, req);
+            return;
+            
+        case CMD_ATTACH:
+            // Only a local peer with a kernel-verified PID can be cleaned up after, and
+            // only one that may map the table (the server's user, or root) uses it
+            if (!shm_enabled || s->peer_pid == 0 ||
+                (s->peer_uid != geteuid() && s->peer_uid != 0)) {
+                status = STATUS_INVALID;
                 break;
+            }
+            s->attached = true;
+            break;
+            
+        case CMD_EXIT:
+            printf("Client (PID: %d) requested exit\n", client_pid);
+            c->close_after_flush = true;
+            break;
+            
+        default:
+            status = STATUS_INVALID;
+            break;
+    }
+    
+    put_response(out, req->op, status, NULL, 0);
+}
+
+
+static void mutex_on_open(Conn* c) {
+    Session* s = calloc(1, sizeof(Session));
+    if (!s) {
+        c->close_after_flush = true;
+        return;
+    }
+    s->conn = c;
+    s->client_pid = -1;
+    s->token = atomic_fetch_add(&next_session_token, 1);
+    atomic_fetch_add(&client_connections, 1);
+
+    struct sockaddr_storage local;
+    struct ucred cred;
+    socklen_t len = sizeof(local);
+    if (getsockname(c->fd, (struct sockaddr*)&local, &len) == 0 && local.ss_family == AF_UNIX) {
+        len = sizeof(cred);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+            s->peer_pid = cred.pid;
+            s->peer_uid = cred.uid;
         }
-        
-        // Send response back to client
-        if (send(client_socket, response, strlen(response), 0) < 0) {
-            perror("send failed");
+    }
+    s->waiter.wake = wake_session;
+    s->waiter.ctx = s;
+    s->waiter.owner_token = s->token;
+    s->commit.done = commit_done;
+    s->commit.ctx = s;
+    pthread_mutex_init(&s->mail_lock, NULL);
+    c->session = s;
+}
+
+
+// Handle every complete frame received so far (partial frames wait for more input)
+static void mutex_on_data(Conn* c) {
+    ProtoRequest req;
+
+    if (!c->session) return;
+
+    while (!c->paused && !c->close_after_flush) {
+        int size = proto_get_request(&c->in, &req);
+        if (size == 0) break;
+        if (size < 0) {
+            printf("Client (PID: %d) sent an invalid frame\n", ((Session*)c->session)->client_pid);
+            c->close_after_flush = true;
             break;
         }
+        
+        execute_request(c, &req);
+        buf_consume(&c->in, size);
     }
+
+    // Messages the requests themselves produced go out with their responses
+    Session* s = c->session;
+    if (s->subscribed && !c->closed) send_pushes(c, s, false);
+    hold_for_commit(c, s);
+}
+
+
+static void mutex_on_wake(Conn* c) {
+    Session* s = c->session;
+    if (s->syncing && atomic_exchange(&s->committed, false)) commit_reached(c, s);
+
+    if (s->waiting && atomic_exchange(&s->woken, false)) {
+        Status status = lock_status(s->waiter.status);
+        if (status == STATUS_DEADLOCK) {
+            printf("Wait of PID %d for mutex '%s' aborted to break a deadlock\n",
+                   s->client_pid, s->waiter.name);
+        }
+        wait_done(s, status);
+    }
+    if (s->subscribed) send_pushes(c, s, true);
+    hold_for_commit(c, s);
+}
+
+
+static void mutex_on_close(Conn* c) {
+    Session* s = c->session;
+    if (!s) return;
+    atomic_fetch_sub(&client_connections, 1);
+
+    if (s->client_pid != -1) printf("Client (PID: %d) disconnected\n", s->client_pid);
+
+    // Leave the wait queue; if a wakeup is already on its way, on_wake cleans up
+    if (s->waiting && mutex_cancel_wait(&s->waiter)) s->waiting = false;
+    if (s->parked && !s->waiting) finish_request(s, CMD_LOCK, STATUS_OK, NULL, 0);
     
-    close(client_socket);  // Close the client socket
-    return NULL;
+    release_all_held(s);
+    drop_subscriptions(c, s);
+    if (s->attached) mutex_release_pid(s->peer_pid);
+    buf_free(&s->unsynced);  // A pending commit still drops its hold in on_wake
+}
+
+
+static const ConnOps mutex_ops = {
+    mutex_on_open, mutex_on_data, mutex_on_wake, mutex_on_close
+};
+
+
+// Write at most max_chars characters of s to out as the inside of a JSON string
+static void json_escape(char* out, size_t size, const char* s, size_t max_chars) {
+    size_t n = 0;
+    for (size_t i = 0; s[i] != '\0' && i < max_chars; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        char esc[8];
+        if (ch == '"' || ch == '\\') {
+            snprintf(esc, sizeof(esc), "\\%c", ch);
+        } else if (ch < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+        } else {
+            esc[0] = (char)ch;
+            esc[1] = '\0';
+        }
+
+        size_t len = strlen(esc);
+        if (n + len >= size) break;
+        memcpy(out + n, esc, len);
+        n += len;
+    }
+    out[n] = '\0';
+}
+
+
+// One mutex as a JSON object, as listed by /mutexes and carried by /events
+static void format_mutex_json(const Mutex* m, char* out, size_t size) {
+    char name[MAX_MUTEX_NAME * 6];
+    char message[50 * 6 + 1];
+    MutexMessage* last = mutex_last_message(m);
+    const char* mode = !mutex_locked(m) ? "none" : (m->reader_count > 0 ? "shared" : "exclusive");
+
+    json_escape(name, sizeof(name), mutex_name(m), MAX_MUTEX_NAME);
+    json_escape(message, sizeof(message), last ? last->text : "", 50);
+    snprintf(out, size,
+             "{\"name\":\"%s\",\"owner\":%d,\"locked\":%s,\"mode\":\"%s\",\"readers\":%d,"
+             "\"last_message\":\"%s\",\"message_seq\":%llu}",
+             name, mutex_owner(m), mutex_locked(m) ? "true" : "false", mode, m->reader_count, message,
+             (unsigned long long)(last ? last->seq : 0));
+}
+
+
+// Output buffer and entry count of a JSON array being built
+typedef struct {
+    Buffer* out;
+    int count;
+} JsonBuilder;
+
+
+// mutex_foreach callback: append one mutex as a JSON object
+static void append_mutex_json(const Mutex* m, void* ctx) {
+    JsonBuilder* builder = ctx;
+    char mutex_json[1024];
+
+    format_mutex_json(m, mutex_json, sizeof(mutex_json));
+    if (builder->count++ > 0) buf_append(builder->out, ",", 1);
+    buf_append(builder->out, mutex_json, strlen(mutex_json));
+}
+
+
+// mutex_foreach_deleted callback: append one name as a JSON string
+static void append_name_json(const char* name, void* ctx) {
+    JsonBuilder* builder = ctx;
+    char escaped[MAX_MUTEX_NAME * 6];
+
+    json_escape(escaped, sizeof(escaped), name, MAX_MUTEX_NAME);
+    if (builder->count++ > 0) buf_append(builder->out, ",", 1);
+    buf_append(builder->out, "\"", 1);
+    buf_append(builder->out, escaped, strlen(escaped));
+    buf_append(builder->out, "\"", 1);
+}
+
+
+// Dashboard connection streaming registry events (GET /events, Server-Sent Events)
+typedef struct EventStream {
+    Conn* conn;
+    Buffer pending;             // Events not yet moved to conn->out
+    bool posted;                // conn_post issued and web_on_wake not run yet
+    bool closed;                // Connection gone: web_on_wake drops the last hold
+    struct EventStream* prev;
+    struct EventStream* next;
+} EventStream;
+
+#define STREAM_MAX_BACKLOG (1 << 20)   // Drop a dashboard that falls this far behind
+
+// Open event streams. Events are published by whichever thread changed the registry,
+// with a stripe lock held: streams_lock is taken inside stripe locks and only
+// conn_post is called under it. Fields of EventStream marked above are guarded by it.
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static EventStream* streams = NULL;
+static _Atomic int stream_count = 0;
+
+static const char* event_names[] = { "create", "delete", "lock", "unlock", "send" };
+
+
+// Registry observer: queue the event on every open stream
+static void publish_event(MutexEvent event, const Mutex* m, int client_pid) {
+    if (atomic_load(&stream_count) == 0) return;
+
+    char mutex_json[1024];
+    char frame[1200];
+    format_mutex_json(m, mutex_json, sizeof(mutex_json));
+    int len = snprintf(frame, sizeof(frame), "data: {\"type\":\"%s\",\"pid\":%d,\"mutex\":%s}\n\n",
+                       event_names[event], client_pid, mutex_json);
+
+    pthread_mutex_lock(&streams_lock);
+    for (EventStream* s = streams; s != NULL; s = s->next) {
+        if (s->pending.len <= STREAM_MAX_BACKLOG) buf_append(&s->pending, frame, len);
+        if (!s->posted) {
+            s->posted = true;
+            conn_post(s->conn);
+        }
+    }
+    pthread_mutex_unlock(&streams_lock);
+}
+
+
+// GET /events: send the current list, then keep the connection open and push every
+// change as it happens. Events carry the whole mutex record, so one that the list
+// already reflects does no harm when it arrives after it.
+static void open_stream(Conn* c) {
+    EventStream* s = calloc(1, sizeof(EventStream));
+    if (!s) {
+        c->close_after_flush = true;
+        return;
+    }
+    s->conn = c;
+    c->session = s;
+    conn_hold(c);  // conn_post may reach c until it is unlinked and no post is pending
+
+    pthread_mutex_lock(&streams_lock);
+    s->next = streams;
+    if (streams) streams->prev = s;
+    streams = s;
+    atomic_fetch_add(&stream_count, 1);
+    pthread_mutex_unlock(&streams_lock);
+
+    const char* header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n\r\n"
+        "data: {\"type\":\"snapshot\",\"mutexes\":[";
+    buf_append(&c->out, header, strlen(header));
+
+    JsonBuilder builder = { &c->out, 0 };
+    mutex_foreach(append_mutex_json, &builder);
+    buf_append(&c->out, "]}\n\n", 4);
+}
+
+
+static const char* json_header =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Connection: close\r\n\r\n";
+
+// Last full /mutexes response, reused while the registry generation stays the same
+// (web requests are all served by reactor 0). Not kept while fast mutexes exist:
+// their lock words change hands without a new generation.
+static Buffer mutexes_cache = {0};
+static uint64_t mutexes_cache_gen = 0;
+static bool mutexes_cache_valid = false;
+
+
+// Changes after generation since: the mutexes changed and the names deleted. Returns
+// false if the server no longer knows every deletion since then.
+static bool append_delta(Buffer* out, uint64_t since, uint64_t gen) {
+    Buffer deleted = {0};
+    JsonBuilder builder = { &deleted, 0 };
+    if (since < gen && !mutex_foreach_deleted(since, append_name_json, &builder)) {
+        buf_free(&deleted);
+        return false;
+    }
+
+    char head[96];
+    snprintf(head, sizeof(head), "{\"generation\":%llu,\"full\":false,\"mutexes\":[",
+             (unsigned long long)gen);
+    buf_append(out, json_header, strlen(json_header));
+    buf_append(out, head, strlen(head));
+
+    builder.out = out;
+    builder.count = 0;
+    if (since < gen || mutex_has_fast()) mutex_foreach_since(since, append_mutex_json, &builder);
+
+    buf_append(out, "],\"deleted\":[", 13);
+    if (deleted.len > 0) buf_append(out, deleted.data, deleted.len);
+    buf_append(out, "]}", 2);
+    buf_free(&deleted);
+    return true;
+}
+
+
+// GET /mutexes[?since=<generation>]: every mutex ("full":true), or only what changed
+// after that generation. Pass the returned "generation" as since on the next request.
+static void answer_mutexes(Conn* c, const char* query) {
+    uint64_t gen = mutex_generation();
+    bool fast = mutex_has_fast();
+
+    // A since from the future comes from before a server restart: send everything
+    if (strncmp(query, "?since=", 7) == 0 && query[7] >= '0' && query[7] <= '9') {
+        uint64_t since = strtoull(query + 7, NULL, 10);
+        if (since <= gen && append_delta(&c->out, since, gen)) return;
+    }
+
+    if (!mutexes_cache_valid || mutexes_cache_gen != gen || fast) {
+        char head[96];
+        snprintf(head, sizeof(head), "{\"generation\":%llu,\"full\":true,\"mutexes\":[",
+                 (unsigned long long)gen);
+        buf_consume(&mutexes_cache, mutexes_cache.len);
+        buf_append(&mutexes_cache, json_header, strlen(json_header));
+        buf_append(&mutexes_cache, head, strlen(head));
+
+        JsonBuilder builder = { &mutexes_cache, 0 };
+        mutex_foreach(append_mutex_json, &builder);
+        buf_append(&mutexes_cache, "]}", 2);
+
+        mutexes_cache_gen = gen;
+        mutexes_cache_valid = !fast;
+    }
+    buf_append(&c->out, mutexes_cache.data, mutexes_cache.len);
+}
+
+
+// Per-mutex counter lines, gathered by one mutex_foreach pass
+typedef struct {
+    Buffer acquires;
+    Buffer contentions;
+} MutexCounters;
+
+
+// mutex_foreach callback: one line per counter for m
+static void append_mutex_counters(const Mutex* m, void* ctx) {
+    MutexCounters* counters = ctx;
+    char name[MAX_MUTEX_NAME * 2];
+
+    metrics_label_escape(name, sizeof(name), mutex_name(m));
+    metrics_printf(&counters->acquires, "mutex_acquires_total{mutex=\"%s\"} %llu\n",
+                   name, (unsigned long long)m->cold->acquires);
+    metrics_printf(&counters->contentions, "mutex_contentions_total{mutex=\"%s\"} %llu\n",
+                   name, (unsigned long long)m->cold->contentions);
 }
 
 
-void handle_web_client(int client_socket) {
+// GET /metrics: counters and latency histograms in the Prometheus text format
+static void answer_metrics(Conn* c) {
+    Buffer* out = &c->out;
+    const char* header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n\r\n";
+    buf_append(out, header, strlen(header));
+
+    metrics_printf(out, "# HELP mutex_server_responses_total Responses sent, by request and status "
+                        "(BATCH entries count under their own operation).\n"
+                        "# TYPE mutex_server_responses_total counter\n");
+    for (int op = 0; op <= CMD_INVALID; op++) {
+        for (int status = 0; status <= STATUS_READ_ONLY; status++) {
+            uint64_t n = atomic_load_explicit(&responses[op][status], memory_order_relaxed);
+            if (n == 0) continue;
+            metrics_printf(out, "mutex_server_responses_total{op=\"%s\",status=\"%s\"} %llu\n",
+                           command_to_string(op), status_to_string(status), (unsigned long long)n);
+        }
+    }
+
+    metrics_printf(out, "# HELP mutex_server_mutexes Mutexes in the registry.\n"
+                        "# TYPE mutex_server_mutexes gauge\n"
+                        "mutex_server_mutexes %d\n", atomic_load(&mutex_count));
+    metrics_printf(out, "# HELP mutex_server_connections Open connections.\n"
+                        "# TYPE mutex_server_connections gauge\n"
+                        "mutex_server_connections{kind=\"client\"} %d\n"
+                        "mutex_server_connections{kind=\"event_stream\"} %d\n",
+                   atomic_load(&client_connections), atomic_load(&stream_count));
+    metrics_printf(out, "# HELP mutex_server_threads Server threads by role.\n"
+                        "# TYPE mutex_server_threads gauge\n"
+                        "mutex_server_threads{role=\"reactor\"} %d\n"
+                        "mutex_server_threads{role=\"shm_watch\"} %d\n",
+                   reactor_total, shm_enabled ? 1 : 0);
+    metrics_printf(out, "# HELP mutex_server_backups Backups connected for replication.\n"
+                        "# TYPE mutex_server_backups gauge\n"
+                        "mutex_server_backups %d\n"
+                        "# HELP mutex_server_is_backup 1 while this server follows a primary.\n"
+                        "# TYPE mutex_server_is_backup gauge\n"
+                        "mutex_server_is_backup %d\n",
+                   repl_backup_count(), repl_is_backup() ? 1 : 0);
+
+    histogram_format(out, "mutex_hold_seconds",
+                     "Time a lock was held, for holds granted and released through the server.",
+                     "mode=\"exclusive\"", &mutex_hold_time[0]);
+    histogram_format(out, "mutex_hold_seconds", NULL, "mode=\"shared\"", &mutex_hold_time[1]);
+    histogram_format(out, "mutex_wait_seconds",
+                     "Time a waiting lock spent in a wait queue until it was granted.",
+                     NULL, &mutex_wait_time);
+
+    MutexCounters counters = { {0}, {0} };
+    mutex_foreach(append_mutex_counters, &counters);
+    metrics_printf(out, "# HELP mutex_acquires_total Holds granted by the server, per mutex.\n"
+                        "# TYPE mutex_acquires_total counter\n");
+    if (counters.acquires.len > 0) buf_append(out, counters.acquires.data, counters.acquires.len);
+    metrics_printf(out, "# HELP mutex_contentions_total Lock attempts that found the mutex held, "
+                        "per mutex.\n"
+                        "# TYPE mutex_contentions_total counter\n");
+    if (counters.contentions.len > 0) {
+        buf_append(out, counters.contentions.data, counters.contentions.len);
+    }
+    buf_free(&counters.acquires);
+    buf_free(&counters.contentions);
+}
+
+
+// POST /promote: a backup stops following its primary and takes changes
+static void answer_promote(Conn* c) {
+    const char* response = repl_promote() == 0 ?
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+        "Promoted to primary\n" :
+        "HTTP/1.1 409 Conflict\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+        "Not a backup\n";
+    buf_append(&c->out, response, strlen(response));
+}
+
+
+// Answer one HTTP request and close the connection afterwards, or start an event stream
+static void handle_web_request(Conn* c) {
     char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
+    size_t len = c->in.len < sizeof(buffer) - 1 ? c->in.len : sizeof(buffer) - 1;
+    memcpy(buffer, c->in.data, len);
+    buffer[len] = '\0';
+    buf_consume(&c->in, c->in.len);
     
-    // Receive HTTP request from client
-    bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
+    if (strncmp(buffer, "GET /events", 11) == 0) {
+        open_stream(c);
         return;
     }
-    
-    buffer[bytes_received] = '\0';
+    c->close_after_flush = true;
     
     // If request is GET /mutexes
-    if (strstr(buffer, "GET /mutexes")) {
-        char json_response[2048];
-        pthread_mutex_lock(&global_mutex_lock);
-        
-        // Build JSON response, preparing HTTP headers
-        snprintf(json_response, sizeof(json_response), 
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: application/json\r\n"
-                "Access-Control-Allow-Origin: *\r\n"
-                "Connection: close\r\n\r\n"
-                "{\"mutexes\":[");
-        
-        // Add each mutex to JSON
-        for (int i = 0; i < mutex_count; i++) {
-            char time_buf[20];
-            if (mutexes[i].lock_time > 0) {
-                strftime(time_buf, sizeof(time_buf), "%H:%M:%S", localtime(&mutexes[i].lock_time));
-            } else {
-                strcpy(time_buf, "null");
-            }
-            
-            char mutex_json[256];
-            
-            snprintf(mutex_json, sizeof(mutex_json), 
-                    "%s{\"name\":\"%s\",\"owner\":%d,\"locked\":%s,\"last_message\":\"%.50s\"}",
-                    (i > 0) ? "," : "",
-                    mutexes[i].name,
-                    mutexes[i].owner_pid,
-                    mutexes[i].is_locked ? "true" : "false",
-                    mutexes[i].last_message);
-            
-            strncat(json_response, mutex_json, sizeof(json_response) - strlen(json_response) - 1);
-        }
-        
-        strcat(json_response, "]}");
-        pthread_mutex_unlock(&global_mutex_lock);
-        
-        // Send JSON response to web client
-        send(client_socket, json_response, strlen(json_response), 0);
+    if (strncmp(buffer, "GET /mutexes", 12) == 0) {
+        answer_mutexes(c, buffer + 12);
+    } else if (strncmp(buffer, "GET /metrics", 12) == 0) {
+        answer_metrics(c);
+    } else if (strncmp(buffer, "POST /promote", 13) == 0) {
+        answer_promote(c);
     }
-    
-    close(client_socket);
 }
 
-int main() {
-    // Handle Ctrl+C (SIGINT) and termination (SIGTERM) signals
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
 
-    // Call cleanup() if the program exits
-    atexit(cleanup);
-    
+static void web_on_open(Conn* c) {
+    (void)c;
+}
+
+
+// Wait for the end of the request headers (streams ignore anything sent after them)
+static void web_on_data(Conn* c) {
+    if (c->close_after_flush || c->session) {
+        buf_consume(&c->in, c->in.len);
+        return;
+    }
+    if (memmem(c->in.data, c->in.len, "\r\n\r\n", 4) || c->in.len >= BUFFER_SIZE) {
+        handle_web_request(c);
+    }
+}
+
+
+// Events were published: move them to the socket
+static void web_on_wake(Conn* c) {
+    EventStream* s = c->session;
+    if (s == NULL) return;
+
+    pthread_mutex_lock(&streams_lock);
+    s->posted = false;
+    bool closed = s->closed;
+    Buffer events = s->pending;
+    s->pending = (Buffer){0};
+    pthread_mutex_unlock(&streams_lock);
+
+    if (closed) {
+        conn_release(c);
+        return;
+    }
+    if (events.len > STREAM_MAX_BACKLOG || c->out.len > STREAM_MAX_BACKLOG) {
+        printf("Dropping event stream that fell behind (it reconnects with a fresh list)\n");
+        buf_free(&events);
+        conn_close(c);
+        return;
+    }
+    buf_append(&c->out, events.data, events.len);
+    buf_free(&events);
+}
+
+
+static void web_on_close(Conn* c) {
+    EventStream* s = c->session;
+    if (s == NULL) return;
+
+    pthread_mutex_lock(&streams_lock);
+    if (s->prev) s->prev->next = s->next;
+    else streams = s->next;
+    if (s->next) s->next->prev = s->prev;
+    atomic_fetch_sub(&stream_count, 1);
+    s->closed = true;
+    bool posted = s->posted;
+    buf_free(&s->pending);
+    pthread_mutex_unlock(&streams_lock);
+
+    if (!posted) conn_release(c);  // Else web_on_wake drops the hold
+}
+
+
+static const ConnOps web_ops = {
+    web_on_open, web_on_data, web_on_wake, web_on_close
+};
+
+
+// Create a non-blocking listening socket on port; with reuse_port several sockets
+// share the port and the kernel spreads incoming connections across them
+static int open_listener(int port, const char* what, bool reuse_port) {
     struct sockaddr_in address;  // Point to server address structure
     int opt = 1; // Option = true
-    int addrlen = sizeof(address);
-    
-    // Initialize mutexes
-    mutex_init();
     
-    // Create main server socket (for mutex clients)
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s socket failed: %s\n", what, strerror(errno));
         exit(EXIT_FAILURE);
     }
     
     // Allow reuse of the address/port
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
     
     // Set up server address and port
     address.sin_family = AF_INET;  // IPv4
     address.sin_addr.s_addr = INADDR_ANY;  // Accept connections from any IP
-    address.sin_port = htons(SERVER_PORT);  // Use defined server port (8080)
+    address.sin_port = htons(port);
     
     // Bind the socket to the address
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "%s bind failed: %s\n", what, strerror(errno));
         exit(EXIT_FAILURE);
     }
     
     // Start listening for incoming connections
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
-        perror("listen");
+    if (listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "%s listen failed: %s\n", what, strerror(errno));
         exit(EXIT_FAILURE);
     }
-    
-    // Create web interface socket (main port + 1)
-    if ((web_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("web socket failed");
+    return fd;
+}
+
+
+// Unix-domain listener for clients on this host (replaces a stale socket file)
+static int open_unix_listener(const char* path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
         exit(EXIT_FAILURE);
     }
-    
-    // Reuse the same address struct, just change the port (port +1)
-    struct sockaddr_in web_addr = address;
-    web_addr.sin_port = htons(SERVER_PORT + 1);
-    
-    // Bind the web socket to the new port
-    if (bind(web_fd, (struct sockaddr *)&web_addr, sizeof(web_addr)) < 0) {
-        perror("web bind failed");
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("unix socket failed");
         exit(EXIT_FAILURE);
     }
-    
-    // Start listening for web clients
-    if (listen(web_fd, 5) < 0) {
-        perror("web listen");
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "unix listener on %s failed: %s\n", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
+
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-r reactors] [-u path] [-f slots] [-d dir]\n"
+                    "          [-R port [-s]] [-b host:port]\n"
+                    "  -p N     Mutex port; the web interface listens on the next one. Default: %d\n"
+                    "  -r N     Event loop threads, each with its own listening socket on the\n"
+                    "           mutex port (SO_REUSEPORT); 0 = one per online CPU. Default: 1\n"
+                    "  -u PATH  Unix-domain socket for local clients, \"\" = none. Default: %s\n"
+                    "  -f N     Shared-memory table for up to N fast mutexes. Default: off\n"
+                    "  -d DIR   Keep mutexes and holders across restarts in a write-ahead log\n"
+                    "           in DIR. Default: off\n"
+                    "  -R N     Stream every change to backups that connect to port N\n"
+                    "  -s       Reply to a change only once a backup has it (with -R)\n"
+                    "  -b ADDR  Run as a read-only backup of the primary whose -R port is at\n"
+                    "           host:port, until POST /promote on the web port\n",
+            prog, SERVER_PORT, SERVER_SOCKET_PATH);
+}
+
+
+int main(int argc, char* argv[]) {
+    int reactor_count = 1;
+    int opt;
     
-    // Print server status
-    printf("Server started:\n- Mutex port: %d\n- Web port: %d\n", 
-           SERVER_PORT, SERVER_PORT + 1);
+    uint32_t shm_slots = 0;
     
-    fd_set readfds;  // File descriptor set for select
+    while ((opt = getopt(argc, argv, "p:r:u:f:d:R:sb:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                server_port = atoi(optarg);
+                if (server_port < 1 || server_port > 65534) {
+                    fprintf(stderr, "Port must be between 1 and 65534\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                reactor_count = atoi(optarg);
+                if (reactor_count == 0) reactor_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+                    fprintf(stderr, "Reactor count must be between 1 and %d\n", MAX_REACTORS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                unix_path = optarg[0] ? optarg : NULL;
+                break;
+            case 'f':
+                shm_slots = (uint32_t)atoi(optarg);
+                break;
+            case 'd':
+                log_dir = optarg;
+                break;
+            case 'R':
+                repl_port = atoi(optarg);
+                break;
+            case 's':
+                repl_sync = true;
+                break;
+            case 'b':
+                if (strchr(optarg, ':') == NULL) {
+                    fprintf(stderr, "Backup of what? Expected host:port, got %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                primary = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
 
-    while (1) {
+    // Handle Ctrl+C (SIGINT) and termination (SIGTERM) signals on a thread of their own;
+    // threads created from here on inherit the mask
+    static sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    pthread_t signal_tid;
+    if (pthread_create(&signal_tid, NULL, signal_thread, &stop_signals) != 0) {
+        perror("signal thread");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);  // Closed peers are detected by send() instead
 
-        // Clear and set the file descriptors
-        FD_ZERO(&readfds);  // Clear the read file descriptor set
-        FD_SET(server_fd, &readfds);  // Add server socket to the set
-        FD_SET(web_fd, &readfds);  // Add web socket to the set
-        
-        int max_fd = (server_fd > web_fd) ? server_fd : web_fd;
-        
-        // Wait for activity on either socket
-        if (select(max_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
-            perror("select");
-            continue;
+    // Call cleanup() if the program exits
+    atexit(cleanup);
+    
+    // Initialize mutexes
+    mutex_init();
+    mutex_set_observer(publish_event);
+    if (shm_slots > 0) {
+        if (mutex_shm_start(shm_slots) < 0) {
+            perror("shared-memory table");
+            exit(EXIT_FAILURE);
         }
-        
-        // If mutex client connects
-        if (FD_ISSET(server_fd, &readfds)) {  // Checks if server_fd is ready for reading in the set readfds.
-            int* client_socket = malloc(sizeof(int));
-            *client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-            
-            // Create a new thread to handle the client
-            pthread_t thread_id;
-            pthread_create(&thread_id, NULL, handle_client, (void*)client_socket);
-            pthread_detach(thread_id);  // Auto clean up thread when done
+        shm_enabled = true;
+    }
+
+    // Restore the registry from the log (fast mutexes need the table first). Backups are
+    // fed from the log's records, so a primary keeps a log even without a directory.
+    if (log_dir || repl_port) {
+        uint64_t start = monotonic_ns();
+        int replayed = mutex_persist_open(log_dir);
+        if (replayed < 0) {
+            fprintf(stderr, "Write-ahead log in %s: %s\n", log_dir, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (log_dir) {
+            printf("Restored %d mutexes from %d log records in %.1f ms\n",
+                   atomic_load(&mutex_count), replayed, (monotonic_ns() - start) / 1e6);
         }
+    }
+    if (repl_port && repl_serve(repl_port, repl_sync) < 0) {
+        fprintf(stderr, "Replication port %d: %s\n", repl_port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (primary && mutex_follow(primary) < 0) {
+        perror("replication");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Web interface socket (main port + 1), served by the first reactor only
+    web_fd = open_listener(server_port + 1, "web", false);
+    
+    // Local clients connect over the Unix socket, accepted by whichever reactor is free
+    if (unix_path) unix_fd = open_unix_listener(unix_path);
+    
+    // Each reactor accepts from its own mutex socket and serves those clients itself;
+    // only lock handoffs between clients of different reactors cross threads (conn_post)
+    Reactor* reactors[MAX_REACTORS];
+    bool multi = reactor_count > 1;
+    for (int i = 0; i < reactor_count; i++) {
+        server_fds[i] = open_listener(server_port, "mutex", multi);
+        server_fd_count++;
         
-        // If web client connects
-        if (FD_ISSET(web_fd, &readfds)) {  // Checks if web_fd is ready for reading in the set readfds.
-            int web_client = accept(web_fd, NULL, NULL);
-
-            // Handle web client directly (no thread)
-            handle_web_client(web_client);
+        reactors[i] = reactor_create(i);
+        if (!reactors[i] || reactor_listen(reactors[i], server_fds[i], &mutex_ops) < 0 ||
+            (i == 0 && reactor_listen(reactors[i], web_fd, &web_ops) < 0) ||
+            (unix_fd != -1 && reactor_listen(reactors[i], unix_fd, &mutex_ops) < 0)) {
+            fprintf(stderr, "Failed to start event loop %d\n", i);
+            exit(EXIT_FAILURE);
         }
     }
     
+    reactor_total = reactor_count;
+    
+    // Print server status
+    printf("Server started:\n- Mutex port: %d\n- Web port: %d\n- Reactors: %d\n", 
+           server_port, server_port + 1, reactor_count);
+    if (unix_fd != -1) printf("- Unix socket: %s\n", unix_path);
+    if (shm_enabled) printf("- Fast mutex table: %u slots\n", shm_slots);
+    if (log_dir) printf("- Write-ahead log: %s\n", log_dir);
+    if (repl_port) {
+        printf("- Replication port: %d (%s)\n", repl_port, repl_sync ? "synchronous" : "asynchronous");
+    }
+    if (primary) printf("- Backup of: %s\n", primary);
+    
+    // Reactor 0 runs on the main thread
+    for (int i = 1; i < reactor_count; i++) {
+        if (reactor_start(reactors[i]) != 0) {
+            fprintf(stderr, "Failed to start reactor thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    reactor_run(reactors[0]);
     return 0;
 }
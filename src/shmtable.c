@@ -0,0 +1,279 @@
+#include "../inc/shmtable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define SHM_MAGIC 0x4D555459u   // "MUTY": slots carry the rung mark
+
+
+// Process-shared futex (the table is mapped by several processes)
+static long futex(_Atomic uint32_t* addr, int op, uint32_t val, const struct timespec* timeout) {
+    return syscall(SYS_futex, (uint32_t*)addr, op, val, timeout, NULL, 0);
+}
+
+
+static size_t table_size(uint32_t capacity) {
+    return sizeof(ShmTable) + (size_t)capacity * sizeof(ShmSlot);
+}
+
+
+ShmTable* shm_table_create(uint32_t capacity) {
+    uint32_t cap = 16;
+    while (cap < capacity) cap *= 2;
+
+    // A table left behind by a crashed server is stale: start over
+    shm_unlink(SHM_TABLE_NAME);
+    // Owner only: whoever can write a lock word can take or free any fast mutex
+    int fd = shm_open(SHM_TABLE_NAME, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+
+    if (ftruncate(fd, table_size(cap)) < 0) {
+        close(fd);
+        shm_unlink(SHM_TABLE_NAME);
+        return NULL;
+    }
+    ShmTable* t = mmap(NULL, table_size(cap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        shm_unlink(SHM_TABLE_NAME);
+        return NULL;
+    }
+
+    // ftruncate zero-filled it: every slot is SHM_EMPTY
+    t->capacity = cap;
+    atomic_store(&t->doorbell, 0);
+    t->magic = SHM_MAGIC;
+    return t;
+}
+
+
+void shm_table_destroy(ShmTable* t) {
+    munmap(t, table_size(t->capacity));
+    shm_unlink(SHM_TABLE_NAME);
+}
+
+
+void shm_table_unlink() {
+    shm_unlink(SHM_TABLE_NAME);
+}
+
+
+ShmTable* shm_table_open() {
+    int fd = shm_open(SHM_TABLE_NAME, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    ShmTable* t = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmTable)) {
+        t = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (t == MAP_FAILED) return NULL;
+
+    if (t->magic != SHM_MAGIC || table_size(t->capacity) != (size_t)st.st_size) {
+        munmap(t, st.st_size);
+        return NULL;
+    }
+    return t;
+}
+
+
+void shm_table_close(ShmTable* t) {
+    munmap(t, table_size(t->capacity));
+}
+
+
+// Claim the first reusable slot on name's probe sequence. The generation is odd while
+// the name is rewritten, so lookups racing with the reuse see a mismatch.
+ShmSlot* shm_slot_insert(ShmTable* t, const char* name) {
+    uint32_t h = mutex_name_hash(name);
+
+    for (uint32_t n = 0; n < t->capacity; n++) {
+        ShmSlot* s = &t->slots[(h + n) & (t->capacity - 1)];
+        if (atomic_load(&s->state) == SHM_LIVE) continue;
+
+        atomic_fetch_add(&s->generation, 1);
+        s->hash = h;
+        strncpy(s->name, name, MAX_MUTEX_NAME - 1);
+        s->name[MAX_MUTEX_NAME - 1] = '\0';
+        atomic_fetch_add(&s->generation, 1);
+
+        atomic_store(&s->word, 0);
+        atomic_store(&s->state, SHM_LIVE);
+        return s;
+    }
+    return NULL;
+}
+
+
+void shm_slot_remove(ShmSlot* s) {
+    atomic_store(&s->state, SHM_TOMBSTONE);
+}
+
+
+// Live slot of name and its generation, NULL if there is none
+ShmSlot* shm_slot_find(ShmTable* t, const char* name, uint32_t* generation) {
+    uint32_t h = mutex_name_hash(name);
+
+    for (uint32_t n = 0; n < t->capacity; n++) {
+        ShmSlot* s = &t->slots[(h + n) & (t->capacity - 1)];
+        uint32_t state = atomic_load(&s->state);
+        if (state == SHM_EMPTY) return NULL;
+        if (state != SHM_LIVE || s->hash != h) continue;
+
+        uint32_t gen = atomic_load(&s->generation);
+        bool match = (gen % 2 == 0 && strncmp(s->name, name, MAX_MUTEX_NAME) == 0);
+        if (match && atomic_load(&s->generation) == gen) {
+            *generation = gen;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+
+static void ring_doorbell(ShmTable* t) {
+    atomic_fetch_add(&t->doorbell, 1);
+    futex(&t->doorbell, FUTEX_WAKE, 1, NULL);
+}
+
+
+int shm_lock(ShmTable* t, ShmSlot* s, uint32_t generation, uint32_t pid, int timeout_ms) {
+    struct timespec deadline;
+    uint32_t contended = 0;   // Once we slept, others may sleep too: keep the flag set
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    while (1) {
+        uint32_t w = atomic_load(&s->word);
+        uint32_t owner = w & SHM_PID_MASK;
+
+        if (owner == SHM_DEAD) return -4;
+        if (owner == 0) {
+            if (!atomic_compare_exchange_weak(&s->word, &w, pid | contended)) continue;
+
+            // The slot was reused for another mutex since the lookup
+            if (atomic_load(&s->generation) != generation) {
+                shm_unlock(t, s, pid);
+                return -4;
+            }
+            return 0;
+        }
+        if (owner == pid) return -2;
+        if (timeout_ms == 0) return -1;
+
+        // Ask the holder to wake us, then sleep until the word changes
+        if (!(w & SHM_FUTEX_WAITERS)) {
+            if (!atomic_compare_exchange_weak(&s->word, &w, w | SHM_FUTEX_WAITERS)) continue;
+            w |= SHM_FUTEX_WAITERS;
+        }
+
+        struct timespec remaining, *timeout = NULL;
+        if (timeout_ms > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000;
+            }
+            if (remaining.tv_sec < 0) return -3;
+            timeout = &remaining;
+        }
+        futex(&s->word, FUTEX_WAIT, w, timeout);
+        contended = SHM_FUTEX_WAITERS;
+    }
+}
+
+
+int shm_unlock(ShmTable* t, ShmSlot* s, uint32_t pid) {
+    uint32_t owner = atomic_load(&s->word) & SHM_PID_MASK;
+    if (owner == 0 || owner == SHM_DEAD) return -1;
+    if (owner != pid) return -2;
+
+    uint32_t old = atomic_exchange(&s->word, 0);
+    if (old & SHM_FUTEX_WAITERS) futex(&s->word, FUTEX_WAKE, 1, NULL);
+    if (old & SHM_SERVER_WAITERS) {
+        atomic_store(&s->rung, 1);  // Tells the server which slot to hand off
+        ring_doorbell(t);
+    }
+    return 0;
+}
+
+
+uint32_t shm_owner(ShmSlot* s) {
+    uint32_t owner = atomic_load(&s->word) & SHM_PID_MASK;
+    return owner == SHM_DEAD ? 0 : owner;
+}
+
+
+bool shm_acquire(ShmSlot* s, uint32_t pid, bool server_waiters) {
+    uint32_t w = atomic_load(&s->word);
+    uint32_t flags = server_waiters ? SHM_SERVER_WAITERS : 0;
+
+    while ((w & SHM_PID_MASK) == 0) {
+        if (atomic_compare_exchange_weak(&s->word, &w, pid | flags | (w & SHM_FUTEX_WAITERS))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool shm_flag_server_waiters(ShmSlot* s) {
+    uint32_t w = atomic_load(&s->word);
+
+    while ((w & SHM_PID_MASK) != 0) {
+        if ((w & SHM_SERVER_WAITERS) ||
+            atomic_compare_exchange_weak(&s->word, &w, w | SHM_SERVER_WAITERS)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void shm_release(ShmSlot* s) {
+    uint32_t old = atomic_exchange(&s->word, 0);
+    if (old & SHM_FUTEX_WAITERS) futex(&s->word, FUTEX_WAKE, 1, NULL);
+}
+
+
+bool shm_kill(ShmSlot* s, uint32_t pid) {
+    uint32_t w = atomic_load(&s->word);
+
+    while (1) {
+        uint32_t owner = w & SHM_PID_MASK;
+        if (owner != 0 && owner != pid) return false;
+        if (atomic_compare_exchange_weak(&s->word, &w, SHM_DEAD)) break;
+    }
+
+    // Sleepers wake up to find the mutex gone
+    futex(&s->word, FUTEX_WAKE, INT_MAX, NULL);
+    return true;
+}
+
+
+uint32_t shm_doorbell_wait(ShmTable* t, uint32_t seen) {
+    futex(&t->doorbell, FUTEX_WAIT, seen, NULL);
+    return atomic_load(&t->doorbell);
+}
+
+
+bool shm_take_rung(ShmSlot* s) {
+    return atomic_load(&s->rung) != 0 && atomic_exchange(&s->rung, 0) != 0;
+}
+
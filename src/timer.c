@@ -0,0 +1,93 @@
+#include "../inc/timer.h"
+
+
+void wheel_init(TimerWheel* w, uint64_t now_ms) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        w->slots[i].prev = w->slots[i].next = &w->slots[i];
+    }
+    w->due.prev = w->due.next = &w->due;
+    w->tick = now_ms / WHEEL_TICK_MS;
+    w->count = 0;
+}
+
+
+void wheel_add(TimerWheel* w, TimerEntry* t, uint64_t deadline_ms) {
+    if (t->armed) wheel_remove(w, t);
+
+    // Timers more than one revolution away stay in their slot until their round comes;
+    // overdue ones go in the current slot so the next expiry sees them
+    uint64_t tick = deadline_ms / WHEEL_TICK_MS;
+    if (tick < w->tick) tick = w->tick;
+
+    TimerEntry* head = &w->slots[tick % WHEEL_SLOTS];
+    t->deadline = deadline_ms;
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    t->armed = true;
+    w->count++;
+}
+
+
+void wheel_remove(TimerWheel* w, TimerEntry* t) {
+    if (!t->armed) return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->armed = false;
+    w->count--;
+}
+
+
+void wheel_expire(TimerWheel* w, uint64_t now_ms) {
+    uint64_t now_tick = now_ms / WHEEL_TICK_MS;
+
+    if (w->count == 0) {
+        w->tick = now_tick;
+        return;
+    }
+
+    // Visit each slot passed since the last call (every slot at most once)
+    uint64_t first = w->tick;
+    uint64_t ticks = now_tick - first + 1;
+    if (ticks > WHEEL_SLOTS) ticks = WHEEL_SLOTS;
+
+    for (uint64_t i = 0; i < ticks; i++) {
+        TimerEntry* head = &w->slots[(first + i) % WHEEL_SLOTS];
+        TimerEntry* t = head->next;
+
+        while (t != head) {
+            TimerEntry* next = t->next;
+            if (t->deadline <= now_ms) {
+                // Relink at the tail of the due list, keeping expiry order
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                t->next = &w->due;
+                t->prev = w->due.prev;
+                w->due.prev->next = t;
+                w->due.prev = t;
+            }
+            t = next;
+        }
+    }
+
+    w->tick = now_tick;
+}
+
+
+TimerEntry* wheel_next_due(TimerWheel* w) {
+    TimerEntry* t = w->due.next;
+    if (t == &w->due) return NULL;
+
+    wheel_remove(w, t);
+    return t;
+}
+
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
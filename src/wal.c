@@ -0,0 +1,696 @@
+#include "../inc/wal.h"
+#include "../inc/metrics.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC 0x50414E53u    // "SNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_FILE "mutex.snap"
+#define SNAPSHOT_TEMP "mutex.snap.tmp"
+#define MAX_COMMIT_DELAY_NS 500000ull   // Longest wait for more records before a sync
+
+// On-disk record: this header, then the name and the message (not NUL-terminated).
+// Host byte order: the log is only read back by the server that wrote it.
+typedef struct {
+    uint32_t checksum;      // CRC-32 of the rest of the record
+    uint16_t size;          // Whole record, header included
+    uint8_t type;
+    uint8_t flags;
+    uint64_t lsn;
+    uint64_t seq;
+    int64_t time;
+    int32_t pid;
+    uint16_t name_len;
+    uint16_t message_len;
+} __attribute__((packed)) DiskRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t lsn;           // Log position the snapshot started at
+    uint64_t size;          // Bytes of records that follow
+} SnapshotHeader;
+
+_Static_assert(sizeof(DiskRecord) + MAX_MUTEX_NAME + MAX_MSG_SIZE == WAL_MAX_RECORD,
+               "record header size");
+_Static_assert(sizeof(SnapshotHeader) == WAL_SNAPSHOT_HEADER, "snapshot header size");
+
+static int dir_fd = -1;                 // -1 = no files: records only go to the tap
+static wal_dump_fn dump_state = NULL;
+static _Atomic(wal_tap_fn) tap = NULL;
+static _Atomic bool enabled = false;
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// wal_lock guards the batch and everything the log and snapshot threads hand over
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t snapshot_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t synced_wake = PTHREAD_COND_INITIALIZER;     // synced_lsn advanced
+static Buffer batch;                    // Records not yet taken by the log thread
+static uint64_t next_lsn = 1;
+static WalWaiter* waiters = NULL;
+static int waiter_count = 0;
+static int gather_until = 0;            // Waiters the log thread is gathering for, 0 = none
+static uint32_t segment_seq = 0;        // Segment the log thread writes to
+static bool rotate_requested = false;
+static bool snapshot_requested = false;
+static bool snapshot_running = false;
+
+static _Atomic uint64_t appended_lsn = 0;
+static _Atomic uint64_t synced_lsn = 0;            // On disk
+static _Atomic uint64_t replica_lsn = UINT64_MAX;  // Acknowledged by a backup (see wal.h)
+
+// Log thread only
+static int log_fd = -1;
+static uint64_t segment_bytes = 0;
+static int last_round = 0;              // Waiters released by the previous sync
+static uint64_t last_sync_ns = 0;
+
+// Set when a record did not fit into memory; per thread, as replication takes
+// snapshots of its own
+static _Thread_local bool snapshot_incomplete = false;
+
+static pthread_t log_tid;
+static pthread_t snapshot_tid;
+
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+
+static uint32_t crc32(const uint8_t* p, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    pthread_once(&crc_once, crc_init);  // Backups decode without opening a log
+    while (n--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+
+// Encode r into out (WAL_MAX_RECORD bytes) and return its size
+static size_t encode(uint8_t* out, const WalRecord* r) {
+    DiskRecord d = {0};
+    d.name_len = strnlen(r->name, MAX_MUTEX_NAME - 1);
+    d.message_len = strnlen(r->message, MAX_MSG_SIZE - 1);
+    d.size = sizeof(d) + d.name_len + d.message_len;
+    d.type = r->type;
+    d.flags = r->flags;
+    d.lsn = r->lsn;
+    d.seq = r->seq;
+    d.time = r->time;
+    d.pid = r->pid;
+
+    memcpy(out, &d, sizeof(d));
+    memcpy(out + sizeof(d), r->name, d.name_len);
+    memcpy(out + sizeof(d) + d.name_len, r->message, d.message_len);
+
+    d.checksum = crc32(out + sizeof(d.checksum), d.size - sizeof(d.checksum));
+    memcpy(out, &d.checksum, sizeof(d.checksum));
+    return d.size;
+}
+
+
+size_t wal_decode(const uint8_t* p, size_t avail, WalRecord* r, char* name, char* message) {
+    DiskRecord d;
+    if (avail < sizeof(d)) return 0;
+    memcpy(&d, p, sizeof(d));
+
+    if (d.size > avail || d.size != sizeof(d) + d.name_len + d.message_len) return 0;
+    if (d.name_len == 0 || d.name_len >= MAX_MUTEX_NAME || d.message_len >= MAX_MSG_SIZE) return 0;
+    if (crc32(p + sizeof(d.checksum), d.size - sizeof(d.checksum)) != d.checksum) return 0;
+
+    memcpy(name, p + sizeof(d), d.name_len);
+    name[d.name_len] = '\0';
+    memcpy(message, p + sizeof(d) + d.name_len, d.message_len);
+    message[d.message_len] = '\0';
+
+    r->lsn = d.lsn;
+    r->type = d.type;
+    r->flags = d.flags;
+    r->seq = d.seq;
+    r->pid = d.pid;
+    r->time = d.time;
+    r->name = name;
+    r->message = message;
+    return d.size;
+}
+
+
+// A failed log write or sync cannot be retried safely (the kernel may have dropped the
+// dirty pages): stop before any change that is not on disk gets acknowledged
+static void log_failed(const char* what) {
+    atomic_store(&enabled, false);  // wal_flush must not wait for the log on the way out
+    perror(what);
+    fprintf(stderr, "Write-ahead log failed, stopping the server\n");
+    exit(EXIT_FAILURE);
+}
+
+
+static int write_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static void segment_name(char* out, size_t size, uint32_t seq) {
+    snprintf(out, size, "mutex-%08u.wal", seq);
+}
+
+
+// Create segment seq and make its directory entry durable, -1 on failure
+static int open_segment(uint32_t seq) {
+    char name[32];
+    segment_name(name, sizeof(name), seq);
+
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (fsync(dir_fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int compare_seq(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+// Sequence numbers of the segments in the log directory, ascending (*seqs is malloc'd).
+// Returns how many, -1 on failure.
+static int list_segments(uint32_t** seqs) {
+    int fd = dup(dir_fd);
+    DIR* d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (d == NULL) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    rewinddir(d);
+
+    int count = 0, cap = 0;
+    *seqs = NULL;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        uint32_t seq;
+        int end = 0;
+        if (sscanf(e->d_name, "mutex-%8u.wal%n", &seq, &end) != 1 || end == 0 ||
+            e->d_name[end] != '\0') {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t* grown = realloc(*seqs, cap * sizeof(uint32_t));
+            if (!grown) {
+                closedir(d);
+                return -1;
+            }
+            *seqs = grown;
+        }
+        (*seqs)[count++] = seq;
+    }
+    closedir(d);
+
+    qsort(*seqs, count, sizeof(uint32_t), compare_seq);
+    return count;
+}
+
+
+// Map a file of the log directory read-only. Returns NULL for an empty file (errno 0)
+// or one that cannot be read (errno set, ENOENT if there is none).
+static const uint8_t* map_file(const char* name, size_t* size) {
+    *size = 0;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void* p = NULL;
+    if (fstat(fd, &st) == 0) {
+        errno = 0;
+        if (st.st_size > 0) {
+            p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                p = NULL;
+            } else {
+                *size = st.st_size;
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return p;
+}
+
+
+size_t wal_snapshot_size(const uint8_t* header) {
+    SnapshotHeader h;
+    memcpy(&h, header, sizeof(h));
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION) return 0;
+    return sizeof(h) + h.size;
+}
+
+
+int wal_load_snapshot(const uint8_t* data, size_t size, wal_apply_fn apply, uint64_t* lsn) {
+    SnapshotHeader h;
+    int count = 0;
+    bool valid = size >= sizeof(h) && wal_snapshot_size(data) == size;
+    if (valid) memcpy(&h, data, sizeof(h));
+
+    char name[MAX_MUTEX_NAME], message[MAX_MSG_SIZE];
+    for (size_t off = sizeof(h); valid && off < size; count++) {
+        WalRecord r;
+        size_t n = wal_decode(data + off, size - off, &r, name, message);
+        if (n == 0) valid = false;
+        else apply(&r);
+        off += n;
+    }
+
+    if (!valid) {
+        errno = EBADMSG;
+        return -1;
+    }
+    *lsn = h.lsn;
+    return count;
+}
+
+
+// Replay the snapshot file: every record must be intact. Returns the records applied,
+// 0 without a snapshot, -1 if it is corrupt.
+static int replay_snapshot(wal_apply_fn apply, uint64_t* lsn) {
+    size_t size;
+    const uint8_t* p = map_file(SNAPSHOT_FILE, &size);
+    if (p == NULL) return (errno == 0 || errno == ENOENT) ? 0 : -1;
+
+    int count = wal_load_snapshot(p, size, apply, lsn);
+    int saved = errno;
+    munmap((void*)p, size);
+    errno = saved;
+    return count;
+}
+
+
+// Replay the records of segment seq that are newer than `after`. A torn or corrupt
+// record ends the segment: it is the tail of a batch being written when the server
+// stopped, and was never acknowledged. Returns the records applied, -1 on failure.
+static int replay_segment(uint32_t seq, uint64_t after, wal_apply_fn apply, uint64_t* last) {
+    char file[32];
+    segment_name(file, sizeof(file), seq);
+
+    size_t size;
+    const uint8_t* p = map_file(file, &size);
+    if (p == NULL) return (errno == 0 || errno == ENOENT) ? 0 : -1;
+
+    int count = 0;
+    size_t off = 0;
+    char name[MAX_MUTEX_NAME], message[MAX_MSG_SIZE];
+    while (off < size) {
+        WalRecord r;
+        size_t n = wal_decode(p + off, size - off, &r, name, message);
+        if (n == 0) {
+            fprintf(stderr, "Write-ahead log: %s ends with %zu unreadable bytes, ignored\n",
+                    file, size - off);
+            break;
+        }
+        if (r.lsn > after) {
+            apply(&r);
+            count++;
+        }
+        if (r.lsn > *last) *last = r.lsn;
+        off += n;
+    }
+    munmap((void*)p, size);
+    return count;
+}
+
+
+int wal_snapshot(Buffer* out, uint64_t lsn) {
+    SnapshotHeader h = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, lsn, 0 };
+    size_t start = out->len;
+
+    snapshot_incomplete = buf_append(out, &h, sizeof(h)) < 0;
+    if (!snapshot_incomplete) dump_state(out);
+    if (snapshot_incomplete) {
+        errno = ENOMEM;
+        return -1;
+    }
+    h.size = out->len - start - sizeof(h);
+    memcpy(out->data + start, &h, sizeof(h));
+    return 0;
+}
+
+
+// Write a snapshot of the state as of log position lsn and make it the current one
+static int write_snapshot(uint64_t lsn) {
+    Buffer snap = {0};
+    if (wal_snapshot(&snap, lsn) < 0) {
+        buf_free(&snap);
+        return -1;
+    }
+
+    // Written aside, then renamed over the old one once it is on disk
+    int fd = openat(dir_fd, SNAPSHOT_TEMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0) {
+        if (write_all(fd, snap.data, snap.len) == 0 && fsync(fd) == 0 &&
+            renameat(dir_fd, SNAPSHOT_TEMP, dir_fd, SNAPSHOT_FILE) == 0 && fsync(dir_fd) == 0) {
+            rc = 0;
+        }
+        close(fd);
+    }
+    buf_free(&snap);
+    return rc;
+}
+
+
+// Delete the segments before seq (the current snapshot covers them)
+static void delete_segments(uint32_t seq) {
+    uint32_t* seqs;
+    int count = list_segments(&seqs);
+
+    for (int i = 0; i < count && seqs[i] < seq; i++) {
+        char name[32];
+        segment_name(name, sizeof(name), seqs[i]);
+        unlinkat(dir_fd, name, 0);
+    }
+    free(seqs);
+}
+
+
+// Clients answered by the last sync typically send their next change right away. Give
+// them a moment (up to half a sync) to join this batch rather than syncing for the first
+// record alone and making the rest wait a whole sync more. Caller holds wal_lock.
+static void gather_batch() {
+    if (last_round < 2 || dir_fd < 0) return;
+
+    uint64_t delay = last_sync_ns / 2;
+    if (delay > MAX_COMMIT_DELAY_NS) delay = MAX_COMMIT_DELAY_NS;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += delay;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    gather_until = last_round;
+    while (waiter_count < gather_until && !rotate_requested) {
+        if (pthread_cond_timedwait(&log_wake, &wal_lock, &deadline) != 0) break;
+    }
+    gather_until = 0;
+}
+
+
+static uint64_t committed_lsn() {
+    uint64_t synced = atomic_load(&synced_lsn);
+    uint64_t replica = atomic_load(&replica_lsn);
+    return synced < replica ? synced : replica;
+}
+
+
+// Unlink the waiters whose records are committed now. Caller holds wal_lock.
+static WalWaiter* take_committed(int* count) {
+    uint64_t end = committed_lsn();
+    WalWaiter* ready = NULL;
+
+    *count = 0;
+    for (WalWaiter** link = &waiters; *link != NULL; ) {
+        WalWaiter* w = *link;
+        if (w->lsn <= end) {
+            *link = w->next;
+            w->next = ready;
+            ready = w;
+            waiter_count--;
+            (*count)++;
+        } else {
+            link = &w->next;
+        }
+    }
+    return ready;
+}
+
+
+static void run_waiters(WalWaiter* ready) {
+    while (ready != NULL) {
+        WalWaiter* next = ready->next;
+        ready->done(ready);
+        ready = next;
+    }
+}
+
+
+// Group commit: write everything appended since the last round with one write() and
+// one fdatasync(), then tell the waiters whose records are now on disk. The batch goes
+// to the tap (replication) first, so backups work on it while the disk syncs.
+static void* log_thread(void* arg) {
+    (void)arg;
+    Buffer out = {0};
+
+    while (1) {
+        pthread_mutex_lock(&wal_lock);
+        while (batch.len == 0 && !rotate_requested) pthread_cond_wait(&log_wake, &wal_lock);
+        gather_batch();
+
+        // Take the batch, leaving the emptied buffer of the previous round in its place
+        Buffer taken = batch;
+        batch = out;
+        out = taken;
+        uint64_t end = next_lsn - 1;
+
+        // A snapshot starts: this batch and later ones go to a new segment. Earlier
+        // segments hold nothing newer than the position the snapshot started at.
+        bool rotate = rotate_requested;
+        rotate_requested = false;
+        if (rotate) segment_seq++;
+        uint32_t seq = segment_seq;
+        pthread_mutex_unlock(&wal_lock);
+
+        wal_tap_fn send = atomic_load(&tap);
+        if (send != NULL && out.len > 0) send(out.data, out.len);
+
+        if (rotate) {
+            close(log_fd);
+            log_fd = open_segment(seq);
+            if (log_fd < 0) log_failed("write-ahead log segment");
+            segment_bytes = 0;
+        }
+        if (out.len > 0 && dir_fd >= 0) {
+            uint64_t start = monotonic_ns();
+            if (write_all(log_fd, out.data, out.len) < 0) log_failed("write-ahead log write");
+            if (fdatasync(log_fd) < 0) log_failed("write-ahead log sync");
+            last_sync_ns = monotonic_ns() - start;
+            segment_bytes += out.len;
+        }
+        buf_consume(&out, out.len);
+
+        pthread_mutex_lock(&wal_lock);
+        if (dir_fd >= 0) {
+            atomic_store(&synced_lsn, end);
+            pthread_cond_broadcast(&synced_wake);
+        }
+        WalWaiter* ready = take_committed(&last_round);
+
+        if (segment_bytes >= WAL_SNAPSHOT_BYTES && !snapshot_running && !snapshot_requested) {
+            snapshot_requested = true;
+            pthread_cond_signal(&snapshot_wake);
+        }
+        pthread_mutex_unlock(&wal_lock);
+
+        run_waiters(ready);
+    }
+    return NULL;
+}
+
+
+static void* snapshot_thread(void* arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&wal_lock);
+        while (!snapshot_requested) pthread_cond_wait(&snapshot_wake, &wal_lock);
+        snapshot_requested = false;
+        snapshot_running = true;
+
+        // Everything up to lsn is in the registry already: the snapshot contains it
+        uint64_t lsn = next_lsn - 1;
+        uint32_t first_kept = segment_seq + 1;
+        rotate_requested = true;
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&wal_lock);
+
+        // On failure the segments stay, so nothing is lost; the next one retries
+        if (write_snapshot(lsn) == 0) delete_segments(first_kept);
+        else perror("write-ahead log snapshot");
+
+        pthread_mutex_lock(&wal_lock);
+        snapshot_running = false;
+        pthread_mutex_unlock(&wal_lock);
+    }
+    return NULL;
+}
+
+
+int wal_open(const char* dir, wal_apply_fn apply, wal_dump_fn dump) {
+    dump_state = dump;
+
+    if (dir == NULL) {
+        if (pthread_create(&log_tid, NULL, log_thread, NULL) != 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        atomic_store(&enabled, true);
+        return 0;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+
+    // The snapshot, then the segments in order, skipping what the snapshot contains
+    uint64_t snapshot_lsn = 0;
+    int replayed = replay_snapshot(apply, &snapshot_lsn);
+    if (replayed < 0) return -1;
+
+    uint32_t* seqs;
+    int count = list_segments(&seqs);
+    if (count < 0) return -1;
+
+    uint64_t last = snapshot_lsn;
+    int from_log = 0;
+    for (int i = 0; i < count; i++) {
+        int n = replay_segment(seqs[i], snapshot_lsn, apply, &last);
+        if (n < 0) {
+            free(seqs);
+            return -1;
+        }
+        from_log += n;
+    }
+
+    // Never append to an old segment: it may end with a torn record
+    segment_seq = count > 0 ? seqs[count - 1] + 1 : 1;
+    free(seqs);
+    log_fd = open_segment(segment_seq);
+    if (log_fd < 0) return -1;
+
+    next_lsn = last + 1;
+    atomic_store(&appended_lsn, last);
+    atomic_store(&synced_lsn, last);
+
+    if (pthread_create(&log_tid, NULL, log_thread, NULL) != 0 ||
+        pthread_create(&snapshot_tid, NULL, snapshot_thread, NULL) != 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    atomic_store(&enabled, true);
+
+    // Fold the replayed log into a new snapshot, so the next start reads less
+    if (from_log > 0) {
+        pthread_mutex_lock(&wal_lock);
+        snapshot_requested = true;
+        pthread_cond_signal(&snapshot_wake);
+        pthread_mutex_unlock(&wal_lock);
+    }
+    return replayed + from_log;
+}
+
+
+bool wal_enabled() {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+
+uint64_t wal_append(WalRecord* r) {
+    uint8_t record[WAL_MAX_RECORD];
+
+    pthread_mutex_lock(&wal_lock);
+    r->lsn = next_lsn++;
+    size_t size = encode(record, r);
+    if (batch.len == 0) pthread_cond_signal(&log_wake);
+    if (buf_append(&batch, record, size) < 0) log_failed("write-ahead log batch");
+    atomic_store(&appended_lsn, r->lsn);
+    if (dir_fd < 0) atomic_store(&synced_lsn, r->lsn);  // Nothing to wait for but backups
+    pthread_mutex_unlock(&wal_lock);
+
+    return r->lsn;
+}
+
+
+uint64_t wal_last_lsn() {
+    return atomic_load(&appended_lsn);
+}
+
+
+void wal_flush() {
+    if (!wal_enabled()) return;
+
+    pthread_mutex_lock(&wal_lock);
+    uint64_t end = next_lsn - 1;
+    while (dir_fd >= 0 && wal_enabled() && atomic_load(&synced_lsn) < end) {
+        pthread_cond_wait(&synced_wake, &wal_lock);
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+bool wal_durable(uint64_t lsn) {
+    return committed_lsn() >= lsn;
+}
+
+
+void wal_wait(WalWaiter* w, uint64_t lsn) {
+    w->lsn = lsn;
+
+    pthread_mutex_lock(&wal_lock);
+    if (committed_lsn() < lsn) {
+        w->next = waiters;
+        waiters = w;
+        if (++waiter_count == gather_until) pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&wal_lock);
+        return;
+    }
+    pthread_mutex_unlock(&wal_lock);
+
+    w->done(w);
+}
+
+
+void wal_snapshot_add(Buffer* snapshot, const WalRecord* r) {
+    uint8_t record[WAL_MAX_RECORD];
+    size_t size = encode(record, r);
+    if (buf_append(snapshot, record, size) < 0) snapshot_incomplete = true;
+}
+
+
+void wal_set_tap(wal_tap_fn fn) {
+    atomic_store(&tap, fn);
+}
+
+
+void wal_set_replica_lsn(uint64_t lsn) {
+    int count;
+
+    pthread_mutex_lock(&wal_lock);
+    atomic_store(&replica_lsn, lsn);
+    WalWaiter* ready = take_committed(&count);
+    pthread_mutex_unlock(&wal_lock);
+
+    run_waiters(ready);
+}
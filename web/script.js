@@ -4,31 +4,93 @@ let clients = {};
 let mutexes = [];
 let activeMessages = [];
 let lastMessages = {};
+let renderPending = false;
+let generation = null;   // Registry generation of the last /mutexes answer
 
 // Initialize the application
 function init() {
     console.log("Initializing Mutex Monitor...");
-    updateData();
-    setInterval(updateData, 1000);
+    if (window.EventSource) {
+        subscribe();
+    } else {
+        updateData();
+        setInterval(updateData, 1000);
+    }
     window.addEventListener('resize', updateAllPositions);
 }
 
+// Follow the server's event stream (it starts with the full list and reconnects by itself)
+function subscribe() {
+    const events = new EventSource(`http://localhost:${SERVER_PORT + 1}/events`);
+    events.onmessage = (e) => {
+        applyEvent(JSON.parse(e.data));
+        scheduleRender();
+    };
+    events.onerror = () => {
+        console.error('Event stream interrupted, reconnecting...');
+    };
+}
+
+// Apply one pushed event to the mutex list
+function applyEvent(event) {
+    if (event.type === 'snapshot') {
+        // Messages sent before we connected are not animated
+        event.mutexes.forEach(mutex => {
+            lastMessages[mutex.name] = mutex.message_seq;
+        });
+        mutexes = event.mutexes;
+        return;
+    }
+
+    const mutex = event.mutex;
+    const index = mutexes.findIndex(m => m.name === mutex.name);
+    if (event.type === 'delete') {
+        if (index >= 0) mutexes.splice(index, 1);
+        delete lastMessages[mutex.name];
+        return;
+    }
+    if (index >= 0) {
+        mutexes[index] = mutex;
+    } else {
+        mutexes.push(mutex);
+    }
+
+    if (event.type === 'send') {
+        lastMessages[mutex.name] = mutex.message_seq;
+        updateClients();  // The arrow starts at the sender's element
+        showMessageAnimation(event.pid, mutex.last_message);
+    }
+}
+
+// Redraw at most once per frame, however many events arrive
+function scheduleRender() {
+    if (renderPending) return;
+    renderPending = true;
+    requestAnimationFrame(() => {
+        renderPending = false;
+        updateClients();
+        updateMutexList();
+    });
+}
+
 // Update all locations
 function updateAllPositions() {
     updateArrowPositions();
 }
 
-// Update data from server
+// Poll the whole list from the server (browsers without EventSource)
 function updateData() {
     // backend: 8080
     // frontend: 8081
-    fetch(`http://localhost:${SERVER_PORT + 1}/mutexes`)
+    const since = generation !== null ? `?since=${generation}` : '';
+    fetch(`http://localhost:${SERVER_PORT + 1}/mutexes${since}`)
         .then(response => {
             if (!response.ok) throw new Error('Network response was not ok');
             return response.json();
         })
         .then(data => {
-            processMutexData(data.mutexes);
+            generation = data.generation;
+            processMutexData(data.full ? data.mutexes : mergeChanges(data));
             updateClients();
             updateMutexList();
         })
@@ -38,14 +100,22 @@ function updateData() {
 }
 
 
+// Apply a /mutexes?since= answer to the current list
+function mergeChanges(data) {
+    const byName = new Map(mutexes.map(m => [m.name, m]));
+    data.deleted.forEach(name => byName.delete(name));
+    data.mutexes.forEach(m => byName.set(m.name, m));
+    return Array.from(byName.values());
+}
+
+
 // Handling mutex data
 function processMutexData(newMutexes) {
     newMutexes.forEach(mutex => {
-        if (mutex.last_message && mutex.last_message !== '' && 
-            (!lastMessages[mutex.name] || lastMessages[mutex.name] !== mutex.last_message)) {
-            
+        // Sequence numbers tell repeated texts apart
+        if (mutex.message_seq > (lastMessages[mutex.name] || 0)) {
             showMessageAnimation(mutex.owner, mutex.last_message);
-            lastMessages[mutex.name] = mutex.last_message;
+            lastMessages[mutex.name] = mutex.message_seq;
         }
     });
     mutexes = newMutexes;
@@ -104,7 +174,7 @@ function updateMutexList() {
                 <div>Owner: ${mutex.owner > 0 ? 'PID ' + mutex.owner : 'None'}</div>
             </div>
             <div class="mutex-status ${mutex.locked ? 'status-locked' : 'status-unlocked'}">
-                ${mutex.locked ? 'LOCKED' : 'UNLOCKED'}
+                ${!mutex.locked ? 'UNLOCKED' : (mutex.mode === 'shared' ? `SHARED (${mutex.readers})` : 'LOCKED')}
             </div>
         `;
         container.appendChild(item);